@@ -0,0 +1,186 @@
+#include "bitmap.h"
+
+void Block_Bitmap::reset(int n)
+{
+	nblocks = n;
+	nfree = n;
+	hint = 0;
+	low = 0;
+	words.assign((n + 63) / 64, 0);
+
+	// Os bits além do último bloco ficam marcados como em uso para que a
+	// busca nunca os devolva
+	if(n % 64) {
+		words.back() = ~0ULL << (n % 64);
+	}
+}
+
+bool Block_Bitmap::test(int blocknum)
+{
+	return (words[blocknum / 64] >> (blocknum % 64)) & 1;
+}
+
+void Block_Bitmap::set(int blocknum)
+{
+	uint64_t bit = 1ULL << (blocknum % 64);
+
+	if(!(words[blocknum / 64] & bit)) {
+		words[blocknum / 64] |= bit;
+		nfree--;
+	}
+}
+
+void Block_Bitmap::clear(int blocknum)
+{
+	uint64_t bit = 1ULL << (blocknum % 64);
+
+	if(words[blocknum / 64] & bit) {
+		words[blocknum / 64] &= ~bit;
+		nfree++;
+	}
+	if(blocknum < low) 
+		low = blocknum;
+}
+
+void Block_Bitmap::merge(const Block_Bitmap &other)
+{
+	nfree = 0;
+	for(size_t w = 0; w < words.size(); w++) {
+		words[w] |= other.words[w];
+		nfree += 64 - __builtin_popcountll(words[w]);
+	}
+}
+
+int Block_Bitmap::allocate_first()
+{
+	int blocknum = find_free(low);
+	if(blocknum < 0) 
+		return -1;
+
+	set(blocknum);
+	low = blocknum + 1;
+	return blocknum;
+}
+
+int Block_Bitmap::allocate_run(int wanted, int *count)
+{
+	*count = 0;
+	if(nfree == 0) 
+		return -1;
+
+	// Percorre os trechos livres a partir da dica, dando a volta no disco,
+	// até achar um trecho de wanted blocos ou examinar RUN_SEARCH_LIMIT trechos
+	int best = -1, best_length = 0;
+	int from = hint;
+	bool wrapped = false;
+
+	for(int examined = 0; examined < RUN_SEARCH_LIMIT && best_length < wanted; examined++) {
+		int start = find_free(from);
+		if(start < 0 || (wrapped && start >= hint)) {
+			if(wrapped || hint == 0) 
+				break;
+			wrapped = true;
+			from = 0;
+			continue;
+		}
+
+		int length = free_run(start, wanted);
+		if(length > best_length) {
+			best = start;
+			best_length = length;
+		}
+		from = start + length;
+	}
+
+	if(best < 0) 
+		return -1;
+
+	for(int b = best; b < best + best_length; b++) {
+		set(b);
+	}
+	hint = best + best_length < nblocks ? best + best_length : 0;
+
+	*count = best_length;
+	return best;
+}
+
+// Tamanho do trecho livre que começa em blocknum, limitado a limit. Os bits
+// em uso de cada palavra acham o fim do trecho pelos zeros à direita.
+int Block_Bitmap::free_run(int blocknum, int limit)
+{
+	int length = 0;
+
+	while(length < limit) {
+		int b = blocknum + length;
+		if(b >= nblocks) 
+			break;
+
+		uint64_t used = words[b / 64] >> (b % 64);
+		if(used) {
+			length += __builtin_ctzll(used);
+			break;
+		}
+		length += 64 - b % 64;
+	}
+
+	return length < limit ? length : limit;
+}
+
+// Primeiro bloco livre a partir de from, ou -1. Cada palavra com algum bit
+// zero tem o bloco livre achado direto pelo número de zeros à direita.
+int Block_Bitmap::find_free(int from)
+{
+	if(from >= nblocks) 
+		return -1;
+
+	size_t w = from / 64;
+	uint64_t available = ~words[w] & (~0ULL << (from % 64));
+
+	while(!available) {
+		if(++w == words.size()) 
+			return -1;
+		available = ~words[w];
+	}
+
+	return w * 64 + __builtin_ctzll(available);
+}
+
+void Block_Bitmap::load(const vector<uint64_t> &image)
+{
+	for(size_t w = 0; w < words.size(); w++) {
+		words[w] = w < image.size() ? image[w] : 0;
+	}
+	if(nblocks % 64) {
+		words.back() |= ~0ULL << (nblocks % 64);
+	}
+
+	// Recalcula o contador de livres a partir das palavras carregadas
+	nfree = 0;
+	for(uint64_t word : words) {
+		nfree += 64 - __builtin_popcountll(word);
+	}
+	hint = 0;
+	low = 0;
+}
+
+void Block_Bitmap::store(vector<uint64_t> &image)
+{
+	for(size_t w = 0; w < image.size(); w++) {
+		image[w] = w < words.size() ? words[w] : 0;
+	}
+}
+
+int Block_Bitmap::size()
+{
+	return nblocks;
+}
+
+int Block_Bitmap::free_count()
+{
+	return nfree;
+}
+
+int Block_Bitmap::used_count()
+{
+	return nblocks - nfree;
+}
@@ -0,0 +1,58 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// Mapa de blocos livres do sistema de arquivos: um bit por bloco (1 = em
+// uso), agrupados em palavras de 64 bits. A busca por blocos livres examina
+// uma palavra por vez e recomeça de onde parou a última alocação (next-fit).
+class Block_Bitmap
+{
+public:
+    // Redimensiona para nblocks blocos, todos livres
+    void reset(int nblocks);
+
+    bool test(int blocknum);
+    void set(int blocknum);
+    void clear(int blocknum);
+
+    // Marca como em uso todos os blocos em uso em other (mesmo tamanho)
+    void merge(const Block_Bitmap &other);
+
+    // Ocupa um trecho contíguo de até wanted blocos livres e retorna o
+    // primeiro (-1 se cheio); count recebe o tamanho do trecho. Sem um
+    // trecho do tamanho pedido, fica com o maior encontrado.
+    int allocate_run(int wanted, int *count);
+    // Ocupa e retorna o menor bloco livre, ou -1 se cheio. Os bits abaixo
+    // de low estão todos em uso, então a busca não reexamina o começo.
+    int allocate_first();
+
+    int size();
+    int free_count();
+    int used_count();
+
+    // Cópia das palavras do mapa de/para a área persistida no disco, que
+    // pode ser maior que o mapa (o excesso é ignorado ou zerado)
+    void load(const vector<uint64_t> &image);
+    void store(vector<uint64_t> &image);
+
+private:
+    int find_free(int from);
+    int free_run(int blocknum, int limit);
+
+    // Trechos livres examinados por allocate_run antes de desistir de
+    // achar um do tamanho pedido
+    static const int RUN_SEARCH_LIMIT = 1024;
+
+private:
+    vector<uint64_t> words;
+    int nblocks = 0;
+    int nfree = 0;
+    int hint = 0;   // bloco onde começa a próxima busca
+    int low = 0;    // nenhum bloco abaixo deste está livre
+};
+
+#endif
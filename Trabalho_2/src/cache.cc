@@ -0,0 +1,242 @@
+#include "cache.h"
+#include <string.h>
+#include <algorithm>
+
+Block_Cache::Block_Cache(int n, int bsize, cache_policy p, write_back_fn wb)
+{
+	block_size = bsize;
+	replacement = p;
+	write_back = wb;
+
+	entries.resize(n);
+	storage.resize((size_t) n * block_size);
+	for(int i = n - 1; i >= 0; i--) {
+		free_slots.push_back(i);
+	}
+}
+
+int Block_Cache::capacity()
+{
+	return entries.size();
+}
+
+Block_Cache::cache_policy Block_Cache::policy()
+{
+	return replacement;
+}
+
+long Block_Cache::hits()
+{
+	lock_guard<mutex> guard(lock);
+	return nhits;
+}
+
+long Block_Cache::misses()
+{
+	lock_guard<mutex> guard(lock);
+	return nmisses;
+}
+
+long Block_Cache::write_backs()
+{
+	lock_guard<mutex> guard(lock);
+	return nwrite_backs;
+}
+
+const char *Block_Cache::policy_name(cache_policy p)
+{
+	return p == POLICY_LRU ? "lru" : "clock";
+}
+
+bool Block_Cache::parse_policy(const char *name, cache_policy *p)
+{
+	if(!strcmp(name, "lru")) {
+		*p = POLICY_LRU;
+	} else if(!strcmp(name, "clock")) {
+		*p = POLICY_CLOCK;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+char *Block_Cache::slot_data(int slot)
+{
+	return storage.data() + (size_t) slot * block_size;
+}
+
+bool Block_Cache::read(int blocknum, char *data, bool will_fill)
+{
+	lock_guard<mutex> guard(lock);
+
+	auto found = slots.find(blocknum);
+	if(found == slots.end()) {
+		nmisses++;
+		if(will_fill) pending[blocknum].readers++;
+		return false;
+	}
+
+	nhits++;
+	touch(found->second);
+	memcpy(data, slot_data(found->second), block_size);
+	return true;
+}
+
+// A leitura do backend é feita sem o lock; uma escrita concorrente pode ter
+// chegado antes (e até ter sido despejada), então só a cópia do cache vale
+void Block_Cache::fill(int blocknum, char *data)
+{
+	lock_guard<mutex> guard(lock);
+
+	bool stale = false;
+	auto waiting = pending.find(blocknum);
+	if(waiting != pending.end()) {
+		stale = waiting->second.stale;
+		if(--waiting->second.readers == 0) 
+			pending.erase(waiting);
+	}
+
+	auto found = slots.find(blocknum);
+	if(found != slots.end()) {
+		memcpy(data, slot_data(found->second), block_size);
+		return;
+	}
+	if(stale) 
+		return;
+
+	int slot = slot_for(blocknum);
+	memcpy(slot_data(slot), data, block_size);
+}
+
+void Block_Cache::write(int blocknum, const char *data)
+{
+	lock_guard<mutex> guard(lock);
+
+	auto found = slots.find(blocknum);
+	int slot = (found != slots.end()) ? found->second : slot_for(blocknum);
+
+	touch(slot);
+	entries[slot].dirty = true;
+	memcpy(slot_data(slot), data, block_size);
+	mark_stale(blocknum);
+}
+
+void Block_Cache::update(int blocknum, const char *data)
+{
+	lock_guard<mutex> guard(lock);
+
+	auto found = slots.find(blocknum);
+	if(found != slots.end()) {
+		memcpy(slot_data(found->second), data, block_size);
+	}
+	mark_stale(blocknum);
+}
+
+bool Block_Cache::contains(int blocknum)
+{
+	lock_guard<mutex> guard(lock);
+	return slots.count(blocknum) > 0;
+}
+
+void Block_Cache::invalidate(int blocknum)
+{
+	lock_guard<mutex> guard(lock);
+	mark_stale(blocknum);
+
+	auto found = slots.find(blocknum);
+	if(found == slots.end()) 
+		return;
+
+	int slot = found->second;
+	if(replacement == POLICY_LRU) {
+		lru.erase(entries[slot].lru_position);
+	}
+	entries[slot] = cache_entry();
+	slots.erase(found);
+	free_slots.push_back(slot);
+}
+
+void Block_Cache::flush()
+{
+	lock_guard<mutex> guard(lock);
+
+	vector<pair<int, const char *>> dirty;
+	for(size_t slot = 0; slot < entries.size(); slot++) {
+		if(entries[slot].dirty) {
+			dirty.push_back(make_pair(entries[slot].blocknum, (const char *) slot_data(slot)));
+			entries[slot].dirty = false;
+		}
+	}
+
+	// em ordem de bloco, para que os vizinhos virem uma só escrita
+	sort(dirty.begin(), dirty.end());
+	nwrite_backs += dirty.size();
+	if(!dirty.empty()) 
+		write_back(dirty);
+}
+
+// Reserva uma posição para o bloco, despejando outro se necessário;
+// chamada com o lock
+int Block_Cache::slot_for(int blocknum)
+{
+	int slot;
+	if(!free_slots.empty()) {
+		slot = free_slots.back();
+		free_slots.pop_back();
+	} else {
+		slot = evict();
+	}
+
+	entries[slot].blocknum = blocknum;
+	entries[slot].dirty = false;
+	entries[slot].referenced = true;
+	if(replacement == POLICY_LRU) {
+		lru.push_front(slot);
+		entries[slot].lru_position = lru.begin();
+	}
+	slots[blocknum] = slot;
+	return slot;
+}
+
+// Escolhe a vítima pela política configurada e grava o bloco se estiver sujo
+int Block_Cache::evict()
+{
+	int slot;
+	if(replacement == POLICY_LRU) {
+		slot = lru.back();
+		lru.pop_back();
+	} else {
+		while(entries[clock_hand].referenced) {
+			entries[clock_hand].referenced = false;
+			clock_hand = (clock_hand + 1) % entries.size();
+		}
+		slot = clock_hand;
+		clock_hand = (clock_hand + 1) % entries.size();
+	}
+
+	cache_entry &victim = entries[slot];
+	if(victim.dirty) {
+		nwrite_backs++;
+		write_back(vector<pair<int, const char *>>(1, make_pair(victim.blocknum, (const char *) slot_data(slot))));
+	}
+	slots.erase(victim.blocknum);
+	victim = cache_entry();
+	return slot;
+}
+
+void Block_Cache::touch(int slot)
+{
+	if(replacement == POLICY_LRU) {
+		lru.splice(lru.begin(), lru, entries[slot].lru_position);
+	} else {
+		entries[slot].referenced = true;
+	}
+}
+
+// Chamada com o lock
+void Block_Cache::mark_stale(int blocknum)
+{
+	auto waiting = pending.find(blocknum);
+	if(waiting != pending.end()) 
+		waiting->second.stale = true;
+}
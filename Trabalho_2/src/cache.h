@@ -0,0 +1,97 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+using namespace std;
+
+// Cache de blocos com escrita adiada (write-back) usado pelo Disk entre o
+// sistema de arquivos e o backend de E/S. Blocos escritos ficam sujos na
+// memória até serem despejados ou até flush().
+class Block_Cache
+{
+public:
+    enum cache_policy { POLICY_LRU, POLICY_CLOCK };
+
+    // write_back grava no backend uma lista de blocos sujos
+    typedef function<void(const vector<pair<int, const char *>> &)> write_back_fn;
+
+    Block_Cache(int capacity, int block_size, cache_policy policy, write_back_fn write_back);
+
+    // Copia o bloco para data se ele estiver no cache. Com will_fill, uma
+    // falta fica registrada até o fill() correspondente
+    bool read(int blocknum, char *data, bool will_fill = false);
+    // Insere um bloco recém-lido do backend. Se o bloco foi escrito desde a
+    // falta, a leitura está velha: não é inserida, e data recebe a cópia do
+    // cache, se houver
+    void fill(int blocknum, char *data);
+    // Escreve o bloco no cache e o marca como sujo
+    void write(int blocknum, const char *data);
+    // Atualiza a cópia do bloco, se houver, sem mudar seu estado
+    void update(int blocknum, const char *data);
+    // O bloco está no cache
+    bool contains(int blocknum);
+    // Descarta o bloco sem gravá-lo
+    void invalidate(int blocknum);
+    // Grava todos os blocos sujos, em ordem de bloco
+    void flush();
+
+    int capacity();
+    cache_policy policy();
+    long hits();
+    long misses();
+    long write_backs();
+
+    static const char *policy_name(cache_policy policy);
+    static bool parse_policy(const char *name, cache_policy *policy);
+
+private:
+    class cache_entry {
+        public:
+            int blocknum = -1;
+            bool dirty = false;
+            bool referenced = false;
+            list<int>::iterator lru_position;
+    };
+
+    // Faltas de um bloco ainda lendo do backend; stale se ele foi escrito
+    // ou descartado nesse meio tempo
+    class pending_read {
+        public:
+            int readers = 0;
+            bool stale = false;
+    };
+
+    int slot_for(int blocknum);
+    int evict();
+    void touch(int slot);
+    void mark_stale(int blocknum);
+    char *slot_data(int slot);
+
+private:
+    int block_size;
+    cache_policy replacement;
+    write_back_fn write_back;
+
+    vector<cache_entry> entries;
+    vector<char> storage;
+    unordered_map<int, int> slots;  // bloco -> posição em entries
+    vector<int> free_slots;
+    unordered_map<int, pending_read> pending;
+
+    list<int> lru;                  // mais recente no início (POLICY_LRU)
+    int clock_hand = 0;             // ponteiro do relógio (POLICY_CLOCK)
+
+    long nhits = 0;
+    long nmisses = 0;
+    long nwrite_backs = 0;
+
+    mutex lock;
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include "dedup.h"
+#include <algorithm>
+#include <string.h>
+
+void Dedup_Index::reset(int nblocks)
+{
+	int size = 0;
+	if(nblocks > 0) {
+		size = WAYS;
+		while(size < 2 * nblocks && size < MAX_ENTRIES) size *= 2;
+	}
+
+	entries.assign(size, index_entry());
+	block_hashes.assign(max(nblocks, 0), 0);
+	occupied = 0;
+}
+
+// Primeira entrada do conjunto do hash
+Dedup_Index::index_entry *Dedup_Index::find_set(uint64_t hash)
+{
+	return &entries[(hash * WAYS) & (entries.size() - 1)];
+}
+
+int Dedup_Index::lookup(uint64_t hash)
+{
+	if(entries.empty()) return 0;
+
+	index_entry *set = find_set(hash);
+	for(int way = 0; way < WAYS; way++) {
+		if(set[way].hash == hash && matches(set[way].blocknum, hash)) {
+			return set[way].blocknum;
+		}
+	}
+	return 0;
+}
+
+bool Dedup_Index::matches(int blocknum, uint64_t hash)
+{
+	return blocknum > 0 && blocknum < (int) block_hashes.size() && block_hashes[blocknum] == hash;
+}
+
+// Ocupa uma entrada livre ou que não vale mais; com o conjunto todo
+// válido, os bits altos do hash escolhem a vítima
+void Dedup_Index::insert(uint64_t hash, int blocknum)
+{
+	if(entries.empty() || blocknum <= 0 || blocknum >= (int) block_hashes.size()) return;
+	block_hashes[blocknum] = hash;
+
+	index_entry *set = find_set(hash);
+	index_entry *victim = nullptr;
+	for(int way = 0; way < WAYS; way++) {
+		if(set[way].hash == hash && set[way].blocknum == blocknum) return;
+		if(!victim && (!set[way].blocknum || !matches(set[way].blocknum, set[way].hash))) {
+			victim = &set[way];
+		}
+	}
+	if(!victim) victim = &set[hash >> 62];
+
+	if(!victim->blocknum) occupied++;
+	victim->hash = hash;
+	victim->blocknum = blocknum;
+}
+
+// A entrada da tabela fica para trás e é descartada no lookup (o bloco não
+// tem mais aquele hash) ou substituída no próximo insert
+void Dedup_Index::forget(int blocknum)
+{
+	if(blocknum > 0 && blocknum < (int) block_hashes.size()) {
+		block_hashes[blocknum] = 0;
+	}
+}
+
+uint64_t Dedup_Index::hash(const char *data, int size)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+	for(int i = 0; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		h = (h ^ word) * 0xff51afd7ed558ccdULL;
+		h = (h << 31) | (h >> 33);
+	}
+	h ^= h >> 29;
+	return h ? h : 1;
+}
+
+void Dedup_Index::record_hash(long nanoseconds)
+{
+	hashed++;
+	hash_nanoseconds += nanoseconds;
+}
+
+void Dedup_Index::record_match(bool equal)
+{
+	(equal ? duplicates : mismatches)++;
+}
+
+void Dedup_Index::reset_stats()
+{
+	hashed = 0;
+	hash_nanoseconds = 0;
+	duplicates = 0;
+	mismatches = 0;
+}
+
+int Dedup_Index::capacity()
+{
+	return entries.size();
+}
+
+int Dedup_Index::used()
+{
+	return occupied;
+}
+
+size_t Dedup_Index::memory()
+{
+	return entries.size() * sizeof(index_entry) + block_hashes.size() * sizeof(uint64_t);
+}
+
+// Resumo legível: ocupação do índice, custo do hash e espaço poupado
+void Dedup_Index::print(ostream &out, int block_size)
+{
+	out << "index: " << used() << "/" << capacity() << " entries, " << memory() << " bytes\n";
+
+	out << "hashed blocks: " << hashed;
+	if(hashed) {
+		out << ", " << hash_nanoseconds / hashed << " ns/block";
+		if(hash_nanoseconds) {
+			out << ", " << (double) hashed * block_size * 1000 / hash_nanoseconds << " MB/s";
+		}
+	}
+	out << "\n";
+
+	out << "duplicate blocks: " << duplicates << " (" << (long long) duplicates * block_size << " bytes saved)\n";
+	out << "hash matches with different contents: " << mismatches << "\n";
+}
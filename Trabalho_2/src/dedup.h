@@ -0,0 +1,71 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+using namespace std;
+
+// Índice de deduplicação de blocos por conteúdo: uma tabela de tamanho fixo
+// de hash para bloco, em conjuntos de WAYS entradas escolhidos pelo hash, e,
+// por bloco do disco, o hash do conteúdo conhecido pelo índice (0 = não
+// conhecido). Uma entrada só vale enquanto o bloco mantiver aquele hash, então
+// quem libera ou altera um bloco o esquece. Com o conjunto cheio de entradas
+// válidas, uma delas é substituída: o índice perde candidatos, mas nunca
+// cresce. Não é sincronizado; o sistema de arquivos o protege com a trava
+// dos mapas.
+class Dedup_Index
+{
+public:
+    // Entradas da tabela: a potência de 2 que cobre duas vezes o disco, até
+    // este limite
+    static const int MAX_ENTRIES = 1 << 18;
+    static const int WAYS = 4;
+
+    // Redimensiona para um disco de nblocks blocos, com o índice vazio
+    void reset(int nblocks);
+
+    // Bloco cujo conteúdo tinha o hash dado (0 se nenhum)
+    int lookup(uint64_t hash);
+    // O bloco ainda tem o conteúdo com o hash dado
+    bool matches(int blocknum, uint64_t hash);
+    void insert(uint64_t hash, int blocknum);
+    void forget(int blocknum);
+
+    // Hash não criptográfico de um bloco: um passo de multiplicação e
+    // rotação por palavra de 64 bits, nunca 0
+    static uint64_t hash(const char *data, int size);
+
+    // Contadores: blocos com hash calculado e o tempo gasto, candidatos
+    // encontrados, os que eram iguais (blocos poupados) e os que não eram
+    void record_hash(long nanoseconds);
+    void record_match(bool equal);
+    void reset_stats();
+
+    int capacity();
+    int used();
+    size_t memory();
+    void print(ostream &out, int block_size);
+
+private:
+    class index_entry {
+        public:
+            uint64_t hash = 0;
+            int blocknum = 0;
+    };
+
+    index_entry *find_set(uint64_t hash);
+
+    vector<index_entry> entries;
+    vector<uint64_t> block_hashes;
+    int occupied = 0;
+
+    atomic<long> hashed{0};
+    atomic<long> hash_nanoseconds{0};
+    atomic<long> duplicates{0};
+    atomic<long> mismatches{0};
+};
+
+#endif
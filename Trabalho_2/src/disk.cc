@@ -1,8 +1,36 @@
 #include "disk.h"
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <chrono>
 
-Disk::Disk(const char *filename, int n)
+static long now_ns()
 {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Disk::Disk(const char *filename, int n, disk_mode m)
+{
+	fd = -1;
+	mapping = 0;
+	cache = 0;
+	stats = new Disk_Stats(n);
+	model = 0;
+	active_model = 0;
+	ring = 0;
+	stopping = false;
+	in_flight = 0;
+	mode = m;
+	nblocks = 0;
+	nreads = 0;
+	nwrites = 0;
+	nholes = 0;
+
 	diskfile = fopen(filename, "r+");
 
 	if(!diskfile) 
@@ -13,11 +41,156 @@ Disk::Disk(const char *filename, int n)
 		return;
 	}
 
-	ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+	fd = fileno(diskfile);
+
+	// ftruncate só ajusta o tamanho: a imagem nova é toda um buraco e o
+	// espaço no hospedeiro é alocado conforme os blocos são escritos
+	ftruncate(fd, (off_t) n * DISK_BLOCK_SIZE);
 
     nblocks = n;
-    nreads = 0;
-    nwrites = 0;
+	scan_holes();
+
+	if(mode == MODE_MMAP && !map_image()) {
+		cout << "WARNING: couldn't map " << filename << ", using pread\n";
+		mode = MODE_PREAD;
+	}
+}
+
+// Monta o mapa de buracos da imagem com SEEK_DATA/SEEK_HOLE. Se o
+// sistema de arquivos do hospedeiro não souber responder, todos os
+// blocos são tratados como dados.
+void Disk::scan_holes()
+{
+	holes.assign(nblocks, 1);
+
+	off_t end = (off_t) nblocks * DISK_BLOCK_SIZE;
+	off_t pos = 0;
+
+	while(pos < end) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if(data < 0) {
+			if(errno != ENXIO) holes.assign(nblocks, 0);
+			break;
+		}
+
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if(hole < 0) hole = end;
+
+		for(off_t b = data / DISK_BLOCK_SIZE; b < (hole + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE && b < nblocks; b++) {
+			holes[b] = 0;
+		}
+		pos = hole;
+	}
+}
+
+// Um bloco em cache pode ainda não ter chegado à imagem, mas já tem dados
+bool Disk::is_hole(int blocknum)
+{
+	if(cache && cache->contains(blocknum)) 
+		return false;
+	return hole_at(blocknum);
+}
+
+bool Disk::hole_at(int blocknum)
+{
+	lock_guard<mutex> guard(holes_lock);
+	return blocknum >= 0 && blocknum < (int) holes.size() && holes[blocknum];
+}
+
+void Disk::mark_written(int blocknum, int count)
+{
+	lock_guard<mutex> guard(holes_lock);
+	for(int b = blocknum; b < blocknum + count && b < (int) holes.size(); b++) {
+		holes[b] = 0;
+	}
+}
+
+// Devolve ao hospedeiro o espaço dos blocos liberados. Eles passam a ser
+// lidos como zeros; a cópia em cache, suja ou não, é descartada.
+void Disk::discard(int blocknum, int count)
+{
+	if(count <= 0) 
+		return;
+	sanity_check(blocknum, this);
+	sanity_check(blocknum + count - 1, this);
+
+	if(cache) {
+		for(int b = blocknum; b < blocknum + count; b++) {
+			cache->invalidate(b);
+		}
+	}
+
+	if(mode == MODE_STDIO) {
+		lock_guard<mutex> guard(stdio_lock);
+		fflush(diskfile);
+	}
+
+	if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) blocknum * DISK_BLOCK_SIZE, (off_t) count * DISK_BLOCK_SIZE) < 0) 
+		return;
+
+	lock_guard<mutex> guard(holes_lock);
+	for(int b = blocknum; b < blocknum + count; b++) {
+		holes[b] = 1;
+	}
+}
+
+Disk::~Disk()
+{
+	stop_async();
+	delete cache;
+	delete stats;
+	delete model;
+}
+
+Disk_Stats *Disk::get_stats()
+{
+	return stats;
+}
+
+void Disk::enable_model(const Disk_Model::model_params &params)
+{
+	lock_guard<mutex> guard(model_lock);
+
+	if(model) {
+		model->configure(params);
+	} else {
+		model = new Disk_Model(params);
+	}
+	active_model = model;
+}
+
+void Disk::disable_model()
+{
+	lock_guard<mutex> guard(model_lock);
+	active_model = 0;
+}
+
+Disk_Model *Disk::get_model()
+{
+	return active_model;
+}
+
+// Threads de E/S leem o ponteiro publicado uma vez só; o modelo nunca é
+// liberado antes do disco, então continuar a cobrança é seguro mesmo que
+// ele seja desligado no meio
+void Disk::charge_model(int blocknum, int count)
+{
+	Disk_Model *current = active_model;
+	if(current) 
+		current->charge(blocknum, count);
+}
+
+bool Disk::map_image()
+{
+	if(nblocks <= 0) 
+		return false;
+
+	void *addr = mmap(0, (size_t) nblocks * DISK_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) 
+		return false;
+
+	mapping = (char *) addr;
+	return true;
 }
 
 int Disk::size()
@@ -25,6 +198,35 @@ int Disk::size()
 	return nblocks;
 }
 
+Disk::disk_mode Disk::get_mode()
+{
+	return mode;
+}
+
+const char *Disk::mode_name(disk_mode m)
+{
+	switch(m) {
+		case MODE_STDIO: return "stdio";
+		case MODE_PREAD: return "pread";
+		case MODE_MMAP: return "mmap";
+	}
+	return "unknown";
+}
+
+bool Disk::parse_mode(const char *name, disk_mode *m)
+{
+	if(!strcmp(name, "stdio")) {
+		*m = MODE_STDIO;
+	} else if(!strcmp(name, "pread")) {
+		*m = MODE_PREAD;
+	} else if(!strcmp(name, "mmap")) {
+		*m = MODE_MMAP;
+	} else {
+		return false;
+	}
+	return true;
+}
+
 void Disk::sanity_check( int blocknum, const void *data )
 {
 	if(blocknum < 0) {
@@ -46,39 +248,680 @@ void Disk::sanity_check( int blocknum, const void *data )
 void Disk::read(int blocknum, char *data )
 {
 	sanity_check(blocknum, data);
+	long start = now_ns();
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+	if(!cache || !cache->read(blocknum, data, true)) {
+		physical_readv(vector<pair<int, char *>>(1, make_pair(blocknum, data)));
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
-		cout << "ERROR: couldn't access simulated disk\n";
-		abort();
+		if(cache) cache->fill(blocknum, data);
 	}
+
+	stats->record_access(false, blocknum, 1);
+	stats->record_latency(false, now_ns() - start);
 }
 
 void Disk::write(int blocknum, const char *data)
 {
 	sanity_check(blocknum, data);
+	long start = now_ns();
 
-    fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
-
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
+	if(cache) {
+		cache->write(blocknum, data);
+	} else {
+		struct iovec iov = { (void *) data, DISK_BLOCK_SIZE };
+		run_io(blocknum, &iov, 1, true);
 		nwrites++;
+	}
+
+	stats->record_access(true, blocknum, 1);
+	stats->record_latency(true, now_ns() - start);
+}
+
+void Disk::readv(int blocknum, int count, char *data)
+{
+	vector<pair<int, char *>> blocks;
+	for(int i = 0; i < count; i++) {
+		blocks.push_back(make_pair(blocknum + i, data + (size_t) i * DISK_BLOCK_SIZE));
+	}
+	readv(blocks);
+}
+
+void Disk::writev(int blocknum, int count, const char *data)
+{
+	vector<pair<int, const char *>> blocks;
+	for(int i = 0; i < count; i++) {
+		blocks.push_back(make_pair(blocknum + i, data + (size_t) i * DISK_BLOCK_SIZE));
+	}
+	writev(blocks);
+}
+
+// Com cache, só os blocos ausentes vão ao backend (ainda agrupados)
+void Disk::readv(const vector<pair<int, char *>> &blocks)
+{
+	if(blocks.empty()) 
+		return;
+	long start = now_ns();
+
+	if(!cache) {
+		physical_readv(blocks);
 	} else {
-		cout << "ERROR: couldn't access simulated disk\n";
-		abort();
+		vector<pair<int, char *>> misses;
+		for(const auto &block : blocks) {
+			sanity_check(block.first, block.second);
+			if(!cache->read(block.first, block.second, true)) {
+				misses.push_back(block);
+			}
+		}
+
+		physical_readv(misses);
+		for(const auto &block : misses) {
+			cache->fill(block.first, block.second);
+		}
+	}
+
+	for(const auto &block : blocks) {
+		stats->record_access(false, block.first, 1);
+	}
+	stats->record_latency(false, now_ns() - start);
+}
+
+void Disk::writev(const vector<pair<int, const char *>> &blocks)
+{
+	if(blocks.empty()) 
+		return;
+	long start = now_ns();
+
+	if(!cache) {
+		physical_writev(blocks);
+	} else {
+		for(const auto &block : blocks) {
+			sanity_check(block.first, block.second);
+			cache->write(block.first, block.second);
+		}
+	}
+
+	for(const auto &block : blocks) {
+		stats->record_access(true, block.first, 1);
+	}
+	stats->record_latency(true, now_ns() - start);
+}
+
+// Agrupa os pares (bloco, buffer) consecutivos no disco em uma única
+// requisição vetorizada. A ordem da lista é mantida; só blocos vizinhos
+// que aparecem em sequência na lista são unidos.
+void Disk::physical_readv(const vector<pair<int, char *>> &all_blocks)
+{
+	// Blocos que são buracos na imagem são lidos como zeros sem ir ao backend
+	vector<pair<int, char *>> blocks;
+	for(const auto &block : all_blocks) {
+		sanity_check(block.first, block.second);
+		if(hole_at(block.first)) {
+			memset(block.second, 0, DISK_BLOCK_SIZE);
+			nholes++;
+		} else {
+			blocks.push_back(block);
+		}
+	}
+
+	size_t first = 0;
+
+	while(first < blocks.size()) {
+		size_t last = merge_run(blocks, first);
+		vector<struct iovec> iov(last - first);
+
+		for(size_t i = first; i < last; i++) {
+			sanity_check(blocks[i].first, blocks[i].second);
+			iov[i - first].iov_base = blocks[i].second;
+			iov[i - first].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		run_io(blocks[first].first, iov.data(), iov.size(), false);
+		nreads += iov.size();
+		first = last;
+	}
+}
+
+void Disk::physical_writev(const vector<pair<int, const char *>> &blocks)
+{
+	size_t first = 0;
+
+	while(first < blocks.size()) {
+		size_t last = merge_run(blocks, first);
+		vector<struct iovec> iov(last - first);
+
+		for(size_t i = first; i < last; i++) {
+			sanity_check(blocks[i].first, blocks[i].second);
+			iov[i - first].iov_base = (void *) blocks[i].second;
+			iov[i - first].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		run_io(blocks[first].first, iov.data(), iov.size(), true);
+		nwrites += iov.size();
+		first = last;
+	}
+}
+
+// Coloca um cache de blocos na frente do backend. No modo mapeado a
+// própria page cache já cumpre esse papel e view() precisa enxergar os
+// dados mais recentes, então o cache não é usado.
+bool Disk::enable_cache(int capacity, Block_Cache::cache_policy policy)
+{
+	if(cache || capacity <= 0 || mode == MODE_MMAP) 
+		return false;
+
+	cache = new Block_Cache(capacity, DISK_BLOCK_SIZE, policy, [this](const vector<pair<int, const char *>> &blocks) {
+		physical_writev(blocks);
+	});
+	return true;
+}
+
+// Grava no backend todos os blocos sujos do cache e os torna duráveis: o
+// mapeamento com msync, o arquivo com fdatasync (antes, no modo stdio, o
+// buffer do FILE vai para o descritor)
+void Disk::sync()
+{
+	if(cache) 
+		cache->flush();
+	if(mapping) {
+		msync(mapping, (size_t) nblocks * DISK_BLOCK_SIZE, MS_SYNC);
+		return;
+	}
+
+	if(mode == MODE_STDIO) {
+		lock_guard<mutex> guard(stdio_lock);
+		fflush(diskfile);
+	}
+	fdatasync(fd);
+}
+
+// Retorna o fim (exclusivo) da sequência de blocos contíguos que começa
+// em first, limitada a IOV_MAX entradas por chamada.
+template <typename T>
+size_t Disk::merge_run(const vector<pair<int, T>> &blocks, size_t first)
+{
+	size_t last = first + 1;
+
+	while(last < blocks.size() && last - first < IOV_MAX &&
+	      blocks[last].first == blocks[last - 1].first + 1) {
+		last++;
+	}
+	return last;
+}
+
+// Acesso sem cópia: o bloco é lido no próprio mapeamento. Conta como
+// uma leitura para manter as estatísticas comparáveis entre os modos.
+const char *Disk::view(int blocknum)
+{
+	if(mode != MODE_MMAP) 
+		return 0;
+
+	sanity_check(blocknum, mapping);
+	nreads++;
+	charge_model(blocknum, 1);
+	stats->record_access(false, blocknum, 1);
+
+	return mapping + (size_t) blocknum * DISK_BLOCK_SIZE;
+}
+
+// Transfere a sequência de buffers iov para os blocos consecutivos a
+// partir de blocknum, usando o backend escolhido na construção.
+void Disk::run_io(int blocknum, struct iovec *iov, int iovcnt, bool is_write)
+{
+	off_t pos = (off_t) blocknum * DISK_BLOCK_SIZE;
+
+	size_t bytes = 0;
+	for(int i = 0; i < iovcnt; i++) bytes += iov[i].iov_len;
+
+	charge_model(blocknum, bytes / DISK_BLOCK_SIZE);
+	if(is_write) 
+		mark_written(blocknum, bytes / DISK_BLOCK_SIZE);
+
+	if(mode == MODE_MMAP) {
+		for(int i = 0; i < iovcnt; i++) {
+			if(is_write) {
+				memcpy(mapping + pos, iov[i].iov_base, iov[i].iov_len);
+			} else {
+				memcpy(iov[i].iov_base, mapping + pos, iov[i].iov_len);
+			}
+			pos += iov[i].iov_len;
+		}
+	} else if(mode == MODE_STDIO) {
+		stdio_io(pos, iov, iovcnt, is_write);
+	} else {
+		positional_io(pos, iov, iovcnt, is_write);
+	}
+}
+
+void Disk::stdio_io(off_t pos, struct iovec *iov, int iovcnt, bool is_write)
+{
+	lock_guard<mutex> guard(stdio_lock);
+
+    fseek(diskfile, pos, SEEK_SET);
+
+	for(int i = 0; i < iovcnt; i++) {
+		size_t done;
+		if(is_write) {
+			done = fwrite(iov[i].iov_base, iov[i].iov_len, 1, diskfile);
+		} else {
+			done = fread(iov[i].iov_base, iov[i].iov_len, 1, diskfile);
+		}
+		if(done != 1) {
+			cout << "ERROR: couldn't access simulated disk\n";
+			abort();
+		}
+	}
+}
+
+// preadv/pwritev não usam a posição do descritor, então várias threads
+// podem acessar blocos diferentes ao mesmo tempo sem sincronização.
+// Os dados vão direto para os buffers do chamador. Transferências
+// parciais avançam sobre o vetor até completar todos os buffers.
+void Disk::positional_io(off_t pos, struct iovec *iov, int iovcnt, bool is_write)
+{
+	while(iovcnt > 0) {
+		ssize_t r = is_write ? pwritev(fd, iov, iovcnt, pos) : preadv(fd, iov, iovcnt, pos);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) {
+			cout << "ERROR: couldn't access simulated disk\n";
+			abort();
+		}
+		pos += r;
+
+		while(iovcnt > 0 && (size_t) r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + r;
+			iov->iov_len -= r;
+		}
 	}
-	
 }
 
 void Disk::close()
 {
+	stop_async();
+
 	if(diskfile) {
+		sync();
 		cout << nreads << " disk block reads\n";
 		cout << nwrites << " disk block writes\n";
+		if(nholes) {
+			cout << nholes << " hole block reads skipped\n";
+		}
+		if(cache) {
+			cout << cache->hits() << " cache hits\n";
+			cout << cache->misses() << " cache misses\n";
+		}
+		if(mapping) {
+			munmap(mapping, (size_t) nblocks * DISK_BLOCK_SIZE);
+			mapping = 0;
+		}
 		fclose(diskfile);
 		diskfile = 0;
+		fd = -1;
+	}
+}
+
+// ---------------------------------------------------------------------
+// E/S assíncrona
+//
+// Cada lote é dividido em trechos de blocos adjacentes (io_run). No modo
+// MODE_PREAD os trechos viram requisições IORING_OP_READV/WRITEV em um
+// io_uring e uma thread coleta as conclusões em lote; nos outros modos,
+// ou se o io_uring não puder ser criado, um pool de threads executa os
+// trechos com run_io().
+// ---------------------------------------------------------------------
+
+struct Disk::uring {
+	int fd;
+	unsigned capacity;         // máximo de trechos em andamento no kernel
+	unsigned active;           // trechos em andamento (protegido por queue_lock)
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	thread reaper;
+	thread::id reaper_id;
+};
+
+static const unsigned URING_ENTRIES = 64;
+
+void Disk::submit(const vector<io_request> &batch, function<void()> on_complete)
+{
+	if(batch.empty()) {
+		if(on_complete) on_complete();
+		return;
+	}
+
+	call_once(async_once, &Disk::start_async, this);
+
+	vector<io_run *> runs;
+	for(const io_request &request : batch) {
+		sanity_check(request.blocknum, request.data);
+
+		// Leituras presentes no cache são atendidas na hora; escritas
+		// também atualizam a cópia em cache para ela não ficar velha
+		if(cache) {
+			if(request.is_write) {
+				cache->update(request.blocknum, request.data);
+			} else if(cache->read(request.blocknum, request.data)) {
+				continue;
+			}
+		}
+		if(!request.is_write && hole_at(request.blocknum)) {
+			memset(request.data, 0, DISK_BLOCK_SIZE);
+			nholes++;
+			continue;
+		}
+
+		io_run *last = runs.empty() ? 0 : runs.back();
+		if(!last || last->is_write != request.is_write || last->iov.size() >= IOV_MAX ||
+		   last->blocknum + (int) last->iov.size() != request.blocknum) {
+			last = new io_run;
+			last->submitted = now_ns();
+			last->blocknum = request.blocknum;
+			last->is_write = request.is_write;
+			runs.push_back(last);
+		}
+
+		struct iovec iov = { request.data, DISK_BLOCK_SIZE };
+		last->iov.push_back(iov);
+		stats->record_access(request.is_write, request.blocknum, 1);
+
+		if(request.is_write) {
+			nwrites++;
+		} else {
+			nreads++;
+		}
+	}
+
+	if(runs.empty()) {
+		if(on_complete) on_complete();
+		return;
+	}
+
+	shared_ptr<io_batch> shared = make_shared<io_batch>();
+	shared->pending = runs.size();
+	shared->on_complete = on_complete;
+
+	for(io_run *run : runs) {
+		run->batch = shared;
+		queue_run(run);
+	}
+}
+
+void Disk::drain()
+{
+	unique_lock<mutex> guard(queue_lock);
+	drained.wait(guard, [this] { return in_flight == 0; });
+}
+
+const char *Disk::async_engine()
+{
+	if(ring) return "io_uring";
+	if(!workers.empty()) return "threads";
+	return "idle";
+}
+
+void Disk::start_async()
+{
+	if(mode == MODE_PREAD && uring_setup()) {
+		ring->reaper = thread(&Disk::uring_reap_loop, this);
+		ring->reaper_id = ring->reaper.get_id();
+		return;
+	}
+
+	unsigned nworkers = max(4u, thread::hardware_concurrency());
+	for(unsigned i = 0; i < nworkers; i++) {
+		workers.push_back(thread(&Disk::worker_loop, this));
 	}
 }
 
+void Disk::stop_async()
+{
+	if(!ring && workers.empty()) 
+		return;
+
+	drain();
+
+	{
+		lock_guard<mutex> guard(queue_lock);
+		stopping = true;
+		if(ring) uring_push(0); // requisição vazia que acorda a thread de coleta
+	}
+	queue_cond.notify_all();
+
+	for(thread &worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+
+	if(ring) {
+		ring->reaper.join();
+		munmap(ring->sqes, ring->sqes_size);
+		munmap(ring->sq_ptr, ring->sq_size);
+		if(ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+		::close(ring->fd);
+		delete ring;
+		ring = 0;
+	}
+}
+
+void Disk::queue_run(io_run *run)
+{
+	unique_lock<mutex> guard(queue_lock);
+	in_flight++;
+
+	if(!ring) {
+		queue.push_back(run);
+		queue_cond.notify_one();
+		return;
+	}
+
+	// A thread de coleta não pode esperar por espaço que só ela libera
+	// (acontece quando on_complete enfileira outro lote): executa na hora.
+	if(ring->active >= ring->capacity && this_thread::get_id() == ring->reaper_id) {
+		guard.unlock();
+		run_io(run->blocknum, run->iov.data(), run->iov.size(), run->is_write);
+		complete_run(run);
+		return;
+	}
+
+	queue_cond.wait(guard, [this] { return ring->active < ring->capacity; });
+	uring_push(run);
+}
+
+void Disk::complete_run(io_run *run)
+{
+	stats->record_latency(run->is_write, now_ns() - run->submitted);
+
+	if(run->batch->pending.fetch_sub(1) == 1 && run->batch->on_complete) {
+		run->batch->on_complete();
+	}
+	delete run;
+
+	lock_guard<mutex> guard(queue_lock);
+	if(--in_flight == 0) {
+		drained.notify_all();
+	}
+}
+
+// Cada thread retira vários trechos da fila de uma vez
+void Disk::worker_loop()
+{
+	unique_lock<mutex> guard(queue_lock);
+
+	while(1) {
+		queue_cond.wait(guard, [this] { return stopping || !queue.empty(); });
+		if(queue.empty()) 
+			return;
+
+		size_t take = queue.size() / workers.size() + 1;
+		vector<io_run *> batch;
+		while(!queue.empty() && batch.size() < take) {
+			batch.push_back(queue.front());
+			queue.pop_front();
+		}
+
+		guard.unlock();
+		for(io_run *run : batch) {
+			run_io(run->blocknum, run->iov.data(), run->iov.size(), run->is_write);
+			complete_run(run);
+		}
+		guard.lock();
+	}
+}
+
+bool Disk::uring_setup()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if(ring_fd < 0) 
+		return false;
+
+	uring *r = new uring;
+	r->fd = ring_fd;
+	r->active = 0;
+	r->capacity = params.sq_entries;
+	r->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	r->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single_mmap) {
+		r->sq_size = r->cq_size = max(r->sq_size, r->cq_size);
+	}
+
+	r->sq_ptr = mmap(0, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	r->cq_ptr = single_mmap ? r->sq_ptr : mmap(0, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+	if(r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+		if(sqes != MAP_FAILED) munmap(sqes, r->sqes_size);
+		if(r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+		if(r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_size);
+		::close(ring_fd);
+		delete r;
+		return false;
+	}
+
+	char *sq = (char *) r->sq_ptr;
+	char *cq = (char *) r->cq_ptr;
+	r->sq_head = (unsigned *) (sq + params.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + params.sq_off.array);
+	r->cq_head = (unsigned *) (cq + params.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	r->sqes = (struct io_uring_sqe *) sqes;
+
+	ring = r;
+	return true;
+}
+
+// Coloca o trecho no anel de submissão; chamada com queue_lock. Um
+// trecho nulo vira um IORING_OP_NOP usado para encerrar a coleta.
+void Disk::uring_push(io_run *run)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if(run) {
+		charge_model(run->blocknum, run->iov.size());
+		if(run->is_write) mark_written(run->blocknum, run->iov.size());
+		sqe->opcode = run->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long) run->iov.data();
+		sqe->len = run->iov.size();
+		sqe->off = (off_t) run->blocknum * DISK_BLOCK_SIZE;
+		ring->active++;
+	} else {
+		sqe->opcode = IORING_OP_NOP;
+	}
+	sqe->user_data = (unsigned long) run;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while(syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+		if(errno != EINTR && errno != EAGAIN) {
+			cout << "ERROR: couldn't submit to io_uring\n";
+			abort();
+		}
+	}
+}
+
+// Espera conclusões e trata todas as que estiverem disponíveis de uma vez
+void Disk::uring_reap_loop()
+{
+	bool done = false;
+
+	while(!done) {
+		if(syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			cout << "ERROR: couldn't wait on io_uring\n";
+			abort();
+		}
+
+		vector<pair<io_run *, int>> completed;
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for(; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			io_run *run = (io_run *) (unsigned long) cqe->user_data;
+			if(run) {
+				completed.push_back(make_pair(run, cqe->res));
+			} else {
+				done = true;
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		{
+			lock_guard<mutex> guard(queue_lock);
+			ring->active -= completed.size();
+		}
+		queue_cond.notify_all();
+
+		for(auto &entry : completed) {
+			io_run *run = entry.first;
+			int res = entry.second;
+
+			if(res < 0 && res != -EINTR && res != -EAGAIN) {
+				cout << "ERROR: couldn't access simulated disk\n";
+				abort();
+			}
+
+			// Transferência parcial: completa o restante de forma síncrona
+			size_t skip = res > 0 ? res : 0;
+			struct iovec *iov = run->iov.data();
+			int iovcnt = run->iov.size();
+			while(iovcnt > 0 && skip >= iov->iov_len) {
+				skip -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if(iovcnt > 0) {
+				iov->iov_base = (char *) iov->iov_base + skip;
+				iov->iov_len -= skip;
+				positional_io((off_t) run->blocknum * DISK_BLOCK_SIZE + (res > 0 ? res : 0), iov, iovcnt, run->is_write);
+			}
+
+			complete_run(run);
+		}
+	}
+}
@@ -1,9 +1,22 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "cache.h"
+#include "stats.h"
+#include "model.h"
 #include <fstream>
 #include <iostream>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <utility>
 
 using namespace std;
 
@@ -13,22 +26,154 @@ public:
     static const unsigned short int DISK_BLOCK_SIZE = 4096;
     static const unsigned int DISK_MAGIC = 0xdeadbeef;
 
-    Disk(const char *filename, int nblocks);
+    // Backend de E/S usado pelo disco, escolhido na construção.
+    // MODE_STDIO usa o FILE* com buffer (fseek + fread/fwrite);
+    // MODE_PREAD usa o descritor cru com pread/pwrite, sem cópia
+    // intermediária e sem posição compartilhada entre threads;
+    // MODE_MMAP mapeia a imagem inteira e permite acessar os blocos
+    // diretamente na memória através de view().
+    enum disk_mode { MODE_STDIO, MODE_PREAD, MODE_MMAP };
+
+    Disk(const char *filename, int nblocks, disk_mode mode = MODE_PREAD);
+    ~Disk();
 
     int size();
+    disk_mode get_mode();
     void read(int blocknum, char * data);
     void write(int blocknum, const char * data);
     void close();
 
+    // Cache de blocos opcional entre o sistema de arquivos e o backend;
+    // deve ser habilitado antes do primeiro acesso
+    bool enable_cache(int capacity, Block_Cache::cache_policy policy);
+    // Grava os blocos sujos do cache (e do mapeamento ou do buffer do
+    // stdio) na imagem e espera que ela chegue ao armazenamento do
+    // hospedeiro: as escritas anteriores ficam duráveis antes das seguintes
+    void sync();
+
+    // Libera no hospedeiro o espaço de count blocos (PUNCH_HOLE); depois
+    // disso eles são lidos como zeros sem acesso ao backend
+    void discard(int blocknum, int count = 1);
+    // O bloco nunca foi escrito ou foi descartado
+    bool is_hole(int blocknum);
+
+    // Instrumentação dos acessos lógicos (inclusive os atendidos pelo cache)
+    Disk_Stats *get_stats();
+
+    // Modelo de latência opcional, cobrado em cada acesso físico ao backend.
+    // Pode ser ligado e desligado com E/S em andamento; o modelo, uma vez
+    // criado, vive até o fim do disco
+    void enable_model(const Disk_Model::model_params &params);
+    void disable_model();
+    Disk_Model *get_model();
+
+    // Leitura/escrita de count blocos consecutivos a partir de blocknum,
+    // com uma única chamada ao backend.
+    void readv(int blocknum, int count, char *data);
+    void writev(int blocknum, int count, const char *data);
+
+    // Leitura/escrita de uma lista de pares (bloco, buffer); blocos
+    // adjacentes no disco são unidos em um único preadv/pwritev.
+    void readv(const vector<pair<int, char *>> &blocks);
+    void writev(const vector<pair<int, const char *>> &blocks);
+
+    // Requisição assíncrona de um bloco
+    struct io_request {
+        int blocknum;
+        char *data;
+        bool is_write;
+    };
+
+    // Enfileira um lote de requisições e retorna sem esperar. Blocos
+    // adjacentes do lote são unidos; on_complete é chamado em uma thread
+    // de E/S quando todo o lote terminar (ou na hora, se o lote for vazio).
+    // Usa io_uring no modo MODE_PREAD e um pool de threads nos demais
+    // modos ou quando o io_uring não está disponível.
+    void submit(const vector<io_request> &batch, function<void()> on_complete);
+    // Espera todas as requisições assíncronas pendentes
+    void drain();
+    const char *async_engine();
+
+    // Ponteiro direto para o bloco no mapeamento (somente MODE_MMAP).
+    // Retorna 0 nos outros modos; o chamador deve então usar read().
+    const char *view(int blocknum);
+
+    static const char *mode_name(disk_mode mode);
+    static bool parse_mode(const char *name, disk_mode *mode);
+
 private:
     void sanity_check(int blocknum, const void *data);
 
+    void scan_holes();
+    bool hole_at(int blocknum);
+    void mark_written(int blocknum, int count);
+    void physical_readv(const vector<pair<int, char *>> &blocks);
+    void physical_writev(const vector<pair<int, const char *>> &blocks);
+    void run_io(int blocknum, struct iovec *iov, int iovcnt, bool is_write);
+    void stdio_io(off_t pos, struct iovec *iov, int iovcnt, bool is_write);
+    void positional_io(off_t pos, struct iovec *iov, int iovcnt, bool is_write);
+
+    template <typename T>
+    static size_t merge_run(const vector<pair<int, T>> &blocks, size_t first);
+
+    // Trecho contíguo de um lote assíncrono
+    struct io_batch {
+        atomic<int> pending;
+        function<void()> on_complete;
+    };
+    struct io_run {
+        long submitted;
+        int blocknum;
+        bool is_write;
+        vector<struct iovec> iov;
+        shared_ptr<io_batch> batch;
+    };
+    struct uring;
+
+    void start_async();
+    void stop_async();
+    void queue_run(io_run *run);
+    void complete_run(io_run *run);
+    void worker_loop();
+    bool uring_setup();
+    void uring_push(io_run *run);
+    void uring_reap_loop();
+    bool map_image();
+    void charge_model(int blocknum, int count);
+
 private:
     FILE *diskfile;
+    int fd;
+    char *mapping;
+    Block_Cache *cache;
+    Disk_Stats *stats;
+    Disk_Model *model;
+    atomic<Disk_Model *> active_model;  // model quando ligado, senão 0
+    mutex model_lock;                   // serializa enable/disable_model
+    disk_mode mode;
     int nblocks;
-    int nreads;
-    int nwrites;
+    atomic<int> nreads;
+    atomic<int> nwrites;
+    atomic<long> nholes;
+
+    // blocos da imagem que são buracos (nunca escritos ou descartados)
+    vector<unsigned char> holes;
+    mutex holes_lock;
+
+    // o FILE* tem uma única posição; serializa fseek + fread/fwrite
+    mutex stdio_lock;
+
+    // estado da E/S assíncrona, criado no primeiro submit()
+    once_flag async_once;
+    uring *ring;
+    vector<thread> workers;
+    deque<io_run *> queue;
+    mutex queue_lock;
+    condition_variable queue_cond;
+    bool stopping;
+    int in_flight;
+    condition_variable drained;
 };
 
 
-#endif
\ No newline at end of file
+#endif
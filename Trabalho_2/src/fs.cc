@@ -2,10 +2,18 @@
 #include <math.h>
 #include <cstring> 
 #include <algorithm>
+#include <tuple>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <chrono>
 
 
 int INE5412_FS::fs_format()
 {
+    std::unique_lock<std::shared_mutex> guard(fs_lock);
+
     // Verifica se o disco está montado
     // Uma tentativa de formatar um disco montado deve falhar
     if (get_mounted()) {
@@ -13,34 +21,90 @@ int INE5412_FS::fs_format()
         return 0;
     }
 
-    // Lê o superbloco
     union fs_block superblock;
-    disk->read(0, superblock.data);
-
-    // Libera a tabela de inodes
-    for (int i = 0; i < superblock.super.ninodeblocks; i++) {
-        // Lê o bloco de inodes
-        union fs_block inode_block;
-        disk->read(i + 1, inode_block.data);
-
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            // Marca o inode como inválido
-            inode_block.inode[j].isvalid = 0;
-        }
-
-        // Escreve o bloco de inodes atualizado no disco
-        disk->write(i + 1, inode_block.data);
-    }
 
     // Calcula o número de blocos e reserva 10% para os inodes
     int total_blocks = disk->size();
     int inode_blocks = ceil(total_blocks * 0.1);
+    int bitmap_blocks = (total_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    int inode_map_blocks = (inode_blocks * INODES_PER_BLOCK + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    int ref_blocks = (total_blocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+    int refs_start = inode_blocks + bitmap_blocks + inode_map_blocks + 1;
+    int journal_start = refs_start + ref_blocks;
+
+    // O diário fica com 1/64 do disco, dentro dos limites, mas nunca com
+    // mais de um quarto dos blocos que sobram depois dos mapas. Num disco
+    // pequeno demais para o mínimo ele fica de fora e os metadados são
+    // gravados no lugar, como nas versões sem diário.
+    int journal_blocks = total_blocks / 64;
+    if (journal_blocks < JOURNAL_MIN_BLOCKS) {
+        journal_blocks = JOURNAL_MIN_BLOCKS;
+    }
+    if (journal_blocks > JOURNAL_MAX_BLOCKS) {
+        journal_blocks = JOURNAL_MAX_BLOCKS;
+    }
+    journal_blocks = min(journal_blocks, max(total_blocks - journal_start, 0) / 4);
+    if (journal_blocks < JOURNAL_MIN_BLOCKS) {
+        journal_blocks = 0;
+    }
+    int data_start = journal_start + journal_blocks;
+
+    // Os metadados não podem ocupar o disco inteiro
+    if (data_start >= total_blocks) {
+        cout << "ERROR: disk too small to format\n";
+        return 0;
+    }
 
-    // Configura os parâmetros do superbloco
+    // Configura os parâmetros do superbloco; o restante do bloco fica zerado
+    memset(superblock.data, 0, sizeof(superblock.data));
     superblock.super.magic = FS_MAGIC;
     superblock.super.nblocks = total_blocks;
     superblock.super.ninodeblocks = inode_blocks;
     superblock.super.ninodes = inode_blocks * INODES_PER_BLOCK;
+    superblock.super.version = FS_VERSION;
+    superblock.super.clean = 1;
+    superblock.super.nbitmapblocks = bitmap_blocks;
+    superblock.super.ninodemapblocks = inode_map_blocks;
+    superblock.super.njournalblocks = journal_blocks;
+    superblock.super.journalhead = 0;
+    superblock.super.journalsequence = 1;
+    superblock.super.nrefblocks = ref_blocks;
+
+    // O disco inteiro volta a ser um buraco na imagem; os blocos da nova
+    // tabela de inodes, do mapa de referências e do diário (onde blocos de
+    // uma formatação anterior poderiam passar por válidos) que não puderem
+    // ser descartados são zerados
+    disk->discard(1, total_blocks - 1);
+
+    std::vector<char> zeros(Disk::DISK_BLOCK_SIZE, 0);
+    std::vector<std::pair<int, const char *>> clears;
+    for (int i = 1; i < data_start; i++) {
+        bool cleared = i <= inode_blocks || i >= refs_start;
+        if (cleared && !disk->is_hole(i)) {
+            clears.push_back(std::make_pair(i, (const char *) zeros.data()));
+        }
+    }
+    disk->writev(clears);
+
+    // Grava o mapa de blocos com apenas os metadados ocupados
+    Block_Bitmap initial;
+    initial.reset(total_blocks);
+    for (int i = 0; i < data_start; i++) {
+        initial.set(i);
+    }
+
+    std::vector<uint64_t> image(bitmap_blocks * BITS_PER_BLOCK / 64);
+    initial.store(image);
+    disk->writev(inode_blocks + 1, bitmap_blocks, (const char *) image.data());
+
+    // E o mapa de inodes só com o inode 0, que não é usado
+    Block_Bitmap initial_inodes;
+    initial_inodes.reset(superblock.super.ninodes);
+    initial_inodes.set(0);
+
+    std::vector<uint64_t> inode_image(inode_map_blocks * BITS_PER_BLOCK / 64);
+    initial_inodes.store(inode_image);
+    disk->writev(inode_blocks + bitmap_blocks + 1, inode_map_blocks, (const char *) inode_image.data());
 
     // Escreve o superbloco atualizado no disco
     disk->write(0, superblock.data);
@@ -50,6 +114,9 @@ int INE5412_FS::fs_format()
 
 void INE5412_FS::fs_debug()
 {
+	// Exclusivo: a tabela e as árvores são lidas sem as travas de inode
+	std::unique_lock<std::shared_mutex> guard(fs_lock);
+
 	union fs_block block;
 	// ler o superbloco
 	disk->read(0, block.data);
@@ -59,57 +126,120 @@ void INE5412_FS::fs_debug()
  	cout << "    " << block.super.nblocks << " blocks\n";
 	cout << "    " << block.super.ninodeblocks << " inode blocks\n";
 	cout << "    " << block.super.ninodes << " inodes\n";
+	if (block.super.version >= 1) {
+		cout << "    version " << block.super.version << "\n";
+		cout << "    " << block.super.nbitmapblocks << " bitmap blocks\n";
+		if (block.super.version >= 3) {
+			cout << "    " << block.super.ninodemapblocks << " inode bitmap blocks\n";
+		}
+		if (block.super.version >= 7) {
+			cout << "    " << block.super.nrefblocks << " reference count blocks\n";
+		}
+		if (block.super.version >= 4) {
+			cout << "    " << block.super.njournalblocks << " journal blocks\n";
+		}
+		if (block.super.version >= 6 && block.super.rootinode) {
+			cout << "    root directory: inode " << block.super.rootinode << "\n";
+		}
+		cout << "    " << (block.super.clean ? "clean\n" : "not clean (mounted or not unmounted)\n");
+	}
 
-	union fs_block inode_block;
-
-	// percorre cada bloco de inode
-	for (int i = 0; i < block.super.ninodeblocks; i++) {
-		disk->read(i + 1, inode_block.data);
+	// Contadores dos mapas em memória, só com o disco montado
+	if (get_mounted()) {
+		cout << "    " << bitmap.used_count() << " blocks in use, " << bitmap.free_count() << " free\n";
+		cout << "    " << inode_map.used_count() - 1 << " inodes in use, " << inode_map.free_count() << " free\n";
+	}
 
-		// percorre cada inodo contido no bloco de inode
-		for (int j = 0; j < INODES_PER_BLOCK; j++) {
+	// Cada trabalhador formata um intervalo de blocos de inodes (lidos da
+	// tabela em memória, se montado); o texto é impresso na ordem dos blocos
+	bool from_table = get_mounted();
+	int version = block.super.version;
+	int inode_blocks = max(block.super.ninodeblocks, 0);
+	std::vector<std::string> output(inode_blocks);
+
+	for_each_range(inode_blocks, [&](int begin, int end) {
+		union fs_block inode_scratch;
+
+		// percorre cada bloco de inode do intervalo
+		for (int i = begin; i < end; i++) {
+			const union fs_block *inode_block = from_table ? inode_table_block(i) : block_view(i + 1, &inode_scratch);
+			std::ostringstream out;
+
+			// percorre cada inodo contido no bloco de inode
+			for (int j = 0; j < inodes_per_block(version); j++) {
+
+				// recuperar o inode
+				fs_inode inode;
+				inode_decode(inode_block, j, version, &inode);
+				if (inode.isvalid) { // verificar sua validade
+					int inode_number = (i * inodes_per_block(version)) + j; // calcular numero do inode
+					// printar infos básicas
+					out << "inode " << inode_number << ":\n";
+					out << "    " << "size: " << inode.size << " bytes\n";
+					if (inode.flags & INODE_DIRECTORY) {
+						out << "    " << "directory: " << inode.entries << " entries in " << inode.buckets << " buckets\n";
+					}
 
-			// recuperar o inode
-			fs_inode inode = inode_block.inode[j];
-			if (inode.isvalid) { // verificar sua validade
-				int inode_number = (i * INODES_PER_BLOCK) + j; // calcular numero do inode
-				// printar infos básicas
-				cout << "inode " << inode_number << ":\n";
-				cout << "    " << "size: " << inode.size << " bytes\n";
+					// arquivo guardado no próprio inode: não há blocos
+					if (inode.flags & INODE_INLINE) {
+						out << "    " << "inline data: " << inode.size << " bytes\n";
+						continue;
+					}
 
-				// percorrer os blocos diretos
-				cout << "    " << "direct blocks: "; 
-				for (int direct_block : inode.direct) {
-					if (direct_block) {
-						cout << direct_block << " ";
+					// percorrer os blocos diretos
+					out << "    " << "direct blocks: "; 
+					for (int direct_block : inode.direct) {
+						if (direct_block) {
+							out << direct_block << " ";
+						}
 					}
-				}
-				cout << "\n";
-
-				// verificar se existe bloco indireto
-				if (inode.indirect) {
-					cout << "    " << "indirect block: " << inode.indirect << "\n";
-
-					// recuperar o bloco indireto
-					union fs_block indirect_block;
-					disk->read(inode.indirect, indirect_block.data);
-					
-					// percorrer blocos indiretos
-					cout << "    " << "indirect data blocks: ";
-					for (int indirect_data_blocks : indirect_block.pointers) {
-						if (indirect_data_blocks) {
-							cout << indirect_data_blocks << " ";
+					out << "\n";
+
+					// para cada árvore de ponteiros existente, a raiz e os
+					// blocos de dados nas folhas
+					static const char *tree_names[INDIRECT_LEVELS] = {"indirect", "double indirect", "triple indirect"};
+					int roots[INDIRECT_LEVELS] = {inode.indirect, inode.dindirect, inode.tindirect};
+
+					for (int depth = 1; depth <= INDIRECT_LEVELS; depth++) {
+						if (roots[depth - 1]) {
+							out << "    " << tree_names[depth - 1] << " block: " << roots[depth - 1] << "\n";
+
+							out << "    " << tree_names[depth - 1] << " data blocks: ";
+							walk_tree(roots[depth - 1], depth, [&](int data_block, int level) {
+								if (level == 0) {
+									out << data_block << " ";
+								}
+							});
+							out << "\n";
 						}
 					}
-					cout << "\n";
 				}
 			}
+
+			output[i] = out.str();
 		}
+	});
+
+	for (const std::string &text : output) {
+		cout << text;
 	}
 }
 
 int INE5412_FS::fs_mount()
 {
+    // A thread de commit toma fs_lock; ela para antes e volta no fim se o
+    // disco continuar montado com diário
+    stop_committer();
+    std::unique_lock<std::shared_mutex> guard(fs_lock);
+
+    // Um disco já montado grava os metadados pendentes antes de reconstruir
+    // a tabela; o checkpoint também muda o começo do diário no superbloco
+    if (journal) {
+        checkpoint();
+    } else if (get_mounted()) {
+        flush_inodes();
+    }
+
     // Lê o superbloco para verificar se há um sistema de arquivos
     union fs_block superblock;
     disk->read(0, superblock.data);
@@ -117,163 +247,329 @@ int INE5412_FS::fs_mount()
     // Verifica se o sistema de arquivos é válido
     if (superblock.super.magic != FS_MAGIC) {
         cerr << "file system invalid, format disk...\n";
+        if (journal) {
+            start_committer();
+        }
         return 0;
     }
 
-    // construção do bitmap
-    int total_blocks = superblock.super.nblocks;
-    bitmap.resize(total_blocks, 0);
-    
-    // Ocupa o superbloco no bitmap
-    bitmap[0] = 1;
-
-    // Processa os blocos de inodes
-    for (int i = 0; i < superblock.super.ninodeblocks; i++) {
-        // Ocupa os blocos de inodes no bitmap
-        bitmap[i + 1] = 1;
-
-        // Lê o bloco de inodes
-        union fs_block inode_block;
-        disk->read(i + 1, inode_block.data);
-
-        // Processa os inodes do bloco
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            fs_inode &inode = inode_block.inode[j];
+    // Só as versões conhecidas do formato podem ser montadas
+    if (superblock.super.version > FS_VERSION) {
+        cerr << "unsupported file system version " << superblock.super.version << "\n";
+        if (journal) {
+            start_committer();
+        }
+        return 0;
+    }
 
-            // Verifica os blocos ocupados por inodes
-            if (inode.isvalid) {
-                // Marca os blocos diretos como ocupados no bitmap
-                for (int direct_block : inode.direct) {
-                    if (direct_block != 0) {
-                        bitmap[direct_block] = 1;
-                    }
-                }
+    // Mantém o superbloco em memória enquanto o disco estiver montado
+    this->superblock = superblock.super;
+
+    // A tabela de inodes começa vazia; cada bloco é lido no primeiro acesso
+    readahead.clear();
+    inode_table.clear();
+    inode_table.resize(superblock.super.ninodeblocks);
+    inode_dirty.assign(superblock.super.ninodeblocks, false);
+    metadata_blocks.clear();
+    uncommitted_frees.clear();
+    recent_unshares.clear();
+    uncommitted_unshares.clear();
+    refcounts.clear();
+    refcount_dirty.clear();
+    sharing = 0;
+
+    journal.reset();
+    if (superblock.super.version >= 4 && superblock.super.njournalblocks > 0) {
+        journal.reset(new Journal(disk, journal_start(), superblock.super.njournalblocks,
+                                  superblock.super.journalhead, superblock.super.journalsequence));
+    }
 
-                // Verifica blocos indiretos
-                if (inode.indirect) {
-                    bitmap[inode.indirect] = 1; // Marca o bloco indireto como ocupado no bitmap
+    // Depois de uma desmontagem correta os mapas gravados são carregados
+    // direto. Com diário, depois de uma queda, os mapas do último checkpoint
+    // são atualizados pelas transações confirmadas no diário, e o resultado
+    // é gravado no lugar. Nos demais casos (ou em imagens sem mapa) eles são
+    // reconstruídos a partir dos inodes. Antes da versão 3 só o mapa de
+    // blocos é gravado e o de inodes sai de uma leitura da tabela.
+    if (superblock.super.version >= 1 && superblock.super.clean) {
+        bitmap_load();
+        if (superblock.super.version < 3) {
+            scan_inodes(false);
+        }
+    } else if (journal) {
+        bitmap_load();
+        journal->replay([this](const char *record, int size) {
+            journal_apply(record, size);
+        });
+        checkpoint();
+    } else {
+        scan_inodes(true);
+    }
 
-                    // Lê o bloco indireto
-                    union fs_block indirect_block;
-                    disk->read(inode.indirect, indirect_block.data);
+    // O índice de deduplicação não é persistido
+    if (dedup_on && !refcounts.empty()) {
+        dedup_rebuild();
+    } else {
+        dedup_index.reset(0);
+    }
 
-                    // Marca os blocos apontados como ocupados no bitmap
-                    for (int indirect_data_block : indirect_block.pointers) {
-                        if (indirect_data_block != 0) {
-                            bitmap[indirect_data_block] = 1;
-                        }
-                    }
-                }
-            }
-        }
+    // Enquanto montado o mapa no disco fica desatualizado
+    if (this->superblock.version >= 1) {
+        this->superblock.clean = 0;
+        superblock_save();
     }
 
     // Define o sistema de arquivos como montado
     set_mounted(true);
+    if (journal) {
+        start_committer();
+    }
     return 1; // Retorna sucesso
 }
 
-int INE5412_FS::fs_create()
+int INE5412_FS::fs_unmount()
 {
+	stop_committer();
+	std::unique_lock<std::shared_mutex> guard(fs_lock);
+
 	// Certifica-se de que o disco está montado antes de prosseguir
 	if (!get_mounted()) {
 		cerr << "disk is not mounted\n";
 		return 0;
 	}
 
-	union fs_block super_block;
-	disk->read(0, super_block.data);
+	// Grava os inodes e o mapa de blocos (com diário, num checkpoint) e só
+	// depois marca o superbloco como limpo, para que uma queda no meio leve
+	// a uma varredura ou à recuperação pelo diário no mount
+	if (journal) {
+		checkpoint();
+	} else {
+		flush_inodes();
+		if (superblock.version >= 1) {
+			bitmap_save();
+			disk->sync();
+		}
+	}
+	if (superblock.version >= 1) {
+		superblock.clean = 1;
+		superblock_save();
+	}
+	disk->sync();
+
+	journal.reset();
+	metadata_blocks.clear();
+	readahead.clear();
+	inode_table.clear();
+	inode_dirty.clear();
+	set_mounted(false);
+	return 1;
+}
 
-	union fs_block current_inode_block;
+int INE5412_FS::fs_sync()
+{
+	std::shared_lock<std::shared_mutex> guard(fs_lock);
+
+	// Com diário basta confirmar as transações pendentes (o commit também
+	// esvazia a cache de blocos do disco); se elas não couberem no diário,
+	// um checkpoint grava tudo no lugar
+	if (journal) {
+		if (!journal_commit()) {
+			guard.unlock();
+			std::unique_lock<std::shared_mutex> exclusive(fs_lock);
+			if (journal) {
+				checkpoint();
+			}
+		}
+		return 1;
+	}
 
-	// Itera pelos blocos de inodo disponíveis
-	for (int block_index = 0; block_index < super_block.super.ninodeblocks; block_index++) {
-		disk->read(block_index + 1, current_inode_block.data);
+	// Grava os inodes pendentes, se montado, e esvazia a cache de blocos do disco
+	if (get_mounted()) {
+		flush_inodes();
+	}
+	disk->sync();
 
-		// Percorre cada inodo dentro do bloco atual
-		for (int inode_index = 1; inode_index <= INODES_PER_BLOCK; inode_index++) {
+	return 1;
+}
 
-			fs_inode &current_inode = current_inode_block.inode[inode_index];
+int INE5412_FS::fs_create()
+{
+	std::shared_lock<std::shared_mutex> guard(fs_lock);
 
-			// Verifica se o inodo está livre para uso
-			if (!current_inode.isvalid) {
-				// Calcula o identificador do inodo
-				int inode_number = block_index * INODES_PER_BLOCK + inode_index;
+	// Certifica-se de que o disco está montado antes de prosseguir
+	if (!get_mounted()) {
+		cerr << "disk is not mounted\n";
+		return 0;
+	}
 
-				// Inicializa o inodo como válido e vazio
-				current_inode.isvalid = 1;
-				current_inode.indirect = 0;
-				current_inode.size = 0;
+	// O menor inodo livre sai do mapa de inodes, sem percorrer a tabela
+	int inode_number;
+	{
+		std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+		inode_number = inode_map.allocate_first();
+	}
+	if (inode_number < 0) {
+		// Retorna falha caso não haja inodos disponíveis
+		return 0;
+	}
 
-				// Reseta os blocos diretos
-				for (int &block : current_inode.direct) {
-					block = 0;
-				}
+	// Inicializa o inodo como válido e vazio, sem nenhum ponteiro
+	fs_inode current_inode;
+	memset(&current_inode, 0, sizeof(current_inode));
+	current_inode.isvalid = 1;
 
-				// Persiste as alterações no disco
-				inode_save(inode_number, &current_inode);
+	// Quando o formato permite, o arquivo começa guardado no próprio inode
+	current_inode.flags = inline_limit() ? INODE_INLINE : 0;
 
-				// Retorna o número do inodo recém-criado
-				return inode_number;
-			}
-		}
-	}
-	// Retorna falha caso não haja inodos disponíveis
-	return 0;
+	// Registra o inodo na tabela e no diário e retorna o número do inodo recém-criado
+	Journal::transaction txn;
+	inode_save(inode_number, &current_inode, &txn);
+	journal_submit(&txn);
+	return inode_number;
 }
 
 
 int INE5412_FS::fs_delete(int inumber)
 {
+	std::shared_lock<std::shared_mutex> guard(fs_lock);
+
 	// Verifica se o sistema de arquivos está montado
 	if (!get_mounted()) {
 		cerr << "disk is not mounted\n";
 		return 0;
 	}
 
-	fs_inode inode;
-	if (inode_load(inumber, &inode) && inode.isvalid) {
+	block_refs refs; // Blocos largados, liberados no fim
+	Journal::transaction txn;
+	int released;
+	{
+		std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+		released = release_inode(inumber, 0, &refs, &txn);
+	}
+	if (released) {
+		free_blocks(&refs, std::vector<int>(1, inumber), &txn);
+		return 1; // Sucesso
+	}
+	return 0; // Falha
+}
 
-		// Libera os blocos diretos, verificando se estão alocados antes
-		for (int &direct_block : inode.direct) {
-			if (direct_block != 0) { // Verifica se o bloco está realmente alocado
-				bitmap[direct_block] = 0; // Marca o bloco como livre no bitmap
-				direct_block = 0;         // Limpa o bloco no inode
-			}
+int INE5412_FS::fs_create_many(int count, std::vector<int> &inumbers)
+{
+	std::shared_lock<std::shared_mutex> guard(fs_lock);
+
+	// Certifica-se de que o disco está montado antes de prosseguir
+	inumbers.clear();
+	if (!get_mounted()) {
+		cerr << "disk is not mounted\n";
+		return 0;
+	}
+
+	// Reserva os inodos no mapa de inodes, do menor para o maior
+	std::unique_lock<std::mutex> allocator_guard(allocator_lock);
+	while ((int) inumbers.size() < count) {
+		int inode_number = inode_map.allocate_first();
+		if (inode_number < 0) {
+			break; // Não há mais inodos disponíveis
 		}
+		inumbers.push_back(inode_number);
+	}
+	allocator_guard.unlock();
 
-		// Caso necessário, libera os blocos indiretos
-		if (inode.indirect) {
-			union fs_block indirect_block;
-			disk->read(inode.indirect, indirect_block.data);
+	// Os blocos de inodes envolvidos são lidos numa só requisição; cada um
+	// é gravado uma vez no próximo fs_sync (ou checkpoint), com todos os
+	// seus inodos novos, que entram no diário como uma só transação
+	load_inode_blocks(inumbers);
 
-			for (int &indirect_data_block : indirect_block.pointers) {
-				if (indirect_data_block != 0) { // Verifica se o bloco indireto está alocado
-					bitmap[indirect_data_block] = 0; // Marca o bloco como livre no bitmap
-					indirect_data_block = 0;         // Limpa o bloco indireto
-				}
-			}
+	fs_inode current_inode;
+	memset(&current_inode, 0, sizeof(current_inode));
+	current_inode.isvalid = 1;
+	current_inode.flags = inline_limit() ? INODE_INLINE : 0;
+
+	Journal::transaction txn;
+	for (int inode_number : inumbers) {
+		inode_save(inode_number, &current_inode, &txn);
+	}
+	journal_submit(&txn);
+	return inumbers.size();
+}
+
+int INE5412_FS::fs_delete_many(const std::vector<int> &inumbers)
+{
+	std::shared_lock<std::shared_mutex> guard(fs_lock);
+
+	// Verifica se o sistema de arquivos está montado
+	if (!get_mounted()) {
+		cerr << "disk is not mounted\n";
+		return 0;
+	}
 
-			// Libera o bloco que contém os ponteiros indiretos
-			bitmap[inode.indirect] = 0; // Marca o bloco indireto como livre no bitmap
-			inode.indirect = 0;         // Limpa o bloco indireto no inode
+	load_inode_blocks(inumbers);
+
+	// Os blocos de todos os inodes removidos são liberados numa só passada
+	// pelo mapa de blocos e descartados juntos, agrupando os contíguos
+	block_refs refs;
+	std::vector<int> released;
+	Journal::transaction txn;
+	for (int inumber : inumbers) {
+		// Números fora da tabela contam só como não removidos
+		if (inumber >= 1 && inumber < superblock.ninodes) {
+			std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+			if (release_inode(inumber, 0, &refs, &txn)) {
+				released.push_back(inumber);
+			}
 		}
+	}
+	free_blocks(&refs, released, &txn);
 
-		// Atualiza o tamanho e a validade do inode
-		inode.isvalid = 0;
-		inode.size = 0;
+	return released.size();
+}
 
-		// Salva o inode atualizado no disco
-		inode_save(inumber, &inode);
+// Invalida o inode e acrescenta a refs as referências dos seus ponteiros
+// diretos e das raízes das suas árvores; os blocos só são liberados (ou
+// perdem um dono, se compartilhados) no free_blocks. Retorna 0 se o inode
+// não for válido ou se não for do tipo kind (0 para um arquivo sem nome,
+// INODE_LINKED para um com nome, mais INODE_DIRECTORY para um diretório).
+// Chamado com a trava do inode exclusiva.
+int INE5412_FS::release_inode(int inumber, int kind, block_refs *refs, Journal::transaction *txn)
+{
+	fs_inode inode;
+	if (!inode_load(inumber, &inode) || !inode.isvalid || (inode.flags & (INODE_LINKED | INODE_DIRECTORY)) != kind) {
+		return 0;
+	}
 
-		return 1; // Sucesso
+	// O inode não terá mais o que ler antecipadamente
+	readahead_drop(inumber);
+
+	// Um arquivo guardado no inode não tem blocos; nele os ponteiros são dados
+	if (!(inode.flags & INODE_INLINE)) {
+		// Larga os blocos diretos, verificando se estão alocados antes
+		for (int direct_block : inode.direct) {
+			if (direct_block != 0) {
+				refs->dropped.push_back(std::make_pair(direct_block, 0));
+			}
+		}
+
+		// E as árvores de ponteiros, que o free_blocks percorre
+		int roots[INDIRECT_LEVELS] = {inode.indirect, inode.dindirect, inode.tindirect};
+		for (int depth = 1; depth <= INDIRECT_LEVELS; depth++) {
+			if (roots[depth - 1]) {
+				refs->dropped.push_back(std::make_pair(roots[depth - 1], depth));
+			}
+		}
 	}
-	return 0; // Falha
+
+	// Limpa os ponteiros, o tamanho e a validade do inode
+	memset(&inode, 0, sizeof(inode));
+
+	// Salva o inode atualizado
+	inode_save(inumber, &inode, txn);
+	return 1;
 }
 
 
-int INE5412_FS::fs_getsize(int inumber)
+long long INE5412_FS::fs_getsize(int inumber)
 {
+	std::shared_lock<std::shared_mutex> guard(fs_lock);
+
 	// verifica se está montado
 	if (!get_mounted()) {
 		cerr << "disk is not mounted\n";
@@ -281,13 +577,111 @@ int INE5412_FS::fs_getsize(int inumber)
 	}
 
 	// carrega o inodo e retorna seu tamanho
+	std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
 	fs_inode inode;
 	if (inode_load(inumber, &inode) && inode.isvalid) {
 		return inode.size;
 	} return -1;
 }
 
-int INE5412_FS::fs_read(int number, char *data, int length, int offset)
+// As leituras e escritas síncronas mantêm as travas até a E/S terminar;
+// as assíncronas só durante o mapeamento
+int INE5412_FS::fs_read(int number, char *data, int length, long long offset)
+{
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(number));
+
+    io_plan plan;
+    int bytes = plan_read(number, data, length, offset, &plan, true);
+    run_plan(&plan);
+    return bytes;
+}
+
+int INE5412_FS::fs_write(int inumber, const char *data, int length, long long offset)
+{
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+
+    // Os registros da escrita só vão para o diário depois dos dados (o
+    // free_blocks envia a transação com os blocos trocados por cópias)
+    io_plan plan;
+    int bytes = plan_write(inumber, data, length, offset, &plan);
+    run_plan(&plan);
+    free_blocks(&plan.refs, std::vector<int>(), &plan.txn);
+    return bytes;
+}
+
+std::future<int> INE5412_FS::fs_read_async(int inumber, char *data, int length, long long offset)
+{
+    std::shared_ptr<io_plan> plan = std::make_shared<io_plan>();
+    {
+        std::shared_lock<std::shared_mutex> guard(fs_lock);
+        std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+        plan->bytes = plan_read(inumber, data, length, offset, plan.get(), false);
+    }
+    return run_plan_async(plan);
+}
+
+std::future<int> INE5412_FS::fs_write_async(int inumber, const char *data, int length, long long offset)
+{
+    std::shared_ptr<io_plan> plan = std::make_shared<io_plan>();
+    {
+        std::shared_lock<std::shared_mutex> guard(fs_lock);
+        std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+        plan->bytes = plan_write(inumber, data, length, offset, plan.get());
+        free_blocks(&plan->refs, std::vector<int>(), &plan->txn);
+    }
+    return run_plan_async(plan);
+}
+
+// Executa um plano: lê os blocos, faz as cópias e grava os blocos
+void INE5412_FS::run_plan(io_plan *plan)
+{
+    disk->readv(plan->reads);
+    plan->copy();
+    disk->writev(plan->writes);
+}
+
+// Mesma sequência do run_plan, mas encadeada pelas conclusões do disco.
+// O plano fica vivo nas closures até a escrita terminar.
+std::future<int> INE5412_FS::run_plan_async(std::shared_ptr<io_plan> plan)
+{
+    std::shared_ptr<std::promise<int>> promise = std::make_shared<std::promise<int>>();
+    std::future<int> result = promise->get_future();
+
+    std::vector<Disk::io_request> reads;
+    for (auto &request : plan->reads) {
+        reads.push_back({request.first, request.second, false});
+    }
+
+    Disk *target = disk;
+    disk->submit(reads, [target, plan, promise]() {
+        plan->copy();
+
+        std::vector<Disk::io_request> writes;
+        for (auto &request : plan->writes) {
+            writes.push_back({request.first, (char *) request.second, true});
+        }
+        target->submit(writes, [plan, promise]() {
+            promise->set_value(plan->bytes);
+        });
+    });
+
+    return result;
+}
+
+void INE5412_FS::io_plan::copy()
+{
+    for (auto &entry : copies) {
+        memcpy(std::get<0>(entry), std::get<1>(entry), std::get<2>(entry));
+    }
+}
+
+// Mapeia o trecho lido em requisições de leitura, sem fazer E/S de dados.
+// Com readahead (leituras síncronas), um acesso sequencial é servido do
+// buffer de leitura antecipada do inode, que é lido na hora e copiado
+// direto para data.
+int INE5412_FS::plan_read(int number, char *data, int length, long long offset, io_plan *plan, bool use_readahead)
 {
     // Verifica se o disco está montado
     if (!get_mounted()) {
@@ -295,54 +689,154 @@ int INE5412_FS::fs_read(int number, char *data, int length, int offset)
         return 0;
     }
 
-    // Carrega o inode correspondente ao número fornecido
+    // Carrega o inode correspondente ao número fornecido; diretórios só
+    // são lidos pelas operações com caminhos
     fs_inode inode;
-    if (inode_load(number, &inode) && inode.isvalid) {
-        int remaining_bytes = length;   // Quantidade de bytes restantes para leitura
-        int total_bytes_read = 0;      // Total de bytes já lidos
-        int block_number;              // Número do bloco correspondente ao deslocamento atual
+    if (inode_load(number, &inode) && inode.isvalid && !(inode.flags & INODE_DIRECTORY)) {
+        if (length <= 0 || offset < 0 || offset >= inode.size) {
+            return 0;
+        }
 
-        union fs_block current_block;
+        // Limita a leitura ao tamanho do inode
+        long long end = offset + min((long long) length, inode.size - offset);
 
-        // Lê os dados enquanto houver bytes restantes e o deslocamento estiver dentro do tamanho do inode
-        while (remaining_bytes > 0 && offset < inode.size) {
-            block_number = offset / Disk::DISK_BLOCK_SIZE; // Calcula o número do bloco correspondente
+        // Arquivo guardado no inode: copiado da tabela, sem E/S
+        if (inode.flags & INODE_INLINE) {
+            memcpy(data, inline_data(&inode) + offset, end - offset);
+            return end - offset;
+        }
 
-            if (block_number < POINTERS_PER_INODE) {
-                // Lê os dados dos blocos diretos
-                disk->read(inode.direct[block_number], current_block.data);
-            } else {
-                // Lê os dados dos blocos indiretos
-                int indirect_index = block_number - POINTERS_PER_INODE;
-                union fs_block indirect_block;
-                disk->read(inode.indirect, indirect_block.data);
-                disk->read(indirect_block.pointers[indirect_index], current_block.data);
+        int first_block = offset / Disk::DISK_BLOCK_SIZE;
+        int last_block = (end - 1) / Disk::DISK_BLOCK_SIZE;
+
+        std::shared_ptr<readahead_state> ra;
+        std::unique_lock<std::mutex> ra_guard;
+        bool sequential = false;
+        if (use_readahead) {
+            ra = readahead_find(number);
+            ra_guard = std::unique_lock<std::mutex>(ra->lock);
+
+            // A janela dobra a cada leitura que continua a anterior e some
+            // quando o acesso deixa de ser sequencial
+            sequential = offset == ra->next_offset;
+            if (!sequential) {
+                ra->window = 0;
+            } else if (ra->window < READAHEAD_MIN) {
+                ra->window = READAHEAD_MIN;
+            } else if (ra->window < READAHEAD_MAX) {
+                ra->window = 2 * ra->window < READAHEAD_MAX ? 2 * ra->window : READAHEAD_MAX;
             }
+            ra->next_offset = end;
+        }
 
-            // Calcula o deslocamento dentro do bloco e a quantidade de bytes a copiar
-            int local_offset = offset % Disk::DISK_BLOCK_SIZE;
-            int bytes_to_copy = min(Disk::DISK_BLOCK_SIZE - local_offset, remaining_bytes);
-            bytes_to_copy = min(bytes_to_copy, inode.size - offset);
-
-            // Copia os dados do bloco atual para o buffer de saída
-            memcpy(data + total_bytes_read, current_block.data + local_offset, bytes_to_copy);
+        // Sem leitura antecipada, os blocos de ponteiros são decodificados
+        // uma vez por chamada
+        block_map_cache local_map;
+        block_map_cache *map = ra ? &ra->map : &local_map;
+
+        // Blocos cobertos por inteiro são lidos direto no buffer do usuário;
+        // só o primeiro e o último podem ser parciais e passar por um buffer
+        plan->staging.resize(2 * Disk::DISK_BLOCK_SIZE);
+
+        for (int block_number = first_block; block_number <= last_block; block_number++) {
+            long long block_start = (long long) block_number * Disk::DISK_BLOCK_SIZE;
+            int local_begin = max(offset, block_start) - block_start;
+            int local_end = min(end, block_start + Disk::DISK_BLOCK_SIZE) - block_start;
+            char *destination = data + (block_start + local_begin - offset);
+
+            if (sequential) {
+                // Traz o resto do trecho e mais uma janela de blocos adiante
+                if (block_number < ra->first_block || block_number >= ra->first_block + ra->nblocks) {
+                    readahead_fill(inode, ra.get(), block_number, max(last_block - block_number + 1, ra->window));
+                }
+                memcpy(destination, ra->buffer.data() + (block_number - ra->first_block) * Disk::DISK_BLOCK_SIZE + local_begin, local_end - local_begin);
+                continue;
+            }
 
-            // Atualiza os contadores e o deslocamento
-            total_bytes_read += bytes_to_copy;
-            remaining_bytes -= bytes_to_copy;
-            offset += bytes_to_copy;
+            int physical_block = map_block(inode, block_number, map);
+            if (!physical_block) {
+                // Bloco nunca escrito: lido como zeros
+                memset(destination, 0, local_end - local_begin);
+            } else if (local_begin == 0 && local_end == Disk::DISK_BLOCK_SIZE) {
+                plan->reads.push_back(std::make_pair(physical_block, destination));
+            } else {
+                // Bloco parcial: lido no buffer e copiado depois
+                char *edge = plan->staging.data() + (block_number == first_block ? 0 : Disk::DISK_BLOCK_SIZE);
+                plan->reads.push_back(std::make_pair(physical_block, edge));
+                plan->copies.push_back(std::make_tuple(destination, (const char *) edge + local_begin, local_end - local_begin));
+            }
         }
 
         // Retorna o número total de bytes lidos
-        return total_bytes_read;
+        return end - offset;
     }
 
     // Retorna 0 caso o inode não seja válido ou falhe ao carregar
     return 0;
 }
 
+// Estado de leitura antecipada do inode, criado na primeira leitura. O
+// número de inodes acompanhados é limitado; ao passar do limite, todos
+// são esquecidos (um estado em uso continua válido para quem o tem).
+std::shared_ptr<INE5412_FS::readahead_state> INE5412_FS::readahead_find(int inumber)
+{
+    std::lock_guard<std::mutex> guard(readahead_lock);
+
+    auto found = readahead.find(inumber);
+    if (found != readahead.end()) {
+        return found->second;
+    }
+
+    if (readahead.size() >= READAHEAD_FILES) {
+        readahead.clear();
+    }
+    return readahead[inumber] = std::make_shared<readahead_state>();
+}
+
+// Esquece o que foi lido antecipadamente do inode; chamado, com a trava do
+// inode exclusiva, sempre que seus dados ou ponteiros mudam
+void INE5412_FS::readahead_drop(int inumber)
+{
+    std::lock_guard<std::mutex> guard(readahead_lock);
+    readahead.erase(inumber);
+}
+
+// Trava do inode, compartilhada com os inodes de mesmo resto da divisão
+std::shared_mutex &INE5412_FS::inode_lock(int inumber)
+{
+    return inode_locks[(unsigned int) inumber % INODE_LOCK_STRIPES];
+}
+
+// Lê para o buffer do estado count blocos do arquivo a partir de
+// first_block (sem passar do fim do arquivo), em uma única requisição
+// ao disco; blocos contíguos viram uma só leitura
+void INE5412_FS::readahead_fill(const fs_inode &inode, readahead_state *ra, int first_block, int count)
+{
+    int last_block = (inode.size - 1) / Disk::DISK_BLOCK_SIZE;
+    count = max(min(count, last_block - first_block + 1), 0);
+
+    ra->first_block = first_block;
+    ra->nblocks = count;
+    ra->buffer.resize((size_t) count * Disk::DISK_BLOCK_SIZE);
+
+    std::vector<std::pair<int, char *>> reads;
+    for (int i = 0; i < count; i++) {
+        char *block_data = ra->buffer.data() + (size_t) i * Disk::DISK_BLOCK_SIZE;
+        int physical_block = map_block(inode, first_block + i, &ra->map);
+
+        if (physical_block) {
+            reads.push_back(std::make_pair(physical_block, block_data));
+        } else {
+            // Bloco nunca escrito: lido como zeros
+            memset(block_data, 0, Disk::DISK_BLOCK_SIZE);
+        }
+    }
+    disk->readv(reads);
+}
 
-int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
+// Mapeia e aloca os blocos do trecho escrito e atualiza o inode; a E/S
+// de dados fica descrita no plano
+int INE5412_FS::plan_write(int inumber, const char *data, int length, long long offset, io_plan *plan)
 {
     // verifica se o disco está montado
     if (!get_mounted()) {
@@ -351,81 +845,155 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
     }
 
     fs_inode inode;
-    union fs_block current_block;
-    union fs_block indirect_block;
 
-    // carrega o inode correspondente ao inumber e verifica se ele é válido
-    if (inode_load(inumber, &inode) && inode.isvalid) {
-        int total_bytes_written = 0;  // Total de bytes já escritos
-        int bytes_remaining = length; // Bytes que ainda precisam ser escritos
+    // carrega o inode correspondente ao inumber e verifica se ele é um
+    // arquivo válido
+    if (inode_load(inumber, &inode) && inode.isvalid && !(inode.flags & INODE_DIRECTORY)) {
+        if (length <= 0 || offset < 0 || offset / Disk::DISK_BLOCK_SIZE >= max_file_blocks()) {
+            return 0;
+        }
 
-        while (bytes_remaining > 0) {
-            int block_number = offset / Disk::DISK_BLOCK_SIZE; // Número do bloco baseado no deslocamento
-            int local_offset = offset % Disk::DISK_BLOCK_SIZE; // Offset dentro do bloco atual
+        // O que foi lido antecipadamente deixa de valer
+        readahead_drop(inumber);
 
-            int *target_block_pointer; // Ponteiro para o bloco que será usado (direto ou indireto)
+        long long end = offset + length;
 
-            if (block_number < POINTERS_PER_INODE) {
-                // Blocos diretos
-                target_block_pointer = &inode.direct[block_number];
-            } else {
-                // Blocos indiretos
-                if (!inode.indirect) {
-                    // Aloca um bloco para o ponteiro indireto, caso não exista
-                    int new_block = search_block();
-                    if (new_block == -1) break; // Sem espaço disponível
+        // Enquanto couber, o arquivo continua guardado no inode
+        if ((inode.flags & INODE_INLINE) && end <= inline_limit()) {
+            memcpy(inline_data(&inode) + offset, data, length);
+            inode.size = max(inode.size, end);
+            inode_save(inumber, &inode, &plan->txn);
+            return length;
+        }
 
-                    inode.indirect = new_block;
-                }
+        int first_block = offset / Disk::DISK_BLOCK_SIZE;
+        int last_block = min((end - 1) / Disk::DISK_BLOCK_SIZE, max_file_blocks() - 1);
 
-                // Lê o bloco indireto
-                disk->read(inode.indirect, indirect_block.data);
+        bool inode_changed = false;
 
-                int indirect_index = block_number - POINTERS_PER_INODE;
-                target_block_pointer = &indirect_block.pointers[indirect_index];
+        // Os blocos de ponteiros são lidos uma vez por chamada e os
+        // alterados gravados uma vez no fim
+        pointer_blocks pointers;
 
-                // Aloca um bloco indireto, caso necessário
-                if (!(*target_block_pointer)) {
-                    int new_block = search_block();
-                    if (new_block == -1) break; // Sem espaço disponível
+        // Blocos novos saem de um trecho contíguo do tamanho do que falta
+        // escrever, para que o arquivo fique sequencial no disco
+        block_run run;
 
-                    *target_block_pointer = new_block;
+        // Blocos cobertos por inteiro são gravados direto do buffer do usuário,
+        // sem ler o conteúdo antigo; só o primeiro e o último podem ser
+        // parciais e passar por um buffer (zerado, para blocos recém-alocados)
+        plan->staging.assign(2 * Disk::DISK_BLOCK_SIZE, 0);
 
-                    // Atualiza o bloco indireto no disco
-                    disk->write(inode.indirect, indirect_block.data);
-                }
+        // Um arquivo que passa do limite sai do inode: o conteúdo antigo vai
+        // para o bloco 0, montado no buffer do primeiro bloco escrito ou num
+        // terceiro buffer, gravado à parte
+        int promoted = 0;
+        if (inode.flags & INODE_INLINE) {
+            if (first_block > 0) {
+                plan->staging.resize(3 * Disk::DISK_BLOCK_SIZE, 0);
             }
+            char *block = plan->staging.data() + (first_block > 0 ? 2 * Disk::DISK_BLOCK_SIZE : 0);
 
-            // Aloca um bloco direto, caso necessário
-            if (!(*target_block_pointer)) {
-                int new_block = search_block();
-                if (new_block == -1) break; // Sem espaço disponível
+            // O bloco 0 sai do mesmo trecho que os seguintes quando a escrita começa nele
+            promoted = promote_inline(&inode, &pointers, &run, first_block > 0 ? 1 : last_block + 1, block, &inode_changed);
+            if (promoted == -1) {
+                release_run(&run);
+                return 0; // Sem espaço para o bloco 0
+            }
+            if (promoted && first_block > 0) {
+                plan->writes.push_back(std::make_pair(promoted, (const char *) block));
+            }
+        }
+
+        // Com deduplicação, os blocos inteiros desta escrita ainda não estão
+        // no disco e são comparados com o buffer do usuário
+        bool dedup = dedup_active();
+        std::unordered_map<int, const char *> pending;
+
+        int block_number;
+        for (block_number = first_block; block_number <= last_block; block_number++) {
+            long long block_start = (long long) block_number * Disk::DISK_BLOCK_SIZE;
+            int local_begin = max(offset, block_start) - block_start;
+            int local_end = min(end, block_start + Disk::DISK_BLOCK_SIZE) - block_start;
+            const char *source = data + (block_start + local_begin - offset);
+            bool whole = local_begin == 0 && local_end == Disk::DISK_BLOCK_SIZE;
+
+            // Um bloco inteiro igual a um bloco em uso passa a apontar para ele
+            uint64_t hash = 0;
+            int linked = dedup && whole ? dedup_find(source, pending, &hash) : 0;
+
+            // Mapeia o bloco, alocando-o (e os blocos de ponteiros do
+            // caminho) caso necessário; um bloco compartilhado é trocado por
+            // uma cópia
+            bool fresh = false;
+            int copied = 0;
+            int physical_block = map_alloc(&inode, block_number, &pointers, &run, last_block - block_number + 1, &fresh, &inode_changed, &copied, linked);
+            if (physical_block == -1) {
+                // Sem espaço disponível: o dono ganho no dedup_find é
+                // desfeito, e o contador ainda vai para o diário, já que
+                // outra transação pode ter registrado o valor com ele
+                if (linked) {
+                    {
+                        std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+                        refcount_add(linked, -1);
+                    }
+                    pointers.refs.linked.push_back(linked);
+                }
+                break;
+            }
+            if (linked) {
+                pointers.refs.linked.push_back(linked);
+                continue;
+            }
 
-                *target_block_pointer = new_block;
+            // O bloco 0 de um arquivo que acabou de sair do inode já está no buffer
+            if (block_number == 0 && promoted) {
+                fresh = true;
             }
 
-            // Lê o bloco do disco para atualização
-            disk->read(*target_block_pointer, current_block.data);
+            if (whole) {
+                if (dedup) {
+                    std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+                    dedup_index.insert(hash, physical_block);
+                    pending[physical_block] = source;
+                }
+                plan->writes.push_back(std::make_pair(physical_block, source));
+            } else {
+                // Bloco parcial: o conteúdo antigo é lido no buffer, os dados
+                // do usuário copiados por cima e o bloco gravado inteiro. O
+                // bloco compartilhado é lido já: depois do envio da transação
+                // ele pode ser liberado antes de uma escrita assíncrona rodar.
+                char *edge = plan->staging.data() + (block_number == first_block ? 0 : Disk::DISK_BLOCK_SIZE);
+                if (copied) {
+                    disk->read(copied, edge);
+                } else if (!fresh) {
+                    plan->reads.push_back(std::make_pair(physical_block, edge));
+                }
+                plan->copies.push_back(std::make_tuple(edge + local_begin, source, local_end - local_begin));
+                plan->writes.push_back(std::make_pair(physical_block, (const char *) edge));
+            }
+        }
 
-            // Determina quantos bytes podem ser copiados para o bloco atual
-            int bytes_to_copy = std::min(bytes_remaining, Disk::DISK_BLOCK_SIZE - local_offset);
+        // Devolve o que sobrou do trecho reservado
+        release_run(&run);
+        log_run(&run, &plan->txn);
 
-            // Copia os dados para o bloco atual
-            memcpy(current_block.data + local_offset, data + total_bytes_written, bytes_to_copy);
+        // Os ponteiros alterados são gravados de uma vez; os blocos trocados
+        // por cópias são largados quando a transação for enviada
+        flush_pointers(&pointers, &plan->txn);
+        plan->refs = std::move(pointers.refs);
 
-            // Escreve o bloco atualizado no disco
-            disk->write(*target_block_pointer, current_block.data);
+        // Bytes cobertos pelos blocos mapeados
+        int total_bytes_written = max(min(end, (long long) block_number * Disk::DISK_BLOCK_SIZE) - offset, 0LL);
 
-            // Atualiza os contadores e deslocamentos
-            total_bytes_written += bytes_to_copy;
-            bytes_remaining -= bytes_to_copy;
-            offset += bytes_to_copy;
+        // Atualiza o tamanho do inode, caso algo tenha sido escrito além do fim,
+        // e o salva uma única vez
+        if (total_bytes_written > 0 && inode.size < offset + total_bytes_written) {
+            inode.size = offset + total_bytes_written;
+            inode_changed = true;
         }
-
-        // Atualiza o tamanho do inode, caso necessário
-        if (inode.size < offset) {
-            inode.size = offset;
-            inode_save(inumber, &inode);
+        if (inode_changed) {
+            inode_save(inumber, &inode, &plan->txn);
         }
 
         return total_bytes_written;
@@ -434,92 +1002,2210 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
     return 0;
 }
 
-int INE5412_FS::inode_load(int number, class fs_inode *inode) 
+long long INE5412_FS::fs_reserve(int inumber, long long length)
 {
-    union fs_block superblock;
-    disk->read(0, superblock.data);
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
 
-    // Verifica se o número do inode é válido
-    if (number < 1 || number > superblock.super.ninodes) {
-        cout << "Erro: Número do inode inválido.\n";
+    // verifica se o disco está montado
+    if (!get_mounted()) {
+        cerr << "disk is not mounted.\n";
         return 0;
     }
 
-    union fs_block inode_block;
-    int inodes_per_block = INODES_PER_BLOCK; // Quantidade de inodes por bloco
-    int inode_blocks_count = superblock.super.ninodeblocks; // Quantidade de blocos de inodes
-
-    for (int block_index = 0; block_index < inode_blocks_count; ++block_index) {
-        // Lê o bloco atual de inodes
-        disk->read(block_index + 1, inode_block.data);
+    fs_inode inode;
+    if (!inode_load(inumber, &inode) || !inode.isvalid || (inode.flags & INODE_DIRECTORY) || length <= 0) {
+        return 0;
+    }
 
-        for (int inode_index = 0; inode_index < inodes_per_block; ++inode_index) {
-            int current_inode_number = block_index * inodes_per_block + inode_index;
+    // Os ponteiros do inode vão mudar
+    readahead_drop(inumber);
 
-            // Verifica se o inode atual corresponde ao número solicitado
-            if (current_inode_number == number) {
-                *inode = inode_block.inode[inode_index];
-                return 1; // Retorna sucesso ao encontrar o inode
-            }
-        }
+    // Um arquivo guardado no inode já cobre o que cabe nele
+    if ((inode.flags & INODE_INLINE) && length <= inline_limit()) {
+        return length;
     }
 
-    return 0; // Retorna falha caso o inode não seja encontrado
-}
+    // Último bloco a reservar, limitado ao tamanho máximo de arquivo
+    int last_block = min((length - 1) / Disk::DISK_BLOCK_SIZE, max_file_blocks() - 1);
 
+    bool inode_changed = false;
+    pointer_blocks pointers;
 
-int INE5412_FS::inode_save(int number, class fs_inode *inode) 
-{
-    union fs_block superblock;
-    disk->read(0, superblock.data);
+    std::vector<int> allocated; // blocos de dados reservados nesta chamada
+    block_run run;
+    int block_number;
 
-    // Verifica se o número do inode é válido
-    if (number < 1 || number > superblock.super.ninodes) {
-        cerr << "Erro: Número do inode inválido.\n";
-        return 0;
+    // Caso contrário ele sai do inode antes: o conteúdo vai para o bloco 0,
+    // gravado já (antes dos registros que o referenciam)
+    if (inode.flags & INODE_INLINE) {
+        union fs_block block;
+        int promoted = promote_inline(&inode, &pointers, &run, last_block + 1, block.data, &inode_changed);
+        if (promoted == -1) {
+            release_run(&run);
+            return 0;
+        }
+        if (promoted) {
+            disk->write(promoted, block.data);
+        }
     }
 
-    union fs_block inode_block;
-    int inodes_per_block = INODES_PER_BLOCK; // Quantidade de inodes por bloco
-    int inode_blocks_count = superblock.super.ninodeblocks; // Quantidade de blocos de inodes
+    for (block_number = 0; block_number <= last_block; block_number++) {
+        bool fresh = false;
+        int physical_block = map_alloc(&inode, block_number, &pointers, &run, last_block - block_number + 1, &fresh, &inode_changed, nullptr, 0);
+        if (physical_block == -1) break; // Sem espaço disponível
 
-    for (int block_index = 0; block_index < inode_blocks_count; ++block_index) {
-        // Lê o bloco atual de inodes
-        disk->read(block_index + 1, inode_block.data);
+        if (fresh) {
+            allocated.push_back(physical_block);
+        }
+    }
 
-        for (int inode_index = 0; inode_index < inodes_per_block; ++inode_index) {
-            int current_inode_number = block_index * inodes_per_block + inode_index;
+    // Devolve o que sobrou do trecho reservado
+    Journal::transaction txn;
+    release_run(&run);
+    log_run(&run, &txn);
 
-            // Verifica se o inode atual corresponde ao número fornecido
-            if (current_inode_number == number) {
-                inode_block.inode[inode_index] = *inode; // Salva o inode no bloco
-                disk->write(block_index + 1, inode_block.data); // Escreve o bloco atualizado no disco
-                return 1; // Retorna sucesso após salvar
-            }
+    // Os blocos reservados devem ser lidos como zeros até serem escritos;
+    // só os que ainda guardam dados antigos na imagem precisam ser zerados
+    std::vector<char> zeros(Disk::DISK_BLOCK_SIZE, 0);
+    std::vector<std::pair<int, const char *>> clears;
+
+    std::sort(allocated.begin(), allocated.end());
+    for (int block : allocated) {
+        if (!disk->is_hole(block)) {
+            clears.push_back(std::make_pair(block, (const char *) zeros.data()));
         }
     }
+    disk->writev(clears);
+
+    flush_pointers(&pointers, &txn);
+    if (inode_changed) {
+        inode_save(inumber, &inode, &txn);
+    }
+    free_blocks(&pointers.refs, std::vector<int>(), &txn);
 
-    return 0; // Retorna falha caso o inode não seja salvo
+    // Bytes do início do arquivo cobertos por blocos
+    return min(length, (long long) block_number * Disk::DISK_BLOCK_SIZE);
 }
 
+long long INE5412_FS::fs_seek_data(int inumber, long long offset)
+{
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    return seek_extent(inumber, offset, true);
+}
 
-// função auxiliar para encontrar um bloco livre
-int INE5412_FS::search_block() 
+long long INE5412_FS::fs_seek_hole(int inumber, long long offset)
 {
-    union fs_block superblock;
-    disk->read(0, superblock.data);
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    return seek_extent(inumber, offset, false);
+}
 
-    int total_blocks = superblock.super.nblocks; // Total de blocos disponíveis
+// Procura, a partir de offset, o primeiro trecho com dados (want_data) ou o
+// primeiro buraco do arquivo, como lseek com SEEK_DATA/SEEK_HOLE. Buracos são
+// blocos não alocados ou descartados na imagem; o fim do arquivo conta como
+// buraco. Retorna -1 se não houver mais dados ou se o inode for inválido.
+long long INE5412_FS::seek_extent(int inumber, long long offset, bool want_data)
+{
+    if (!get_mounted()) {
+        cerr << "disk is not mounted.\n";
+        return -1;
+    }
+
+    fs_inode inode;
+    if (!inode_load(inumber, &inode) || !inode.isvalid || (inode.flags & INODE_DIRECTORY) || offset < 0) {
+        return -1;
+    }
+
+    // Num arquivo guardado no inode, tudo antes do fim são dados
+    if (inode.flags & INODE_INLINE) {
+        if (want_data) {
+            return offset < inode.size ? offset : -1;
+        }
+        return max(offset, inode.size);
+    }
+
+    // Os blocos de ponteiros decodificados para a leitura antecipada servem
+    // também aqui: copiar um arquivo esparso alterna buscas e leituras
+    std::shared_ptr<readahead_state> ra = readahead_find(inumber);
+    std::lock_guard<std::mutex> ra_guard(ra->lock);
+    int last_block = (inode.size - 1) / Disk::DISK_BLOCK_SIZE;
+
+    for (int block_number = offset / Disk::DISK_BLOCK_SIZE; offset < inode.size && block_number <= last_block; block_number++) {
+        int physical_block = map_block(inode, block_number, &ra->map);
 
-    // Percorre todos os blocos para encontrar um bloco livre
-    for (int block_index = 0; block_index < total_blocks; ++block_index) {
-        if (!bitmap[block_index]) {
-            bitmap[block_index] = 1; // Marca o bloco como ocupado no bitmap
-            return block_index; // Retorna o índice do bloco livre encontrado
+        bool has_data = physical_block && !disk->is_hole(physical_block);
+        if (has_data == want_data) {
+            return max(offset, (long long) block_number * Disk::DISK_BLOCK_SIZE);
         }
     }
 
-    return -1; // Retorna -1 caso nenhum bloco esteja disponível
+    return want_data ? -1 : max(offset, inode.size);
+}
+
+int INE5412_FS::fs_clone(int inumber)
+{
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    if (!get_mounted()) {
+        cerr << "disk is not mounted\n";
+        return 0;
+    }
+    if (refcounts.empty()) {
+        cerr << "clones need a disk formatted with version 7\n";
+        return 0;
+    }
+
+    // A trava compartilhada basta para que nenhuma escrita altere a origem
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    fs_inode inode;
+    if (!inode_load(inumber, &inode) || !inode.isvalid || (inode.flags & INODE_DIRECTORY)) {
+        return 0;
+    }
+
+    int clone_number;
+    {
+        std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+        clone_number = inode_map.allocate_first();
+    }
+    if (clone_number < 0) {
+        return 0;
+    }
+
+    // A cópia não tem nome; os blocos diretos e as raízes das árvores ganham
+    // um dono (os blocos abaixo de uma raiz são compartilhados por ela)
+    inode.flags &= ~INODE_LINKED;
+    std::vector<int> shared;
+    if (!(inode.flags & INODE_INLINE)) {
+        for (int direct_block : inode.direct) {
+            if (direct_block) {
+                shared.push_back(direct_block);
+            }
+        }
+        for (int root : {inode.indirect, inode.dindirect, inode.tindirect}) {
+            if (root) {
+                shared.push_back(root);
+            }
+        }
+    }
+
+    // Os donos mudam antes de o inode aparecer na tabela, e a transação é
+    // enviada antes de qualquer outra mudança de referências
+    std::lock_guard<std::mutex> share_guard(share_lock);
+    {
+        std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+        for (int block : shared) {
+            refcount_add(block, 1);
+        }
+    }
+
+    Journal::transaction txn;
+    log_refcounts(&txn, shared);
+    inode_save(clone_number, &inode, &txn);
+    journal_submit(&txn);
+    return clone_number;
+}
+
+int INE5412_FS::fs_dedup(bool enabled)
+{
+    std::unique_lock<std::shared_mutex> guard(fs_lock);
+    if (enabled && get_mounted() && refcounts.empty()) {
+        cerr << "deduplication needs a disk formatted with version 7\n";
+        return 0;
+    }
+
+    dedup_on = enabled;
+    if (enabled && get_mounted()) {
+        dedup_rebuild();
+    } else if (!enabled) {
+        dedup_index.reset(0);
+    }
+    return 1;
+}
+
+bool INE5412_FS::fs_dedup_enabled()
+{
+    return dedup_on;
+}
+
+// Estado do índice e custo do hash, seguidos dos blocos que o mapa de
+// referências evita guardar de novo (por clones ou pela deduplicação)
+void INE5412_FS::fs_dedup_print(std::ostream &out)
+{
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+
+    out << "deduplication is " << (dedup_on ? "on" : "off") << "\n";
+    dedup_index.print(out, Disk::DISK_BLOCK_SIZE);
+
+    long long extra = 0;
+    for (int count : refcounts) {
+        extra += count;
+    }
+    out << "extra block references: " << extra << " (" << extra * Disk::DISK_BLOCK_SIZE << " bytes not stored)\n";
+}
+
+void INE5412_FS::fs_dedup_reset()
+{
+    dedup_index.reset_stats();
+}
+
+int INE5412_FS::fs_lookup(const std::string &path)
+{
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+
+    if (!get_mounted()) {
+        cerr << "disk is not mounted\n";
+        return 0;
+    }
+
+    std::vector<std::string> names;
+    if (!split_path(path, &names)) {
+        return 0;
+    }
+    return resolve(names, names.size());
+}
+
+int INE5412_FS::fs_mkdir(const std::string &path)
+{
+    return make_entry(path, true);
+}
+
+int INE5412_FS::fs_create_path(const std::string &path)
+{
+    return make_entry(path, false);
+}
+
+int INE5412_FS::fs_unlink(const std::string &path)
+{
+    return remove_entry(path, false);
+}
+
+int INE5412_FS::fs_rmdir(const std::string &path)
+{
+    return remove_entry(path, true);
+}
+
+int INE5412_FS::fs_readdir(const std::string &path, std::vector<std::tuple<std::string, int, bool>> &entries)
+{
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+
+    entries.clear();
+    if (!get_mounted()) {
+        cerr << "disk is not mounted\n";
+        return 0;
+    }
+
+    std::vector<std::string> names;
+    if (!split_path(path, &names)) {
+        return 0;
+    }
+
+    // Antes de ser criada, a raiz é um diretório vazio
+    int number = resolve(names, names.size());
+    if (!number) {
+        return names.empty() && has_directories();
+    }
+
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(number));
+    fs_inode dir;
+    if (!inode_load(number, &dir) || !dir.isvalid || !(dir.flags & INODE_DIRECTORY)) {
+        return 0;
+    }
+
+    // Os baldes são percorridos em ordem; o índice não é necessário
+    block_map_cache map;
+    union fs_block scratch;
+    for (int bucket_number = 0; bucket_number < dir.buckets; bucket_number++) {
+        int physical_block = map_block(dir, DIR_INDEX_BLOCKS + bucket_number, &map);
+        if (!physical_block) {
+            continue;
+        }
+
+        const dir_bucket &bucket = metadata_view(physical_block, &scratch)->bucket;
+        for (const dir_entry &entry : bucket.entries) {
+            fs_inode inode;
+            if (entry.inumber && dir_target(entry.inumber) && inode_load(entry.inumber, &inode)) {
+                entries.push_back(std::make_tuple(std::string(entry.name, strnlen(entry.name, DIR_NAME_MAX)),
+                                                  entry.inumber, (inode.flags & INODE_DIRECTORY) != 0));
+            }
+        }
+    }
+    return 1;
+}
+
+// Diretórios existem a partir da versão 6
+bool INE5412_FS::has_directories()
+{
+    return superblock.version >= 6;
+}
+
+// Inode da raiz, se ela já foi criada (0 caso contrário). Depois de uma
+// queda o superbloco pode apontar para uma raiz cuja criação não chegou ao
+// disco: o inode só vale se for um diretório.
+int INE5412_FS::root_inode()
+{
+    int root = superblock.rootinode;
+    fs_inode inode;
+
+    if (!has_directories() || root < 1 || root >= superblock.ninodes || !inode_load(root, &inode) ||
+        !inode.isvalid || !(inode.flags & INODE_DIRECTORY)) {
+        return 0;
+    }
+    return root;
+}
+
+// Cria a raiz, com fs_lock exclusiva, e retorna o seu inode (0 sem espaço).
+// O superbloco aponta para ela antes que a criação seja confirmada no
+// diário (ou gravada no lugar), então uma queda no meio não perde um inode.
+int INE5412_FS::make_root()
+{
+    std::unique_lock<std::shared_mutex> guard(fs_lock);
+
+    if (!get_mounted() || !has_directories()) {
+        return 0;
+    }
+    if (root_inode()) {
+        return root_inode();
+    }
+
+    int root;
+    {
+        std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+        root = inode_map.allocate_first();
+    }
+    if (root < 0) {
+        return 0;
+    }
+
+    fs_inode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.isvalid = 1;
+
+    pointer_blocks pointers;
+    block_run run;
+    if (!dir_init(&inode, root, &pointers, &run)) {
+        std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+        inode_map.clear(root);
+        return 0;
+    }
+
+    Journal::transaction txn;
+    log_run(&run, &txn);
+    flush_pointers(&pointers, &txn);
+    inode_save(root, &inode, &txn);
+
+    superblock.rootinode = root;
+    superblock_save();
+
+    if (journal) {
+        journal_submit(&txn);
+        if (!journal_commit()) {
+            checkpoint();
+        }
+    } else {
+        flush_inodes();
+        disk->sync();
+    }
+    return root;
+}
+
+// Cria um arquivo vazio ou um diretório com o caminho dado e retorna o seu
+// inode. O inode novo e a entrada no diretório pai vão para o diário numa
+// só transação.
+int INE5412_FS::make_entry(const std::string &path, bool directory)
+{
+    std::vector<std::string> names;
+    if (!split_path(path, &names) || names.empty() || names.back() == "..") {
+        return 0;
+    }
+
+    bool need_root;
+    {
+        std::shared_lock<std::shared_mutex> guard(fs_lock);
+        if (!get_mounted()) {
+            cerr << "disk is not mounted\n";
+            return 0;
+        }
+        if (!has_directories()) {
+            cerr << "directories need a disk formatted with version 6\n";
+            return 0;
+        }
+        need_root = !root_inode();
+    }
+    if (need_root && !make_root()) {
+        return 0;
+    }
+
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    if (!get_mounted() || !has_directories()) {
+        return 0;
+    }
+
+    int parent = resolve(names, names.size() - 1);
+    if (!parent) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_mutex> parent_guard(inode_lock(parent));
+    fs_inode dir;
+    if (!inode_load(parent, &dir) || !dir.isvalid || !(dir.flags & INODE_DIRECTORY) || dir_find(dir, names.back())) {
+        return 0;
+    }
+
+    int inumber;
+    {
+        std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+        inumber = inode_map.allocate_first();
+    }
+    if (inumber < 0) {
+        return 0;
+    }
+
+    fs_inode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.isvalid = 1;
+    inode.flags = INODE_LINKED;
+
+    // Os blocos de um diretório novo só vão para o diário se o nome entrar
+    pointer_blocks child_pointers;
+    block_run child_run;
+    if (directory) {
+        if (!dir_init(&inode, parent, &child_pointers, &child_run)) {
+            std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+            inode_map.clear(inumber);
+            return 0;
+        }
+    } else if (inline_limit()) {
+        inode.flags |= INODE_INLINE;
+    }
+
+    // Mesmo sem espaço para o nome, o que o dir_insert já alterou no pai
+    // (uma divisão de balde) é válido e vai para o diário
+    Journal::transaction txn;
+    pointer_blocks pointers;
+    block_run run;
+    bool parent_changed = false;
+    int inserted = dir_insert(&dir, names.back(), inumber, &pointers, &run, &parent_changed);
+
+    release_run(&run);
+    log_run(&run, &txn);
+    flush_pointers(&pointers, &txn);
+    if (parent_changed) {
+        inode_save(parent, &dir, &txn);
+    }
+
+    if (inserted) {
+        log_run(&child_run, &txn);
+        flush_pointers(&child_pointers, &txn);
+        inode_save(inumber, &inode, &txn);
+    } else {
+        forget_run(&child_run);
+        std::lock_guard<std::mutex> allocator_guard(allocator_lock);
+        inode_map.clear(inumber);
+    }
+    journal_submit(&txn);
+
+    return inserted ? inumber : 0;
+}
+
+// Remove o arquivo, ou o diretório vazio, com o caminho dado: a entrada e o
+// inode saem numa só transação
+int INE5412_FS::remove_entry(const std::string &path, bool directory)
+{
+    std::vector<std::string> names;
+    if (!split_path(path, &names) || names.empty() || names.back() == "..") {
+        return 0;
+    }
+
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    if (!get_mounted()) {
+        cerr << "disk is not mounted\n";
+        return 0;
+    }
+
+    int parent = resolve(names, names.size() - 1);
+    if (!parent) {
+        return 0;
+    }
+
+    int kind = INODE_LINKED | (directory ? INODE_DIRECTORY : 0);
+    block_refs refs;
+    Journal::transaction txn;
+    {
+        // O nome é procurado com a trava do pai compartilhada e de novo com
+        // as duas travas, já que a entrada pode ter mudado entre as consultas
+        std::unique_lock<std::shared_mutex> first, second;
+        fs_inode dir, inode;
+        int child;
+        while (true) {
+            {
+                std::shared_lock<std::shared_mutex> parent_guard(inode_lock(parent));
+                if (!inode_load(parent, &dir) || !dir.isvalid || !(dir.flags & INODE_DIRECTORY)) {
+                    return 0;
+                }
+                child = dir_find(dir, names.back());
+            }
+            if (!child) {
+                return 0;
+            }
+
+            lock_pair(parent, child, &first, &second);
+            if (inode_load(parent, &dir) && dir.isvalid && (dir.flags & INODE_DIRECTORY) && dir_find(dir, names.back()) == child) {
+                break;
+            }
+            first = std::unique_lock<std::shared_mutex>();
+            second = std::unique_lock<std::shared_mutex>();
+        }
+
+        if (!inode_load(child, &inode) || (inode.flags & (INODE_LINKED | INODE_DIRECTORY)) != kind ||
+            (directory && inode.entries > 0)) {
+            return 0;
+        }
+
+        pointer_blocks pointers;
+        dir_remove(&dir, names.back(), &pointers);
+        flush_pointers(&pointers, &txn);
+        inode_save(parent, &dir, &txn);
+        release_inode(child, kind, &refs, &txn);
+
+        // A transação vai para o diário antes que outra operação no mesmo
+        // diretório possa registrar as suas, ou a recuperação as inverteria
+        free_blocks(&refs, std::vector<int>(1, child), &txn);
+    }
+    return 1;
+}
+
+// Separa os nomes de um caminho absoluto, sem os vazios e os "."; os ".."
+// ficam para o resolve. Retorna false se o caminho não começar com "/" ou
+// tiver um nome longo demais.
+bool INE5412_FS::split_path(const std::string &path, std::vector<std::string> *names)
+{
+    if (path.empty() || path[0] != '/') {
+        return false;
+    }
+
+    size_t begin = 1;
+    while (begin <= path.size()) {
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+
+        std::string name = path.substr(begin, end - begin);
+        if (name.size() > DIR_NAME_MAX) {
+            return false;
+        }
+        if (!name.empty() && name != ".") {
+            names->push_back(name);
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+// Inode dado pelos count primeiros nomes, a partir da raiz (0 se algum não
+// existir ou se um nome do meio não for um diretório). Cada diretório do
+// caminho fica travado só enquanto é consultado.
+int INE5412_FS::resolve(const std::vector<std::string> &names, size_t count)
+{
+    int current = root_inode();
+
+    for (size_t i = 0; i < count && current; i++) {
+        std::shared_lock<std::shared_mutex> inode_guard(inode_lock(current));
+        fs_inode dir;
+        if (!inode_load(current, &dir) || !dir.isvalid || !(dir.flags & INODE_DIRECTORY)) {
+            return 0;
+        }
+        current = names[i] == ".." ? dir.parent : dir_find(dir, names[i]);
+    }
+    return current;
+}
+
+// Trava exclusivamente os inodes a e b (um diretório e um inode dele), na
+// ordem das travas, para não travar em ciclo com outro lock_pair; se os
+// dois compartilham a trava, ela é tomada uma vez só, em first
+void INE5412_FS::lock_pair(int a, int b, std::unique_lock<std::shared_mutex> *first, std::unique_lock<std::shared_mutex> *second)
+{
+    std::shared_mutex *lower = &inode_lock(a), *upper = &inode_lock(b);
+    if (upper < lower) {
+        std::swap(lower, upper);
+    }
+
+    *first = std::unique_lock<std::shared_mutex>(*lower);
+    if (upper != lower) {
+        *second = std::unique_lock<std::shared_mutex>(*upper);
+    }
+}
+
+// FNV-1a do nome; os bits baixos escolhem a posição no índice
+unsigned int INE5412_FS::name_hash(const std::string &name)
+{
+    unsigned int hash = 2166136261u;
+    for (unsigned char byte : name) {
+        hash = (hash ^ byte) * 16777619u;
+    }
+    return hash;
+}
+
+// Transforma o inode num diretório vazio, filho de parent: um bloco de
+// índice, com o único número de balde em 0, e o balde 0, ambos zerados.
+// Os blocos saem de run; sem espaço eles voltam ao mapa e retorna 0.
+int INE5412_FS::dir_init(fs_inode *dir, int parent, pointer_blocks *pointers, block_run *run)
+{
+    bool inode_changed = false;
+
+    dir->flags |= INODE_DIRECTORY;
+    dir->depth = 0;
+    dir->buckets = 1;
+    dir->entries = 0;
+    dir->parent = parent;
+    dir->size = (long long) (DIR_INDEX_BLOCKS + dir->buckets) * Disk::DISK_BLOCK_SIZE;
+
+    if (dir_map(dir, 0, pointers, run, &inode_changed) == -1 ||
+        dir_map(dir, DIR_INDEX_BLOCKS, pointers, run, &inode_changed) == -1) {
+        forget_run(run);
+        return 0;
+    }
+    release_run(run);
+    return 1;
+}
+
+// Bloco físico do bloco block_number do diretório, alocado se ainda não
+// existir (-1 sem espaço). Como os blocos de ponteiros, os blocos do
+// diretório são alterados em pointers e vão para o diário no flush_pointers;
+// um bloco novo começa zerado.
+int INE5412_FS::dir_map(fs_inode *dir, int block_number, pointer_blocks *pointers, block_run *run, bool *inode_changed)
+{
+    bool fresh = false;
+    int physical_block = map_alloc(dir, block_number, pointers, run, 1, &fresh, inode_changed, nullptr, 0);
+
+    if (physical_block > 0 && fresh) {
+        union fs_block *created = new fs_block;
+        memset(created->data, 0, sizeof(created->data));
+        pointers->blocks[physical_block].reset(created);
+        pointers->dirty.insert(physical_block);
+        pointers->created.insert(physical_block);
+    }
+    return physical_block;
+}
+
+// Marca como alterados os inteiros dos size bytes de field, dentro do
+// bloco blocknum de pointers
+void INE5412_FS::dir_changed(pointer_blocks *pointers, int blocknum, const void *field, int size)
+{
+    int first = ((const char *) field - pointers->blocks[blocknum]->data) / (int) sizeof(int);
+    int count = (size + (int) sizeof(int) - 1) / (int) sizeof(int);
+
+    for (int i = first; i < first + count; i++) {
+        pointers->changes.push_back(std::make_pair(blocknum, i));
+    }
+    pointers->dirty.insert(blocknum);
+}
+
+// Inode guardado com o nome no diretório, ou 0: um bloco do índice e um
+// balde, lidos com as alterações ainda não gravadas no lugar
+int INE5412_FS::dir_find(const fs_inode &dir, const std::string &name)
+{
+    unsigned int hash = name_hash(name);
+    unsigned int slot = hash & ((1u << dir.depth) - 1);
+    block_map_cache map;
+    union fs_block scratch;
+
+    int index_block = map_block(dir, slot / POINTERS_PER_BLOCK, &map);
+    if (!index_block) {
+        return 0;
+    }
+    int bucket_number = metadata_view(index_block, &scratch)->pointers[slot % POINTERS_PER_BLOCK];
+
+    int bucket_block = map_block(dir, DIR_INDEX_BLOCKS + bucket_number, &map);
+    if (!bucket_block) {
+        return 0;
+    }
+
+    const dir_bucket &bucket = metadata_view(bucket_block, &scratch)->bucket;
+    for (const dir_entry &entry : bucket.entries) {
+        if (entry.inumber && entry.hash == hash && !strncmp(entry.name, name.c_str(), DIR_NAME_MAX)) {
+            return dir_target(entry.inumber) ? entry.inumber : 0;
+        }
+    }
+    return 0;
+}
+
+// Uma entrada só vale se o inode for válido e tiver nome: sem diário, uma
+// queda pode deixar no disco entradas de inodes que não chegaram a ele
+bool INE5412_FS::dir_target(int inumber)
+{
+    fs_inode inode;
+    return inumber >= 1 && inumber < superblock.ninodes && inode_load(inumber, &inode) &&
+           inode.isvalid && (inode.flags & INODE_LINKED);
+}
+
+// Acrescenta o nome ao diretório, que deve estar travado exclusivamente.
+// Um balde cheio é dividido (antes, com tantos bits quanto o índice, o
+// índice dobra) até o nome caber. Retorna 0 se o nome já existir, se o
+// índice estiver no tamanho máximo ou sem espaço no disco; as alterações
+// feitas até ali continuam válidas.
+int INE5412_FS::dir_insert(fs_inode *dir, const std::string &name, int inumber, pointer_blocks *pointers, block_run *run, bool *inode_changed)
+{
+    unsigned int hash = name_hash(name);
+
+    while (true) {
+        unsigned int slot = hash & ((1u << dir->depth) - 1);
+        int index_block = dir_map(dir, slot / POINTERS_PER_BLOCK, pointers, run, inode_changed);
+        if (index_block == -1) {
+            return 0;
+        }
+
+        int bucket_number = pointer_block(pointers, index_block)->pointers[slot % POINTERS_PER_BLOCK];
+        int bucket_block = dir_map(dir, DIR_INDEX_BLOCKS + bucket_number, pointers, run, inode_changed);
+        if (bucket_block == -1) {
+            return 0;
+        }
+        dir_bucket &bucket = pointer_block(pointers, bucket_block)->bucket;
+
+        // Uma entrada com o mesmo nome só é reaproveitada se o seu inode não valer mais
+        dir_entry *free_entry = nullptr;
+        for (dir_entry &entry : bucket.entries) {
+            if (entry.inumber && entry.hash == hash && !strncmp(entry.name, name.c_str(), DIR_NAME_MAX)) {
+                if (dir_target(entry.inumber)) {
+                    return 0;
+                }
+                entry.inumber = inumber;
+                dir_changed(pointers, bucket_block, &entry.inumber, sizeof(entry.inumber));
+                return 1;
+            }
+            if (!entry.inumber && !free_entry) {
+                free_entry = &entry;
+            }
+        }
+
+        if (free_entry) {
+            free_entry->inumber = inumber;
+            free_entry->hash = hash;
+            memset(free_entry->name, 0, sizeof(free_entry->name));
+            memcpy(free_entry->name, name.data(), name.size());
+            bucket.count++;
+
+            dir_changed(pointers, bucket_block, free_entry, sizeof(*free_entry));
+            dir_changed(pointers, bucket_block, &bucket.count, sizeof(bucket.count));
+            dir->entries++;
+            *inode_changed = true;
+            return 1;
+        }
+
+        // O índice dobra: a metade nova aponta para os mesmos baldes
+        if (bucket.depth == dir->depth) {
+            if (dir->depth == DIR_MAX_DEPTH) {
+                return 0;
+            }
+
+            int half = 1 << dir->depth;
+            for (int i = 0; i < half; i++) {
+                int from = dir_map(dir, i / POINTERS_PER_BLOCK, pointers, run, inode_changed);
+                int to = dir_map(dir, (half + i) / POINTERS_PER_BLOCK, pointers, run, inode_changed);
+                if (to == -1) {
+                    return 0;
+                }
+
+                int *target = &pointer_block(pointers, to)->pointers[(half + i) % POINTERS_PER_BLOCK];
+                *target = pointer_block(pointers, from)->pointers[i % POINTERS_PER_BLOCK];
+                dir_changed(pointers, to, target, sizeof(*target));
+            }
+            dir->depth++;
+            *inode_changed = true;
+        }
+
+        // O balde se divide pelo próximo bit do hash: as entradas com o bit
+        // vão para um balde novo, no fim do diretório
+        int sibling_number = dir->buckets;
+        int sibling_block = dir_map(dir, DIR_INDEX_BLOCKS + sibling_number, pointers, run, inode_changed);
+        if (sibling_block == -1) {
+            return 0;
+        }
+        dir->buckets++;
+        dir->size = (long long) (DIR_INDEX_BLOCKS + dir->buckets) * Disk::DISK_BLOCK_SIZE;
+        *inode_changed = true;
+
+        dir_bucket &sibling = pointer_block(pointers, sibling_block)->bucket;
+        unsigned int bit = 1u << bucket.depth;
+
+        for (dir_entry &entry : bucket.entries) {
+            if (entry.inumber && (entry.hash & bit)) {
+                sibling.entries[sibling.count++] = entry;
+                memset(&entry, 0, sizeof(entry));
+                bucket.count--;
+                dir_changed(pointers, bucket_block, &entry, sizeof(entry));
+            }
+        }
+        bucket.depth++;
+        sibling.depth = bucket.depth;
+        dir_changed(pointers, bucket_block, &bucket.depth, 2 * sizeof(int));
+        dir_changed(pointers, sibling_block, &sibling, (const char *) &sibling.entries[sibling.count] - (const char *) &sibling);
+
+        // As posições do índice que apontavam para o balde e têm o bit passam para o novo
+        for (unsigned int i = (hash & (bit - 1)) | bit; i < (1u << dir->depth); i += 2 * bit) {
+            int block = dir_map(dir, i / POINTERS_PER_BLOCK, pointers, run, inode_changed);
+            if (block == -1) {
+                return 0;
+            }
+
+            int *target = &pointer_block(pointers, block)->pointers[i % POINTERS_PER_BLOCK];
+            *target = sibling_number;
+            dir_changed(pointers, block, target, sizeof(*target));
+        }
+    }
+}
+
+// Tira o nome do diretório, que deve estar travado exclusivamente, e
+// retorna o inode que ele tinha (0 se não havia). Os baldes não se juntam.
+int INE5412_FS::dir_remove(fs_inode *dir, const std::string &name, pointer_blocks *pointers)
+{
+    unsigned int hash = name_hash(name);
+    unsigned int slot = hash & ((1u << dir->depth) - 1);
+    block_map_cache map;
+
+    int index_block = map_block(*dir, slot / POINTERS_PER_BLOCK, &map);
+    if (!index_block) {
+        return 0;
+    }
+    int bucket_number = pointer_block(pointers, index_block)->pointers[slot % POINTERS_PER_BLOCK];
+
+    int bucket_block = map_block(*dir, DIR_INDEX_BLOCKS + bucket_number, &map);
+    if (!bucket_block) {
+        return 0;
+    }
+
+    dir_bucket &bucket = pointer_block(pointers, bucket_block)->bucket;
+    for (dir_entry &entry : bucket.entries) {
+        if (entry.inumber && entry.hash == hash && !strncmp(entry.name, name.c_str(), DIR_NAME_MAX)) {
+            int inumber = entry.inumber;
+            memset(&entry, 0, sizeof(entry));
+            bucket.count--;
+
+            dir_changed(pointers, bucket_block, &entry, sizeof(entry));
+            dir_changed(pointers, bucket_block, &bucket.count, sizeof(bucket.count));
+            dir->entries--;
+            return inumber;
+        }
+    }
+    return 0;
+}
+
+// Aplica as mudanças de referências da operação, registra-as na transação,
+// que vai para o diário, e só então devolve aos mapas os inodes liberados:
+// quem os reutilizar aparece depois no diário. Uma referência largada
+// libera o bloco (e larga as dos filhos de um bloco de ponteiros) só se ele
+// não tiver outro dono. Com blocos compartilhados, tudo acontece sob
+// share_lock, para que o diário tenha as mudanças de um mesmo bloco na
+// ordem em que foram decididas. Com diário os blocos só voltam ao mapa
+// depois que a transação for confirmada (no journal_commit ou no
+// checkpoint): um bloco reutilizado por um arquivo é gravado no lugar na
+// hora, e depois de uma queda antes do commit ele ainda seria do dono antigo.
+void INE5412_FS::free_blocks(block_refs *refs, const std::vector<int> &inumbers, Journal::transaction *txn)
+{
+    // Sem nenhum bloco compartilhado e sem deduplicação, ninguém mais pode
+    // compartilhar os da operação, que só são liberados; com ela, um
+    // dedup_find pode dar um dono a um deles a qualquer momento
+    std::unique_lock<std::mutex> share_guard(share_lock, std::defer_lock);
+    bool counted = !refcounts.empty() && (sharing.load(std::memory_order_acquire) || !refs->shared.empty() || !refs->linked.empty() ||
+                                          dedup_active());
+    if (counted) {
+        share_guard.lock();
+    }
+
+    std::vector<int> shared = refs->shared, freed, unshared;
+    if (!shared.empty()) {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        for (int block : shared) {
+            refcount_add(block, 1);
+        }
+    }
+    for (auto &ref : refs->dropped) {
+        drop_tree(ref.first, ref.second, counted, &freed, &unshared);
+    }
+
+    // Os contadores dos blocos achados pela deduplicação só vão para o diário
+    shared.insert(shared.end(), refs->linked.begin(), refs->linked.end());
+    shared.insert(shared.end(), unshared.begin(), unshared.end());
+    log_refcounts(txn, shared);
+    log_blocks(txn, RECORD_FREE, freed);
+    journal_submit(txn);
+    if (share_guard.owns_lock()) {
+        share_guard.unlock();
+    }
+
+    // Um bloco de ponteiros liberado não pode ir para o disco no próximo
+    // checkpoint, por cima de quem o reutilizar
+    if (journal) {
+        std::lock_guard<std::mutex> guard(metadata_lock);
+        for (int block : freed) {
+            metadata_blocks.erase(block);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        for (int inumber : inumbers) {
+            inode_map.clear(inumber);
+        }
+        if (journal) {
+            uncommitted_frees.insert(uncommitted_frees.end(), freed.begin(), freed.end());
+            uncommitted_unshares.insert(uncommitted_unshares.end(), unshared.begin(), unshared.end());
+            return;
+        }
+    }
+    return_blocks(freed);
+}
+
+// Larga uma referência à árvore com raiz em block (depth níveis de blocos
+// de ponteiros acima dos dados, como no walk_tree): se counted e o bloco
+// tiver outro dono, ele só perde um (vai para unshared); senão vai para
+// freed e os filhos de um bloco de ponteiros perdem a referência dele. O
+// bloco sai do índice de deduplicação na mesma seção de allocator_lock em
+// que o contador é conferido, para que nenhum dedup_find o encontre depois.
+void INE5412_FS::drop_tree(int block, int depth, bool counted, std::vector<int> *freed, std::vector<int> *unshared)
+{
+    if (!block) {
+        return;
+    }
+
+    if (counted) {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        if (refcounts[block] > 0) {
+            refcount_add(block, -1);
+            unshared->push_back(block);
+
+            // O outro dono só pode alterar o bloco no lugar depois do commit
+            if (journal && recent_unshares[block]++ == 0) {
+                sharing++;
+            }
+            return;
+        }
+        dedup_index.forget(block);
+    }
+
+    freed->push_back(block);
+    if (depth == 0) {
+        return;
+    }
+
+    union fs_block scratch;
+    const union fs_block *pointers = metadata_view(block, &scratch);
+    for (int pointer : pointers->pointers) {
+        drop_tree(pointer, depth - 1, counted, freed, unshared);
+    }
+}
+
+// Devolve os blocos ao mapa e o seu espaço ao hospedeiro, agrupando os contíguos
+void INE5412_FS::return_blocks(std::vector<int> &blocks)
+{
+    std::sort(blocks.begin(), blocks.end());
+    {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        for (int block : blocks) {
+            bitmap.clear(block);
+        }
+    }
+
+    for (auto &run : block_runs(blocks)) {
+        disk->discard(run.first, run.second);
+    }
+}
+
+// Trechos (início, tamanho) de blocos consecutivos de uma lista ordenada
+std::vector<std::pair<int, int>> INE5412_FS::block_runs(const std::vector<int> &blocks)
+{
+    std::vector<std::pair<int, int>> runs;
+    size_t first = 0;
+    while (first < blocks.size()) {
+        size_t last = first + 1;
+        while (last < blocks.size() && blocks[last] == blocks[last - 1] + 1) {
+            last++;
+        }
+        runs.push_back(std::make_pair(blocks[first], (int) (last - first)));
+        first = last;
+    }
+    return runs;
+}
+
+// Registra os blocos (ordenados antes) como trechos consecutivos do tipo dado
+void INE5412_FS::log_blocks(Journal::transaction *txn, int type, std::vector<int> &blocks)
+{
+    std::sort(blocks.begin(), blocks.end());
+    for (auto &run : block_runs(blocks)) {
+        log_record(txn, type, run.first, 0, run.second, nullptr, 0);
+    }
+}
+
+// Registra o valor atual dos contadores dos blocos (ordenados e sem
+// repetições antes) em trechos consecutivos, cortados para que cada registro
+// caiba num bloco do diário. Chamado com share_lock, para que a ordem dos
+// registros no diário seja a dos valores.
+void INE5412_FS::log_refcounts(Journal::transaction *txn, std::vector<int> &blocks)
+{
+    if (!journal) {
+        return;
+    }
+
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    int limit = (Journal::max_record() - (int) sizeof(journal_record)) / (int) sizeof(int);
+    for (auto &run : block_runs(blocks)) {
+        for (int first = run.first; first < run.first + run.second; first += limit) {
+            int count = min(limit, run.first + run.second - first);
+            std::vector<int> counts;
+            {
+                std::lock_guard<std::mutex> guard(allocator_lock);
+                counts.assign(refcounts.begin() + first, refcounts.begin() + first + count);
+            }
+            log_record(txn, RECORD_REFS, first, 0, count, counts.data(), count * sizeof(int));
+        }
+    }
+}
+
+// Um bloco em uso que o arquivo vai alterar precisa ser trocado por uma
+// cópia: outro arquivo também o usa ou o usava numa transação ainda não
+// confirmada. Com rewrite (um bloco de dados a ser gravado no lugar), um
+// bloco só do arquivo sai do índice de deduplicação na mesma seção
+// crítica, antes que o dedup_find possa dar a ele outro dono.
+bool INE5412_FS::block_shared(int block, bool rewrite)
+{
+    if (!sharing.load(std::memory_order_acquire) && !(rewrite && dedup_active())) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(allocator_lock);
+    if (refcounts[block] > 0 || recent_unshares.count(block)) {
+        return true;
+    }
+    if (rewrite) {
+        dedup_index.forget(block);
+    }
+    return false;
+}
+
+// Soma delta aos donos extras do bloco; chamado com allocator_lock
+void INE5412_FS::refcount_add(int block, int delta)
+{
+    int before = refcounts[block];
+    refcounts[block] = max(before + delta, 0);
+    refcount_dirty[block / REFCOUNTS_PER_BLOCK] = true;
+
+    if (!before != !refcounts[block]) {
+        sharing += refcounts[block] ? 1 : -1;
+    }
+}
+
+// A deduplicação está ligada e o disco montado tem o mapa de referências
+bool INE5412_FS::dedup_active()
+{
+    return dedup_on.load(std::memory_order_relaxed) && !refcounts.empty();
+}
+
+// Bloco em uso com o mesmo conteúdo que data (0 se não houver); hash recebe
+// o hash de data. Os blocos em pending vão ser gravados pela escrita atual
+// com o conteúdo dado. O candidato do índice é comparado byte a byte fora da
+// trava e só ganha o dono se, de volta nela, ainda tiver aquele conteúdo: um
+// dono que o grave no lugar o tira do índice antes (no block_shared), e
+// depois do novo dono o trocaria por uma cópia.
+int INE5412_FS::dedup_find(const char *data, const std::unordered_map<int, const char *> &pending, uint64_t *hash)
+{
+    auto start = std::chrono::steady_clock::now();
+    *hash = Dedup_Index::hash(data, Disk::DISK_BLOCK_SIZE);
+    dedup_index.record_hash(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+    int candidate;
+    {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        candidate = dedup_index.lookup(*hash);
+    }
+    if (!candidate) {
+        return 0;
+    }
+
+    union fs_block scratch;
+    auto written = pending.find(candidate);
+    const char *current = written != pending.end() ? written->second : block_view(candidate, &scratch)->data;
+    bool equal = !memcmp(current, data, Disk::DISK_BLOCK_SIZE);
+    dedup_index.record_match(equal);
+    if (!equal) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> guard(allocator_lock);
+    if (!dedup_index.matches(candidate, *hash)) {
+        return 0;
+    }
+    refcount_add(candidate, 1);
+    return candidate;
+}
+
+// Reconstrói o índice com o hash de cada bloco de dados dos arquivos (os
+// diretórios e os arquivos guardados no inode ficam de fora). Chamado com
+// fs_lock exclusiva.
+void INE5412_FS::dedup_rebuild()
+{
+    dedup_index.reset(superblock.nblocks);
+
+    union fs_block scratch;
+    auto index_block = [&](int block) {
+        const union fs_block *current = block_view(block, &scratch);
+        auto start = std::chrono::steady_clock::now();
+        uint64_t hash = Dedup_Index::hash(current->data, Disk::DISK_BLOCK_SIZE);
+        dedup_index.record_hash(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        dedup_index.insert(hash, block);
+    };
+
+    for (int inumber = 1; inumber < superblock.ninodes; inumber++) {
+        fs_inode inode;
+        if (!inode_map.test(inumber) || !inode_load(inumber, &inode) || !inode.isvalid ||
+            (inode.flags & (INODE_INLINE | INODE_DIRECTORY))) {
+            continue;
+        }
+
+        for (int direct_block : inode.direct) {
+            if (direct_block) {
+                index_block(direct_block);
+            }
+        }
+        int roots[INDIRECT_LEVELS] = {inode.indirect, inode.dindirect, inode.tindirect};
+        for (int depth = 1; depth <= INDIRECT_LEVELS; depth++) {
+            walk_tree(roots[depth - 1], depth, [&](int block, int level) {
+                if (level == 0) {
+                    index_block(block);
+                }
+            });
+        }
+    }
+}
+
+// Blocos do mapa de referências no disco montado (0 antes da versão 7)
+int INE5412_FS::refcount_blocks()
+{
+    return superblock.version >= 7 ? superblock.nrefblocks : 0;
+}
+
+// Maior arquivo guardado dentro do inode no disco montado (0 antes da versão 5)
+int INE5412_FS::inline_limit()
+{
+    return superblock.version >= 5 ? INLINE_BYTES : 0;
+}
+
+// Conteúdo de um arquivo guardado no inode, no lugar dos ponteiros
+char *INE5412_FS::inline_data(fs_inode *inode)
+{
+    return (char *) inode->direct;
+}
+
+// Tira o arquivo de dentro do inode: os bytes guardados nele vão para
+// block (completado com zeros), que o chamador grava no bloco 0 do
+// arquivo, e os ponteiros voltam a ser ponteiros. Retorna o bloco 0
+// alocado, 0 se o arquivo estava vazio (continua um buraco) ou -1 sem
+// espaço, caso em que o inode fica como estava. O bloco sai de run, que
+// reserva wanted blocos se estiver vazio.
+int INE5412_FS::promote_inline(fs_inode *inode, pointer_blocks *pointers, block_run *run, int wanted, char *block, bool *inode_changed)
+{
+    fs_inode promoted = *inode;
+    memset(block, 0, Disk::DISK_BLOCK_SIZE);
+    memcpy(block, inline_data(&promoted), INLINE_BYTES);
+
+    promoted.flags &= ~INODE_INLINE;
+    memset(inline_data(&promoted), 0, INLINE_BYTES);
+
+    int physical_block = 0;
+    if (promoted.size > 0) {
+        bool fresh = false;
+        physical_block = map_alloc(&promoted, 0, pointers, run, wanted, &fresh, inode_changed, nullptr, 0);
+        if (physical_block == -1) {
+            return -1;
+        }
+    }
+
+    *inode = promoted;
+    *inode_changed = true;
+    return physical_block;
+}
+
+// Níveis de blocos de ponteiros que os inodes do disco montado podem usar:
+// o formato antigo só tem o bloco indireto simples
+int INE5412_FS::max_depth()
+{
+    return superblock.version >= 2 ? INDIRECT_LEVELS : 1;
+}
+
+// Tamanho máximo de arquivo, em blocos
+long long INE5412_FS::max_file_blocks()
+{
+    long long total = POINTERS_PER_INODE, span = 1;
+    for (int depth = 1; depth <= max_depth(); depth++) {
+        span *= POINTERS_PER_BLOCK;
+        total += span;
+    }
+    return total;
+}
+
+// Caminho até o bloco block_number do arquivo: retorna a profundidade
+// (0 = ponteiro direto, 1 a 3 = árvore indireta, dupla ou tripla) e o índice
+// usado em cada nível, da raiz para as folhas; -1 além do tamanho máximo
+int INE5412_FS::block_path(int block_number, int indices[])
+{
+    if (block_number < 0) {
+        return -1;
+    }
+    if (block_number < POINTERS_PER_INODE) {
+        indices[0] = block_number;
+        return 0;
+    }
+
+    long long rest = block_number - POINTERS_PER_INODE, span = 1;
+    for (int depth = 1; depth <= max_depth(); depth++) {
+        span *= POINTERS_PER_BLOCK;
+        if (rest < span) {
+            for (int level = depth - 1; level >= 0; level--) {
+                indices[level] = rest % POINTERS_PER_BLOCK;
+                rest /= POINTERS_PER_BLOCK;
+            }
+            return depth;
+        }
+        rest -= span;
+    }
+    return -1;
+}
+
+// Bloco físico do bloco block_number do arquivo (0 se não alocado). O
+// último bloco de ponteiros lido em cada nível fica decodificado em cache,
+// então leituras vizinhas, mesmo em deslocamentos profundos, só voltam ao
+// disco quando o caminho muda.
+int INE5412_FS::map_block(const fs_inode &inode, int block_number, block_map_cache *cache)
+{
+    int indices[INDIRECT_LEVELS];
+    int depth = block_path(block_number, indices);
+    if (depth <= 0) {
+        return depth == 0 ? inode.direct[indices[0]] : 0;
+    }
+
+    int roots[INDIRECT_LEVELS] = {inode.indirect, inode.dindirect, inode.tindirect};
+    int block = roots[depth - 1];
+
+    for (int level = 0; level < depth && block; level++) {
+        if (cache->blocknum[level] != block) {
+            union fs_block scratch;
+            const union fs_block *pointers = metadata_view(block, &scratch);
+
+            cache->pointers[level].assign(pointers->pointers, pointers->pointers + POINTERS_PER_BLOCK);
+            cache->blocknum[level] = block;
+        }
+        block = cache->pointers[level][indices[level]];
+    }
+    return block;
+}
+
+// Como map_block, mas aloca o bloco de dados e os blocos de ponteiros que
+// faltarem no caminho (fresh indica um bloco de dados novo). Os blocos de
+// ponteiros ficam em pointers até o flush_pointers. Um bloco de ponteiros
+// compartilhado no caminho é trocado por uma cópia só do arquivo, cujos
+// filhos ganham um dono (só no free_blocks; até lá, ficam em inherited e
+// também contam como compartilhados); com copied, o bloco de dados compartilhado também,
+// e copied recebe o bloco antigo (0 se não houve troca), que o chamador lê
+// se a escrita for parcial. Com link, o bloco de dados passa a ser link (um
+// bloco em uso que já ganhou um dono) e o antigo é largado. Retorna -1 sem
+// espaço no disco ou além do tamanho máximo de arquivo.
+int INE5412_FS::map_alloc(fs_inode *inode, int block_number, pointer_blocks *pointers, block_run *run, int wanted, bool *fresh, bool *inode_changed, int *copied, int link)
+{
+    int indices[INDIRECT_LEVELS];
+    int depth = block_path(block_number, indices);
+    if (depth < 0) {
+        return -1;
+    }
+
+    int *roots[INDIRECT_LEVELS] = {&inode->indirect, &inode->dindirect, &inode->tindirect};
+    int *slot = depth == 0 ? &inode->direct[indices[0]] : roots[depth - 1];
+    int parent = 0; // bloco de ponteiros que contém slot (0 = o próprio inode)
+    int parent_index = 0; // e a posição de slot nele
+
+    for (int level = 0; ; level++) {
+        // O antigo é largado mesmo que seja o próprio link: o dono a mais
+        // se desfaz no free_blocks
+        if (level == depth && link) {
+            if (*slot) {
+                pointers->refs.dropped.push_back(std::make_pair(*slot, 0));
+            }
+            *slot = link;
+            if (parent) {
+                pointers->dirty.insert(parent);
+                pointers->changes.push_back(std::make_pair(parent, parent_index));
+            } else {
+                *inode_changed = true;
+            }
+            return link;
+        }
+
+        // Um bloco compartilhado conta como ausente, mas a cópia herda o seu
+        // conteúdo: o de um bloco de ponteiros vem já, o de dados o chamador lê
+        int shared = 0;
+        if (*slot && (level < depth || copied) && !pointers->exclusive.count(*slot)) {
+            if (pointers->inherited.count(*slot) || block_shared(*slot, level == depth)) {
+                shared = *slot;
+                *slot = 0;
+            } else if (level < depth) {
+                pointers->exclusive.insert(*slot);
+            }
+        }
+
+        if (!*slot) {
+            // Os blocos de ponteiros do caminho também saem do trecho reservado
+            int new_block = search_block(run, wanted + depth - level);
+            if (new_block == -1) {
+                *slot = shared;
+                return -1;
+            }
+
+            *slot = new_block;
+            if (parent) {
+                pointers->dirty.insert(parent);
+                pointers->changes.push_back(std::make_pair(parent, parent_index));
+            } else {
+                *inode_changed = true;
+            }
+
+            if (shared) {
+                pointers->refs.dropped.push_back(std::make_pair(shared, depth - level));
+            }
+
+            if (level == depth) {
+                *fresh = !shared;
+                if (copied) {
+                    *copied = shared;
+                }
+            } else {
+                // O bloco pode conter ponteiros antigos de um arquivo apagado
+                union fs_block *created = new fs_block;
+                memset(created->data, 0, sizeof(created->data));
+                pointers->blocks[new_block].reset(created);
+                pointers->dirty.insert(new_block);
+                pointers->created.insert(new_block);
+
+                if (shared) {
+                    *created = *pointer_block(pointers, shared);
+                    for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+                        if (created->pointers[i]) {
+                            pointers->refs.shared.push_back(created->pointers[i]);
+                            pointers->inherited.insert(created->pointers[i]);
+                            pointers->changes.push_back(std::make_pair(new_block, i));
+                        }
+                    }
+                }
+            }
+        }
+
+        if (level == depth) {
+            return *slot;
+        }
+        parent = *slot;
+        parent_index = indices[level];
+        slot = &pointer_block(pointers, parent)->pointers[indices[level]];
+    }
+}
+
+// Bloco de ponteiros blocknum, lido na primeira vez na chamada
+union INE5412_FS::fs_block *INE5412_FS::pointer_block(pointer_blocks *pointers, int blocknum)
+{
+    std::unique_ptr<union fs_block> &block = pointers->blocks[blocknum];
+    if (!block) {
+        block.reset(new fs_block);
+        const union fs_block *current = metadata_view(blocknum, block.get());
+        if (current != block.get()) {
+            *block = *current;
+        }
+    }
+    return block.get();
+}
+
+// Grava os blocos de ponteiros alterados, em ordem, numa só requisição.
+// Com diário eles passam para metadata_blocks até o próximo checkpoint e a
+// transação recebe os blocos criados e os ponteiros alterados, agrupados
+// em trechos consecutivos de um mesmo bloco.
+void INE5412_FS::flush_pointers(pointer_blocks *pointers, Journal::transaction *txn)
+{
+    if (journal) {
+        for (int blocknum : pointers->created) {
+            log_record(txn, RECORD_ZERO, blocknum, 0, 0, nullptr, 0);
+        }
+
+        std::vector<std::pair<int, int>> &changes = pointers->changes;
+        std::sort(changes.begin(), changes.end());
+        changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+
+        int limit = (Journal::max_record() - (int) sizeof(journal_record)) / (int) sizeof(int);
+        size_t first = 0;
+        while (first < changes.size()) {
+            size_t last = first + 1;
+            while (last < changes.size() && (int) (last - first) < limit &&
+                   changes[last].first == changes[first].first &&
+                   changes[last].second == changes[last - 1].second + 1) {
+                last++;
+            }
+
+            int blocknum = changes[first].first, index = changes[first].second, count = last - first;
+            log_record(txn, RECORD_POINTERS, blocknum, index, count, &pointers->blocks[blocknum]->pointers[index], count * sizeof(int));
+            first = last;
+        }
+
+        std::lock_guard<std::mutex> guard(metadata_lock);
+        for (int blocknum : pointers->dirty) {
+            metadata_blocks[blocknum] = std::move(pointers->blocks[blocknum]);
+        }
+    } else {
+        std::vector<std::pair<int, const char *>> pointer_writes;
+
+        for (int blocknum : pointers->dirty) {
+            pointer_writes.push_back(std::make_pair(blocknum, (const char *) pointers->blocks[blocknum]->data));
+        }
+        disk->writev(pointer_writes);
+    }
+
+    pointers->dirty.clear();
+    pointers->created.clear();
+    pointers->changes.clear();
+}
+
+// Percorre a árvore com raiz em block, que tem depth níveis de blocos de
+// ponteiros acima dos dados, chamando visit(bloco, nível) para cada bloco em
+// uso, dos ponteiros para os dados (nível 0 = bloco de dados)
+void INE5412_FS::walk_tree(int block, int depth, const std::function<void(int, int)> &visit)
+{
+    if (!block) {
+        return;
+    }
+
+    visit(block, depth);
+    if (depth == 0) {
+        return;
+    }
+
+    union fs_block scratch;
+    const union fs_block *pointers = metadata_view(block, &scratch);
+    for (int pointer : pointers->pointers) {
+        walk_tree(pointer, depth - 1, visit);
+    }
+}
+
+// Retorna o bloco pedido sem cópia quando o disco está mapeado em memória;
+// caso contrário lê o bloco para o buffer fornecido e retorna o buffer.
+const union INE5412_FS::fs_block *INE5412_FS::block_view(int blocknum, union fs_block *scratch)
+{
+    const char *mapped = disk->view(blocknum);
+    if (mapped) {
+        return reinterpret_cast<const union fs_block *>(mapped);
+    }
+
+    disk->read(blocknum, scratch->data);
+    return scratch;
+}
+
+// Como block_view, para blocos de ponteiros: os alterados desde o último
+// checkpoint são copiados da memória
+const union INE5412_FS::fs_block *INE5412_FS::metadata_view(int blocknum, union fs_block *scratch)
+{
+    if (journal) {
+        std::lock_guard<std::mutex> guard(metadata_lock);
+        auto found = metadata_blocks.find(blocknum);
+        if (found != metadata_blocks.end()) {
+            *scratch = *found->second;
+            return scratch;
+        }
+    }
+    return block_view(blocknum, scratch);
+}
+
+// O inode n fica no bloco n / inodes_per_block + 1, na posição
+// n % inodes_per_block. Os inodes são lidos e alterados na tabela em
+// memória; o bloco alterado só vai para o disco no fs_sync ou, com
+// diário, no checkpoint (o inode alterado vai para a transação txn).
+int INE5412_FS::inode_load(int number, class fs_inode *inode) 
+{
+    // Verifica se o número do inode é válido
+    if (number < 1 || number >= superblock.ninodes) {
+        cout << "Erro: Número do inode inválido.\n";
+        return 0;
+    }
+
+    int slots = inodes_per_block(superblock.version);
+    std::lock_guard<std::mutex> guard(table_lock);
+    inode_decode(inode_table_block(number / slots), number % slots, superblock.version, inode);
+    return 1;
+}
+
+
+int INE5412_FS::inode_save(int number, class fs_inode *inode, Journal::transaction *txn) 
+{
+    // Verifica se o número do inode é válido
+    if (number < 1 || number >= superblock.ninodes) {
+        cerr << "Erro: Número do inode inválido.\n";
+        return 0;
+    }
+
+    int slots = inodes_per_block(superblock.version);
+    int block_index = number / slots;
+    std::lock_guard<std::mutex> guard(table_lock);
+    inode_encode(inode_table_block(block_index), number % slots, superblock.version, inode);
+    inode_dirty[block_index] = true;
+
+    // Os bytes zerados do fim do inode (os ponteiros não usados) ficam fora do registro
+    const char *bytes = (const char *) inode;
+    int size = sizeof(*inode);
+    while (size > 0 && !bytes[size - 1]) {
+        size--;
+    }
+    log_record(txn, RECORD_INODE, number, 0, 0, inode, size);
+
+    return 1;
+}
+
+// Inodes por bloco da tabela na versão do formato dada
+int INE5412_FS::inodes_per_block(int version)
+{
+    return version >= 2 ? INODES_PER_BLOCK : LEGACY_INODES_PER_BLOCK;
+}
+
+// Converte o inode da posição slot do bloco de inodes, no formato da
+// versão dada, para o formato em memória (o atual)
+void INE5412_FS::inode_decode(const union fs_block *block, int slot, int version, fs_inode *inode)
+{
+    if (version >= 2) {
+        *inode = block->inode[slot];
+        return;
+    }
+
+    const fs_legacy_inode &legacy = block->legacy_inode[slot];
+    memset(inode, 0, sizeof(*inode));
+    inode->isvalid = legacy.isvalid;
+    inode->size = legacy.size;
+    memcpy(inode->direct, legacy.direct, sizeof(legacy.direct));
+    inode->indirect = legacy.indirect;
+}
+
+// Grava o inode na posição slot do bloco no formato da versão dada; no
+// formato antigo os arquivos nunca passam do bloco indireto simples
+void INE5412_FS::inode_encode(union fs_block *block, int slot, int version, const fs_inode *inode)
+{
+    if (version >= 2) {
+        block->inode[slot] = *inode;
+        return;
+    }
+
+    fs_legacy_inode &legacy = block->legacy_inode[slot];
+    legacy.isvalid = inode->isvalid;
+    legacy.size = inode->size;
+    memcpy(legacy.direct, inode->direct, sizeof(legacy.direct));
+    legacy.indirect = inode->indirect;
+}
+
+// Bloco da tabela de inodes (0 = primeiro bloco de inodes), lido do disco
+// no primeiro acesso. Chamado com table_lock ou com fs_lock exclusiva.
+union INE5412_FS::fs_block *INE5412_FS::inode_table_block(int index)
+{
+    if (!inode_table[index]) {
+        inode_table[index].reset(new fs_block);
+        disk->read(index + 1, inode_table[index]->data);
+    }
+    return inode_table[index].get();
+}
+
+// Lê de uma vez os blocos [begin, end) da tabela ainda não carregados; os
+// contíguos vão em uma requisição. Só usado pela varredura do mount, com
+// fs_lock exclusiva: cada trabalhador carrega um intervalo diferente.
+void INE5412_FS::load_inode_table(int begin, int end)
+{
+    std::vector<std::pair<int, char *>> inode_reads;
+
+    for (int i = begin; i < end; i++) {
+        if (!inode_table[i]) {
+            inode_table[i].reset(new fs_block);
+            inode_reads.push_back(std::make_pair(i + 1, inode_table[i]->data));
+        }
+    }
+    disk->readv(inode_reads);
+}
+
+// Lê de uma vez os blocos ainda não carregados que contêm os inodes dados
+// (números inválidos são ignorados)
+void INE5412_FS::load_inode_blocks(const std::vector<int> &inumbers)
+{
+    int slots = inodes_per_block(superblock.version);
+    std::vector<int> indices;
+    std::lock_guard<std::mutex> guard(table_lock);
+
+    for (int number : inumbers) {
+        if (number >= 1 && number < superblock.ninodes && !inode_table[number / slots]) {
+            indices.push_back(number / slots);
+        }
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    std::vector<std::pair<int, char *>> inode_reads;
+    for (int i : indices) {
+        inode_table[i].reset(new fs_block);
+        inode_reads.push_back(std::make_pair(i + 1, inode_table[i]->data));
+    }
+    disk->readv(inode_reads);
+}
+
+// Grava os blocos de inodes alterados; os contíguos vão em uma requisição
+void INE5412_FS::flush_inodes()
+{
+    std::vector<std::pair<int, const char *>> inode_writes;
+    std::lock_guard<std::mutex> guard(table_lock);
+
+    for (size_t i = 0; i < inode_dirty.size(); i++) {
+        if (inode_dirty[i]) {
+            inode_writes.push_back(std::make_pair((int) i + 1, (const char *) inode_table[i]->data));
+            inode_dirty[i] = false;
+        }
+    }
+    disk->writev(inode_writes);
+}
+
+
+// Reconstrói o mapa de inodes e, com with_blocks, o mapa de blocos
+// percorrendo os inodes válidos da tabela e suas árvores de ponteiros. Cada
+// trabalhador lê e percorre um intervalo de blocos de inodes marcando mapas
+// parciais; os parciais são unidos no fim. A partir da versão 7 as
+// referências a cada bloco são contadas em owners, que reconstrói também o
+// mapa de referências.
+void INE5412_FS::scan_inodes(bool with_blocks)
+{
+    // construção dos mapas; o inodo 0 nunca é usado
+    inode_map.reset(superblock.ninodes);
+    inode_map.set(0);
+
+    std::vector<std::atomic<int>> owners(with_blocks && refcount_blocks() ? superblock.nblocks : 0);
+    if (with_blocks) {
+        bitmap.reset(superblock.nblocks);
+
+        // Ocupa o superbloco, os blocos de inodes, os dos próprios mapas e os do diário
+        int journal_blocks = superblock.version >= 4 ? superblock.njournalblocks : 0;
+        for (int i = 0; i < journal_start() + journal_blocks; i++) {
+            bitmap.set(i);
+        }
+    }
+
+    std::mutex merge_lock;
+
+    for_each_range(superblock.ninodeblocks, [&](int begin, int end) {
+        Block_Bitmap used, valid;
+        if (with_blocks) {
+            used.reset(superblock.nblocks);
+        }
+        valid.reset(superblock.ninodes);
+
+        // Lê de uma vez os blocos de inodes do intervalo
+        load_inode_table(begin, end);
+
+        // Processa os blocos de inodes
+        for (int i = begin; i < end; i++) {
+            const union fs_block *inode_block = inode_table[i].get();
+
+            // Processa os inodes do bloco
+            for (int j = 0; j < inodes_per_block(superblock.version); j++) {
+                fs_inode inode;
+                inode_decode(inode_block, j, superblock.version, &inode);
+
+                // Verifica os blocos ocupados por inodes
+                if (inode.isvalid) {
+                    valid.set(i * inodes_per_block(superblock.version) + j);
+                    if (!with_blocks || (inode.flags & INODE_INLINE)) {
+                        continue;
+                    }
+
+                    if (!owners.empty()) {
+                        for (int direct_block : inode.direct) {
+                            count_references(direct_block, 0, owners);
+                        }
+                        int roots[INDIRECT_LEVELS] = {inode.indirect, inode.dindirect, inode.tindirect};
+                        for (int depth = 1; depth <= INDIRECT_LEVELS; depth++) {
+                            count_references(roots[depth - 1], depth, owners);
+                        }
+                        continue;
+                    }
+
+                    // Marca os blocos diretos como ocupados no bitmap
+                    for (int direct_block : inode.direct) {
+                        if (direct_block != 0) {
+                            used.set(direct_block);
+                        }
+                    }
+
+                    // Marca os blocos de ponteiros e os blocos de dados
+                    // apontados por eles como ocupados no bitmap
+                    int roots[INDIRECT_LEVELS] = {inode.indirect, inode.dindirect, inode.tindirect};
+                    for (int depth = 1; depth <= INDIRECT_LEVELS; depth++) {
+                        walk_tree(roots[depth - 1], depth, [&](int block, int) {
+                            used.set(block);
+                        });
+                    }
+                }
+            }
+        }
+
+        // Une os mapas parciais do intervalo aos do sistema de arquivos
+        std::lock_guard<std::mutex> guard(merge_lock);
+        inode_map.merge(valid);
+        if (with_blocks) {
+            bitmap.merge(used);
+        }
+    });
+
+    // Cada dono além do primeiro é uma referência a mais
+    if (!owners.empty()) {
+        refcounts.assign(superblock.nblocks, 0);
+        refcount_dirty.assign(refcount_blocks(), true);
+        sharing = 0;
+        for (int block = 0; block < superblock.nblocks; block++) {
+            if (owners[block] > 0) {
+                bitmap.set(block);
+                refcounts[block] = owners[block] - 1;
+                sharing += refcounts[block] > 0;
+            }
+        }
+    }
+}
+
+// Conta uma referência a cada bloco da árvore com raiz em block (como no
+// walk_tree); um bloco de ponteiros compartilhado só é percorrido por quem
+// contou a sua primeira referência, já que os filhos são dos dois donos
+void INE5412_FS::count_references(int block, int depth, std::vector<std::atomic<int>> &owners)
+{
+    if (!block || owners[block]++ > 0 || depth == 0) {
+        return;
+    }
+
+    union fs_block scratch;
+    const union fs_block *pointers = metadata_view(block, &scratch);
+    for (int pointer : pointers->pointers) {
+        count_references(pointer, depth - 1, owners);
+    }
+}
+
+// Número de trabalhadores para percorrer count blocos de inodes: um por
+// núcleo, mas com pelo menos SCAN_MIN_BLOCKS blocos para cada um
+int INE5412_FS::scan_workers(int count)
+{
+    int cores = max((int) std::thread::hardware_concurrency(), 1);
+    return max(min(cores, count / SCAN_MIN_BLOCKS), 1);
+}
+
+// Divide [0, count) em scan_workers(count) intervalos contíguos e executa
+// body(begin, end) para cada um em uma thread; com um só intervalo, roda
+// na própria thread
+void INE5412_FS::for_each_range(int count, const std::function<void(int, int)> &body)
+{
+    int ranges = scan_workers(count);
+    if (ranges == 1) {
+        body(0, count);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int r = 0; r < ranges; r++) {
+        workers.emplace_back(body, (int) ((long) count * r / ranges), (int) ((long) count * (r + 1) / ranges));
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+// O mapa de blocos persistido ocupa nbitmapblocks blocos logo após a
+// tabela de inodes, seguido (a partir da versão 3) pelos ninodemapblocks
+// blocos do mapa de inodes e (a partir da 7) pelos nrefblocks blocos do
+// mapa de referências, um int por bloco; os três são lidos numa só
+// requisição
+void INE5412_FS::bitmap_load()
+{
+    int inode_map_blocks = superblock.version >= 3 ? superblock.ninodemapblocks : 0;
+    int ref_blocks = refcount_blocks();
+    std::vector<uint64_t> image((superblock.nbitmapblocks + inode_map_blocks + ref_blocks) * BITS_PER_BLOCK / 64);
+    disk->readv(superblock.ninodeblocks + 1, superblock.nbitmapblocks + inode_map_blocks + ref_blocks, (char *) image.data());
+
+    const char *ref_image = (const char *) (image.data() + (superblock.nbitmapblocks + inode_map_blocks) * BITS_PER_BLOCK / 64);
+    refcounts.assign(ref_blocks ? superblock.nblocks : 0, 0);
+    refcount_dirty.assign(ref_blocks, false);
+    memcpy(refcounts.data(), ref_image, refcounts.size() * sizeof(int));
+    sharing = refcounts.size() - std::count(refcounts.begin(), refcounts.end(), 0);
+
+    std::vector<uint64_t> inode_image(image.begin() + superblock.nbitmapblocks * BITS_PER_BLOCK / 64,
+                                      image.begin() + (superblock.nbitmapblocks + inode_map_blocks) * BITS_PER_BLOCK / 64);
+    image.resize(superblock.nbitmapblocks * BITS_PER_BLOCK / 64);
+
+    bitmap.reset(superblock.nblocks);
+    bitmap.load(image);
+
+    if (inode_map_blocks) {
+        inode_map.reset(superblock.ninodes);
+        inode_map.load(inode_image);
+    }
+}
+
+// Grava os dois mapas inteiros e só os blocos alterados do mapa de referências
+void INE5412_FS::bitmap_save()
+{
+    int inode_map_blocks = superblock.version >= 3 ? superblock.ninodemapblocks : 0;
+    std::vector<uint64_t> image(superblock.nbitmapblocks * BITS_PER_BLOCK / 64);
+    bitmap.store(image);
+
+    if (inode_map_blocks) {
+        std::vector<uint64_t> inode_image(inode_map_blocks * BITS_PER_BLOCK / 64);
+        inode_map.store(inode_image);
+        image.insert(image.end(), inode_image.begin(), inode_image.end());
+    }
+
+    disk->writev(superblock.ninodeblocks + 1, superblock.nbitmapblocks + inode_map_blocks, (const char *) image.data());
+
+    // O último bloco do mapa de referências é completado com zeros
+    int refs_start = superblock.ninodeblocks + superblock.nbitmapblocks + inode_map_blocks + 1;
+    std::vector<int> last(REFCOUNTS_PER_BLOCK, 0);
+    std::vector<std::pair<int, const char *>> ref_writes;
+    for (size_t i = 0; i < refcount_dirty.size(); i++) {
+        if (refcount_dirty[i]) {
+            const int *counts = refcounts.data() + i * REFCOUNTS_PER_BLOCK;
+            if ((i + 1) * REFCOUNTS_PER_BLOCK > refcounts.size()) {
+                std::copy(counts, counts + (refcounts.size() - i * REFCOUNTS_PER_BLOCK), last.begin());
+                counts = last.data();
+            }
+            ref_writes.push_back(std::make_pair(refs_start + (int) i, (const char *) counts));
+            refcount_dirty[i] = false;
+        }
+    }
+    disk->writev(ref_writes);
+}
+
+// Grava a cópia em memória do superbloco, com o resto do bloco zerado
+void INE5412_FS::superblock_save()
+{
+    union fs_block block;
+    memset(block.data, 0, sizeof(block.data));
+    block.super = superblock;
+
+    disk->write(0, block.data);
+}
+
+// função auxiliar para encontrar um bloco livre: entrega o próximo bloco
+// do trecho reservado em run, reservando antes um trecho contíguo de até
+// wanted blocos se ele tiver acabado (-1 se o disco estiver cheio); o mapa
+// só é consultado, sob allocator_lock, quando o trecho acaba
+int INE5412_FS::search_block(block_run *run, int wanted) 
+{
+    if (!run->count) {
+        // O trecho anterior foi usado até o fim
+        if (run->next > run->first) {
+            run->taken.push_back(std::make_pair(run->first, run->next - run->first));
+        }
+
+        std::unique_lock<std::mutex> guard(allocator_lock);
+        int first = bitmap.allocate_run(max(wanted, 1), &run->count);
+
+        // Disco cheio: os blocos liberados desde o último commit voltam ao
+        // mapa com um commit antecipado
+        if (first == -1 && !uncommitted_frees.empty()) {
+            guard.unlock();
+            journal_commit();
+            guard.lock();
+            first = bitmap.allocate_run(max(wanted, 1), &run->count);
+        }
+        if (first == -1) {
+            run->next = run->first = run->count = 0;
+            return -1;
+        }
+        run->next = run->first = first;
+    }
+
+    run->count--;
+    return run->next++;
+}
+
+// Libera os blocos do trecho que não chegaram a ser usados
+void INE5412_FS::release_run(block_run *run)
+{
+    if (run->next > run->first) {
+        run->taken.push_back(std::make_pair(run->first, run->next - run->first));
+    }
+
+    std::lock_guard<std::mutex> guard(allocator_lock);
+    for (; run->count > 0; run->count--) {
+        bitmap.clear(run->next++);
+    }
+    run->first = run->next;
+}
+
+// Devolve ao mapa os blocos usados de run, que ainda não foram para o
+// diário: a operação que os alocou desistiu antes de registrá-los
+void INE5412_FS::forget_run(block_run *run)
+{
+    release_run(run);
+
+    std::lock_guard<std::mutex> guard(allocator_lock);
+    for (auto &taken : run->taken) {
+        for (int block = taken.first; block < taken.first + taken.second; block++) {
+            bitmap.clear(block);
+        }
+    }
+    run->taken.clear();
+}
+
+// Primeiro bloco do diário, logo depois do mapa de inodes e do mapa de referências
+int INE5412_FS::journal_start()
+{
+    return superblock.ninodeblocks + superblock.nbitmapblocks + superblock.ninodemapblocks + refcount_blocks() + 1;
+}
+
+// Acrescenta um registro à transação, se o disco montado tiver diário
+void INE5412_FS::log_record(Journal::transaction *txn, int type, int target, int index, int count, const void *payload, int size)
+{
+    if (!journal) {
+        return;
+    }
+
+    journal_record record = {type, target, index, count};
+    txn->add(&record, sizeof(record), payload, size);
+}
+
+// Registra os trechos do mapa ocupados pelos blocos usados de run
+void INE5412_FS::log_run(block_run *run, Journal::transaction *txn)
+{
+    for (auto &taken : run->taken) {
+        log_record(txn, RECORD_ALLOC, taken.first, 0, taken.second, nullptr, 0);
+    }
+    run->taken.clear();
+}
+
+// Enfileira a transação para o próximo commit em grupo
+void INE5412_FS::journal_submit(Journal::transaction *txn)
+{
+    if (!journal) {
+        return;
+    }
+
+    journal->submit(txn);
+
+    // Um grupo grande é confirmado sem esperar o fim do intervalo
+    if (journal->pending_bytes() >= JOURNAL_GROUP_BYTES) {
+        committer_wakeup.notify_one();
+    }
+}
+
+// Confirma as transações enfileiradas e só então devolve ao mapa os blocos
+// liberados por elas e deixa os outros donos dos blocos que elas
+// descompartilharam alterá-los no lugar. Os blocos são separados antes do
+// commit, então todas as suas transações já estavam enfileiradas; se elas
+// não couberem no diário, os blocos esperam o checkpoint.
+bool INE5412_FS::journal_commit()
+{
+    std::vector<int> blocks, unshared;
+    {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        blocks.swap(uncommitted_frees);
+        unshared.swap(uncommitted_unshares);
+    }
+
+    if (!journal->commit()) {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        uncommitted_frees.insert(uncommitted_frees.end(), blocks.begin(), blocks.end());
+        uncommitted_unshares.insert(uncommitted_unshares.end(), unshared.begin(), unshared.end());
+        return false;
+    }
+
+    if (!unshared.empty()) {
+        std::lock_guard<std::mutex> guard(allocator_lock);
+        for (int block : unshared) {
+            auto found = recent_unshares.find(block);
+            if (--found->second == 0) {
+                recent_unshares.erase(found);
+                sharing--;
+            }
+        }
+    }
+
+    return_blocks(blocks);
+    return true;
+}
+
+// Refaz no estado em memória um registro de uma transação confirmada no
+// diário. Só usado na montagem, com fs_lock exclusiva; registros fora dos
+// limites do disco são ignorados.
+void INE5412_FS::journal_apply(const char *record, int size)
+{
+    journal_record header;
+    if (size < (int) sizeof(header)) {
+        return;
+    }
+    memcpy(&header, record, sizeof(header));
+
+    const char *payload = record + sizeof(header);
+    int payload_size = size - sizeof(header);
+
+    if (header.type == RECORD_INODE) {
+        if (header.target < 1 || header.target >= superblock.ninodes || payload_size > (int) sizeof(fs_inode)) {
+            return;
+        }
+
+        fs_inode inode;
+        memset(&inode, 0, sizeof(inode));
+        memcpy(&inode, payload, payload_size);
+
+        int slots = inodes_per_block(superblock.version);
+        inode_encode(inode_table_block(header.target / slots), header.target % slots, superblock.version, &inode);
+        inode_dirty[header.target / slots] = true;
+
+        if (inode.isvalid) {
+            inode_map.set(header.target);
+        } else {
+            inode_map.clear(header.target);
+        }
+    } else if (header.type == RECORD_ZERO || header.type == RECORD_POINTERS) {
+        if (header.target <= 0 || header.target >= superblock.nblocks) {
+            return;
+        }
+
+        // O bloco pendente vem do disco no primeiro registro que o altera
+        std::unique_ptr<union fs_block> &block = metadata_blocks[header.target];
+        if (!block) {
+            block.reset(new fs_block);
+            disk->read(header.target, block->data);
+        }
+
+        if (header.type == RECORD_ZERO) {
+            memset(block->data, 0, sizeof(block->data));
+        } else if (header.index >= 0 && header.count >= 0 && header.index + header.count <= POINTERS_PER_BLOCK &&
+                   payload_size == header.count * (int) sizeof(int)) {
+            memcpy(&block->pointers[header.index], payload, payload_size);
+        }
+    } else if (header.type == RECORD_ALLOC || header.type == RECORD_FREE) {
+        for (int block = max(header.target, 0); block < header.target + header.count && block < superblock.nblocks; block++) {
+            if (header.type == RECORD_ALLOC) {
+                bitmap.set(block);
+            } else {
+                bitmap.clear(block);
+                metadata_blocks.erase(block);
+            }
+        }
+    } else if (header.type == RECORD_REFS && !refcounts.empty()) {
+        if (header.target < 0 || header.count < 0 || header.target + header.count > superblock.nblocks ||
+            payload_size != header.count * (int) sizeof(int)) {
+            return;
+        }
+
+        const int *counts = (const int *) payload;
+        for (int i = 0; i < header.count; i++) {
+            refcount_add(header.target + i, counts[i] - refcounts[header.target + i]);
+        }
+    }
+}
+
+// Grava no lugar os metadados alterados desde o último checkpoint (blocos
+// de inodes, blocos de ponteiros e os dois mapas) e esvazia o diário, cujo
+// novo começo vai para o superbloco. Chamado com fs_lock exclusiva, então o
+// estado em memória não tem nenhuma operação pela metade e as transações
+// ainda não confirmadas podem ser descartadas.
+void INE5412_FS::checkpoint()
+{
+    // Os blocos liberados por transações não confirmadas voltam ao mapa
+    // gravado agora, junto com os inodes que não os usam mais; o espaço só
+    // é devolvido ao hospedeiro no fim
+    std::vector<int> frees;
+    frees.swap(uncommitted_frees);
+    for (int block : frees) {
+        bitmap.clear(block);
+    }
+    sharing -= recent_unshares.size();
+    recent_unshares.clear();
+    uncommitted_unshares.clear();
+
+    flush_inodes();
+
+    std::vector<std::pair<int, const char *>> pointer_writes;
+    for (auto &entry : metadata_blocks) {
+        pointer_writes.push_back(std::make_pair(entry.first, (const char *) entry.second->data));
+    }
+    disk->writev(pointer_writes);
+    metadata_blocks.clear();
+
+    bitmap_save();
+    disk->sync();
+
+    journal->checkpointed();
+    superblock.journalhead = journal->head();
+    superblock.journalsequence = journal->sequence();
+    superblock_save();
+    disk->sync();
+
+    return_blocks(frees);
+}
+
+// Thread de commit: confirma as transações enfileiradas a cada
+// JOURNAL_COMMIT_MS (ou antes, quando acordada por um grupo grande) e faz um
+// checkpoint quando elas não cabem no diário, quando ele passa da metade ou
+// quando há blocos de ponteiros pendentes demais
+void INE5412_FS::commit_loop()
+{
+    std::chrono::milliseconds interval(+JOURNAL_COMMIT_MS);
+    std::unique_lock<std::mutex> guard(committer_lock);
+
+    while (!committer_stop) {
+        committer_wakeup.wait_for(guard, interval);
+        if (committer_stop) {
+            break;
+        }
+        guard.unlock();
+
+        bool due = false;
+        {
+            std::shared_lock<std::shared_mutex> fs_guard(fs_lock);
+            if (journal) {
+                due = !journal_commit() || 2 * journal->live_blocks() > journal->capacity();
+
+                std::lock_guard<std::mutex> metadata_guard(metadata_lock);
+                due = due || metadata_blocks.size() >= CHECKPOINT_BLOCKS;
+            }
+        }
+        if (due) {
+            std::unique_lock<std::shared_mutex> fs_guard(fs_lock);
+            if (journal) {
+                checkpoint();
+            }
+        }
+
+        guard.lock();
+    }
+}
+
+void INE5412_FS::start_committer()
+{
+    {
+        std::lock_guard<std::mutex> guard(committer_lock);
+        committer_stop = false;
+    }
+    committer = std::thread(&INE5412_FS::commit_loop, this);
+}
+
+// Para a thread de commit; chamado sem fs_lock, que ela pode estar esperando
+void INE5412_FS::stop_committer()
+{
+    {
+        std::lock_guard<std::mutex> guard(committer_lock);
+        committer_stop = true;
+    }
+    committer_wakeup.notify_one();
+
+    if (committer.joinable()) {
+        committer.join();
+    }
+}
+
+INE5412_FS::~INE5412_FS()
+{
+    stop_committer();
 }
 
 
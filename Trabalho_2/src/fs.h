@@ -2,15 +2,63 @@
 #define FS_H
 
 #include "disk.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "dedup.h"
 #include <vector>
+#include <tuple>
+#include <future>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <string>
 
 class INE5412_FS
 {
 public:
     static const unsigned int FS_MAGIC = 0xf0f03410;
-    static const unsigned short int INODES_PER_BLOCK = 128;
+    static const unsigned short int INODES_PER_BLOCK = 64;
+    static const unsigned short int LEGACY_INODES_PER_BLOCK = 128;
     static const unsigned short int POINTERS_PER_INODE = 5;
     static const unsigned short int POINTERS_PER_BLOCK = 1024;
+    static const int INDIRECT_LEVELS = 3;   // indireto, duplo indireto e triplo indireto
+    static const int INODE_INLINE = 1;      // flag: os dados estão no próprio inode
+    static const int INODE_DIRECTORY = 2;   // flag: o inode é um diretório
+    static const int INODE_LINKED = 4;      // flag: o inode tem um nome num diretório
+    static const int INLINE_BYTES = 48;     // de direct[0] até o fim do inode
+    static const int DIR_NAME_MAX = 56;     // bytes de um nome de diretório
+    static const int DIR_BUCKET_ENTRIES = 63; // entradas por balde, depois do cabeçalho
+    static const int DIR_INDEX_BLOCKS = 64; // blocos do índice, no começo do diretório
+    static const int DIR_MAX_DEPTH = 16;    // 2^16 números de balde cabem no índice
+    static const int REFCOUNTS_PER_BLOCK = Disk::DISK_BLOCK_SIZE / 4; // contadores do mapa de referências por bloco
+
+    // Versão do formato gravada pelo fs_format. Imagens antigas têm versão 0
+    // (o resto do superbloco zerado) e não têm o mapa de blocos persistido;
+    // até a versão 1 os inodes têm o formato antigo (fs_legacy_inode), só
+    // a partir da versão 3 o mapa de inodes livres é persistido, só a
+    // partir da 4 há o diário de metadados, só a partir da 5 arquivos
+    // pequenos ficam dentro do inode (INODE_INLINE), só a partir da 6 há
+    // diretórios e só a partir da 7 blocos compartilhados entre arquivos,
+    // com o mapa de referências.
+    static const int FS_VERSION = 7;
+    static const int BITS_PER_BLOCK = Disk::DISK_BLOCK_SIZE * 8;
+    static const int SCAN_MIN_BLOCKS = 8;   // blocos de inodes por trabalhador da varredura
+    static const int READAHEAD_MIN = 4;     // janela inicial de leitura antecipada, em blocos
+    static const int READAHEAD_MAX = 64;    // janela máxima
+    static const size_t READAHEAD_FILES = 16; // inodes acompanhados ao mesmo tempo
+    static const int INODE_LOCK_STRIPES = 64; // travas de inode, compartilhadas por inumber % 64
+    static const int JOURNAL_MIN_BLOCKS = 8;      // área do diário: 1/64 do disco, nesses limites
+    static const int JOURNAL_MAX_BLOCKS = 1024;
+    static const int JOURNAL_COMMIT_MS = 50;      // intervalo entre commits em grupo
+    static const size_t JOURNAL_GROUP_BYTES = 256 * 1024; // commit antecipado a partir disso
+    static const size_t CHECKPOINT_BLOCKS = 4096; // blocos de ponteiros pendentes antes de um checkpoint
 
     class fs_superblock {
         public:
@@ -18,9 +66,38 @@ public:
             int nblocks;
             int ninodeblocks;
             int ninodes;
+            int version;
+            int clean;          // desmontado corretamente: o mapa gravado é válido
+            int nbitmapblocks;  // blocos do mapa de blocos, logo após os inodes
+            int ninodemapblocks; // blocos do mapa de inodes, logo após o de blocos
+            int njournalblocks; // blocos do diário (0 se não houver), logo após o mapa de referências
+            int journalhead;    // primeiro bloco vivo do diário (relativo à área)
+            int journalsequence; // e o seu número de sequência
+            int rootinode;      // diretório raiz (0 enquanto não for criado)
+            int nrefblocks;     // blocos do mapa de referências, logo após o mapa de inodes (versão 7)
     }; 
 
+    // Inode da versão 2, com 64 bytes. Com INODE_INLINE em flags, os
+    // INLINE_BYTES bytes a partir de direct guardam o conteúdo do arquivo
+    // (zerados além do tamanho) em vez de ponteiros. Os quatro últimos
+    // campos só são usados por diretórios e descrevem a tabela de hash.
     class fs_inode {
+        public:
+            int isvalid;
+            int flags;
+            long long size;
+            int direct[POINTERS_PER_INODE];
+            int indirect;
+            int dindirect;      // duplo indireto: bloco de blocos de ponteiros
+            int tindirect;      // triplo indireto
+            int depth;          // bits do hash usados no índice
+            int buckets;        // baldes alocados
+            int entries;        // nomes guardados
+            int parent;         // diretório pai (a raiz é pai de si mesma)
+    };
+
+    // Inode das versões 0 e 1: só o bloco indireto simples e tamanho de 32 bits
+    class fs_legacy_inode {
         public:
             int isvalid;
             int size;
@@ -28,11 +105,34 @@ public:
             int indirect;
     };
 
+    // Um diretório (INODE_DIRECTORY) é uma tabela de hash extensível
+    // guardada nos blocos do próprio inode: os DIR_INDEX_BLOCKS primeiros
+    // blocos são o índice, com 2^depth números de balde indexados pelos
+    // bits baixos do hash do nome, e o balde k fica no bloco
+    // DIR_INDEX_BLOCKS + k. Um balde cheio é dividido em dois pelo próximo
+    // bit do hash, dobrando o índice quando necessário.
+    class dir_entry {
+        public:
+            int inumber;        // 0 = posição livre
+            unsigned int hash;
+            char name[DIR_NAME_MAX]; // completado com zeros
+    };
+
+    class dir_bucket {
+        public:
+            int depth;          // bits do hash comuns às entradas do balde
+            int count;
+            int reserved[14];
+            dir_entry entries[DIR_BUCKET_ENTRIES];
+    };
+
     union fs_block {
         public:
             fs_superblock super;
             fs_inode inode[INODES_PER_BLOCK];
+            fs_legacy_inode legacy_inode[LEGACY_INODES_PER_BLOCK];
             int pointers[POINTERS_PER_BLOCK];
+            dir_bucket bucket;
             char data[Disk::DISK_BLOCK_SIZE];
     };
 
@@ -42,27 +142,345 @@ public:
         disk = d;
     } 
 
+    // Encerra a thread de commit sem desmontar: o que não foi confirmado no
+    // diário se perde, como numa queda
+    ~INE5412_FS();
+
     void fs_debug();
     int  fs_format();
     int  fs_mount();
+    int  fs_unmount();
+    int  fs_sync();
+    int  get_mounted();
 
     int  fs_create();
     int  fs_delete(int inumber);
-    int  fs_getsize(int inumber);
+    long long fs_getsize(int inumber);
+
+    // Criação e remoção em lote: os inodes de um mesmo bloco custam uma só
+    // gravação do bloco e os blocos de dados liberados são devolvidos ao
+    // mapa numa única passada. Retornam quantos inodes foram criados (com
+    // os números em inumbers) ou removidos.
+    int  fs_create_many(int count, std::vector<int> &inumbers);
+    int  fs_delete_many(const std::vector<int> &inumbers);
+
+    int  fs_read(int inumber, char *data, int length, long long offset);
+    int  fs_write(int inumber, const char *data, int length, long long offset);
 
-    int  fs_read(int inumber, char *data, int length, int offset);
-    int  fs_write(int inumber, const char *data, int length, int offset);
+    // Como fallocate com FALLOC_FL_KEEP_SIZE: aloca, em trechos contíguos,
+    // os blocos ainda não alocados dos primeiros length bytes do arquivo sem
+    // mudar seu tamanho. Retorna quantos bytes ficaram cobertos por blocos.
+    long long fs_reserve(int inumber, long long length);
+
+    // Como lseek com SEEK_DATA/SEEK_HOLE: próximo deslocamento, a partir de
+    // offset, que contém dados ou que é um buraco (bloco nunca escrito)
+    long long fs_seek_data(int inumber, long long offset);
+    long long fs_seek_hole(int inumber, long long offset);
+
+    // Variantes assíncronas: o mapeamento (e a alocação) dos blocos é feito
+    // na chamada e a transferência dos dados é enfileirada no disco. O
+    // buffer deve continuar válido até o resultado ficar pronto. As travas
+    // do inode só cobrem o mapeamento: operações no mesmo arquivo antes do
+    // resultado ficar pronto não são ordenadas com a transferência.
+    std::future<int> fs_read_async(int inumber, char *data, int length, long long offset);
+    std::future<int> fs_write_async(int inumber, const char *data, int length, long long offset);
+
+    // Diretórios, a partir da versão 6. Os caminhos são absolutos, com nomes
+    // de até DIR_NAME_MAX bytes separados por "/" ("." e ".." valem); a
+    // raiz é criada na primeira operação que a altera. fs_lookup retorna o
+    // inode do caminho (0 se não existir); fs_mkdir e fs_create_path criam
+    // um diretório ou um arquivo vazio e retornam o seu inode. Um inode com
+    // nome só é removido pelo caminho (fs_unlink para arquivos, fs_rmdir
+    // para diretórios vazios), e um diretório não é lido nem escrito como
+    // arquivo. fs_readdir lista (nome, inode, é diretório) sem ordem.
+    int  fs_lookup(const std::string &path);
+    int  fs_mkdir(const std::string &path);
+    int  fs_create_path(const std::string &path);
+    int  fs_unlink(const std::string &path);
+    int  fs_rmdir(const std::string &path);
+    int  fs_readdir(const std::string &path, std::vector<std::tuple<std::string, int, bool>> &entries);
+
+    // Cópia instantânea, a partir da versão 7: cria um inode sem nome que
+    // compartilha os blocos de dados e de ponteiros do arquivo inumber e
+    // retorna o seu número (0 em caso de falha). Cada bloco guarda no mapa
+    // de referências quantos donos tem além do primeiro; a primeira escrita
+    // de um dos arquivos num bloco compartilhado troca o bloco (e os blocos
+    // de ponteiros do caminho) por uma cópia só dele, e apagar um dos
+    // arquivos só libera os blocos que não tinham outro dono.
+    int  fs_clone(int inumber);
+
+    // Deduplicação na escrita, a partir da versão 7 (desligada por padrão):
+    // cada bloco escrito por inteiro pelo fs_write tem o hash procurado no
+    // índice (Dedup_Index) e, se um bloco em uso tiver o mesmo conteúdo,
+    // comparado byte a byte, o arquivo passa a apontar para ele, que ganha
+    // um dono no mapa de referências. O índice só fica em memória e é
+    // reconstruído lendo os blocos de dados ao ligar a deduplicação e no
+    // fs_mount. fs_dedup retorna 0 se o disco montado for de versão anterior.
+    int  fs_dedup(bool enabled);
+    bool fs_dedup_enabled();
+    void fs_dedup_print(std::ostream &out);
+    void fs_dedup_reset();
+
+    // A partir da versão 4, as alterações de metadados (inodes, ponteiros e
+    // mapas) viram registros lógicos no diário, confirmados em grupo por uma
+    // thread a cada JOURNAL_COMMIT_MS ou no fs_sync; os blocos de inodes e de
+    // ponteiros só são gravados no lugar nos checkpoints, também feitos pela
+    // thread quando o diário passa da metade. Numa escrita síncrona os dados
+    // chegam ao disco antes dos registros que os referenciam; numa
+    // assíncrona os registros podem ser confirmados antes dos dados.
+
+private:
+    // Mudanças de referências de uma operação, aplicadas no free_blocks
+    // junto com o envio da sua transação: blocos que ganham um dono e
+    // referências que o arquivo larga, como (bloco, níveis de ponteiros até
+    // os dados), para que um bloco de ponteiros liberado largue as dos filhos.
+    // Os blocos em linked, achados pela deduplicação, já tiveram o contador
+    // alterado em memória e só vão para a transação.
+    class block_refs {
+        public:
+            std::vector<int> shared;
+            std::vector<int> linked;
+            std::vector<std::pair<int, int>> dropped;
+    };
+
+    // E/S de dados de uma chamada de leitura/escrita: blocos a ler, cópias
+    // (destino, origem, tamanho) a fazer depois da leitura e blocos a gravar
+    class io_plan {
+        public:
+            int bytes = 0;
+            std::vector<std::pair<int, char *>> reads;
+            std::vector<std::tuple<char *, const char *, int>> copies;
+            std::vector<std::pair<int, const char *>> writes;
+            std::vector<char> staging;
+            Journal::transaction txn;   // registros da escrita
+            block_refs refs;            // e as suas mudanças de referências
+
+            void copy();
+    };
+
+    // Último bloco de ponteiros decodificado em cada nível do caminho até
+    // um bloco de dados; leituras vizinhas reaproveitam o caminho inteiro
+    class block_map_cache {
+        public:
+            int blocknum[INDIRECT_LEVELS] = {};
+            std::vector<int> pointers[INDIRECT_LEVELS];
+    };
+
+    // Blocos de ponteiros (ou de diretório) lidos ou criados por uma
+    // escrita, gravados uma vez no fim da chamada (só os alterados), os
+    // criados e os inteiros alterados (bloco, índice), que vão para o diário.
+    // Os blocos do caminho já vistos como só do arquivo ficam em exclusive;
+    // os compartilhados trocados por uma cópia, em refs, e os filhos das
+    // cópias de blocos de ponteiros, em inherited.
+    class pointer_blocks {
+        public:
+            std::map<int, std::unique_ptr<union fs_block>> blocks;
+            std::set<int> dirty;
+            std::set<int> created;
+            std::vector<std::pair<int, int>> changes;
+            std::set<int> exclusive;
+            std::set<int> inherited;
+            block_refs refs;
+    };
+
+    // Leitura antecipada de um inode: onde a próxima leitura sequencial
+    // começaria, o tamanho da janela, os blocos do arquivo já lidos e os
+    // blocos de ponteiros decodificados. Leitores do mesmo inode usam o
+    // estado um de cada vez.
+    class readahead_state {
+        public:
+            std::mutex lock;
+            long long next_offset = 0;
+            int window = 0;
+            int first_block = 0;
+            int nblocks = 0;
+            std::vector<char> buffer;
+            block_map_cache map;
+    };
+
+    // Trecho contíguo de blocos já ocupados no mapa, entregues um a um
+    // pelo search_block, e os trechos (início, tamanho) efetivamente usados
+    class block_run {
+        public:
+            int next = 0;
+            int count = 0;
+            int first = 0;
+            std::vector<std::pair<int, int>> taken;
+    };
+
+    // Registro lógico do diário, seguido de uma carga: o inode target (a
+    // carga é o inode sem os bytes zerados do fim), count ponteiros a partir
+    // de index no bloco target, um bloco de ponteiros novo (zerado), count
+    // blocos a partir de target ocupados ou liberados no mapa ou os count
+    // contadores do mapa de referências a partir de target. Os contadores
+    // vão com o valor depois da mudança, como os demais registros, para que
+    // reaplicar um registro que o mapa gravado no checkpoint já contém (numa
+    // queda antes de o superbloco avançar o diário) não o altere de novo.
+    enum record_type { RECORD_INODE = 1, RECORD_POINTERS, RECORD_ZERO, RECORD_ALLOC, RECORD_FREE, RECORD_REFS };
+
+    class journal_record {
+        public:
+            int type;
+            int target;
+            int index;
+            int count;
+    };
 
 private:
     Disk *disk;
-    bool mounted = false;
-    std::vector<int> bitmap;
+    std::atomic<bool> mounted{false};
+    fs_superblock superblock; // Cópia do superbloco, válida enquanto montado
+    Block_Bitmap bitmap;
+    Block_Bitmap inode_map; // inodes em uso (o inode 0 nunca é usado)
 
+    // Travas, sempre tomadas nesta ordem: fs_lock (exclusiva para format,
+    // mount, unmount, debug, checkpoint e criação da raiz; compartilhada
+    // pelas demais operações), a trava do inode (compartilhada para ler,
+    // exclusiva para alterar; as de um diretório e de um inode dele são
+    // tomadas juntas só pelo lock_pair), a do estado de leitura antecipada,
+    // share_lock (para aplicar mudanças de referências e enviar a transação
+    // delas) e, por último, uma das travas internas (allocator_lock para os
+    // mapas, table_lock para a tabela de inodes, readahead_lock para o mapa
+    // de estados, metadata_lock para os blocos de ponteiros pendentes ou as
+    // do diário), nunca duas juntas.
+    std::shared_mutex fs_lock;
+    std::shared_mutex inode_locks[INODE_LOCK_STRIPES];
+    std::mutex share_lock;
+    std::mutex allocator_lock;
+    std::mutex table_lock;
+    std::mutex readahead_lock;
+    std::mutex metadata_lock;
+
+    std::unordered_map<int, std::shared_ptr<readahead_state>> readahead;
+
+    // Tabela de inodes em memória, um fs_block por bloco de inodes lido no
+    // primeiro acesso (nulo enquanto não lido), e os blocos alterados desde
+    // a última gravação
+    std::vector<std::unique_ptr<union fs_block>> inode_table;
+    std::vector<bool> inode_dirty;
+
+    // Diário do disco montado (nulo antes da versão 4) e os blocos de
+    // ponteiros alterados desde o último checkpoint, que os leitores
+    // consultam antes do disco
+    std::unique_ptr<Journal> journal;
+    std::map<int, std::unique_ptr<union fs_block>> metadata_blocks;
+
+    // Blocos liberados por transações ainda não confirmadas, que só voltam
+    // ao mapa depois do commit (protegidos por allocator_lock)
+    std::vector<int> uncommitted_frees;
+
+    // Mapa de referências (versão 7): donos de cada bloco além do primeiro e
+    // os blocos do mapa alterados desde a última gravação. Um bloco que
+    // perdeu um dono numa transação ainda não confirmada fica em
+    // recent_unshares até o commit: depois de uma queda o dono antigo ainda
+    // o teria, então o outro também não pode alterá-lo no lugar. sharing
+    // conta os blocos com mais de um dono e os de recent_unshares; zero
+    // dispensa consultar o mapa. Protegidos por allocator_lock.
+    std::vector<int> refcounts;
+    std::vector<bool> refcount_dirty;
+    std::map<int, int> recent_unshares;
+    std::vector<int> uncommitted_unshares;
+    std::atomic<long> sharing{0};
+
+    // Índice de deduplicação (protegido por allocator_lock) e se ela está
+    // ligada, o que só muda com fs_lock exclusiva
+    Dedup_Index dedup_index;
+    std::atomic<bool> dedup_on{false};
+
+    // Thread de commit em grupo e checkpoint
+    std::thread committer;
+    std::mutex committer_lock;
+    std::condition_variable committer_wakeup;
+    bool committer_stop = false;
+
+    int plan_read(int inumber, char *data, int length, long long offset, io_plan *plan, bool use_readahead);
+    int plan_write(int inumber, const char *data, int length, long long offset, io_plan *plan);
+    std::shared_mutex &inode_lock(int inumber);
+    std::shared_ptr<readahead_state> readahead_find(int inumber);
+    void readahead_drop(int inumber);
+    void readahead_fill(const fs_inode &inode, readahead_state *ra, int first_block, int count);
+    void run_plan(io_plan *plan);
+    std::future<int> run_plan_async(std::shared_ptr<io_plan> plan);
+
+    long long seek_extent(int inumber, long long offset, bool want_data);
+    int release_inode(int inumber, int kind, block_refs *refs, Journal::transaction *txn);
+    void free_blocks(block_refs *refs, const std::vector<int> &inumbers, Journal::transaction *txn);
+    void drop_tree(int block, int depth, bool counted, std::vector<int> *freed, std::vector<int> *unshared);
+    void return_blocks(std::vector<int> &blocks);
+    static std::vector<std::pair<int, int>> block_runs(const std::vector<int> &blocks);
+    void log_blocks(Journal::transaction *txn, int type, std::vector<int> &blocks);
+    void log_refcounts(Journal::transaction *txn, std::vector<int> &blocks);
+    bool block_shared(int block, bool rewrite);
+    void refcount_add(int block, int delta);
+    int refcount_blocks();
+    void count_references(int block, int depth, std::vector<std::atomic<int>> &owners);
+
+    bool dedup_active();
+    int dedup_find(const char *data, const std::unordered_map<int, const char *> &pending, uint64_t *hash);
+    void dedup_rebuild();
+
+    int inline_limit();
+    static char *inline_data(fs_inode *inode);
+    int promote_inline(fs_inode *inode, pointer_blocks *pointers, block_run *run, int wanted, char *block, bool *inode_changed);
+
+    bool has_directories();
+    int root_inode();
+    int make_root();
+    int make_entry(const std::string &path, bool directory);
+    int remove_entry(const std::string &path, bool directory);
+    static bool split_path(const std::string &path, std::vector<std::string> *names);
+    int resolve(const std::vector<std::string> &names, size_t count);
+    void lock_pair(int a, int b, std::unique_lock<std::shared_mutex> *first, std::unique_lock<std::shared_mutex> *second);
+    static unsigned int name_hash(const std::string &name);
+    int dir_init(fs_inode *dir, int parent, pointer_blocks *pointers, block_run *run);
+    int dir_map(fs_inode *dir, int block_number, pointer_blocks *pointers, block_run *run, bool *inode_changed);
+    void dir_changed(pointer_blocks *pointers, int blocknum, const void *field, int size);
+    int dir_find(const fs_inode &dir, const std::string &name);
+    int dir_insert(fs_inode *dir, const std::string &name, int inumber, pointer_blocks *pointers, block_run *run, bool *inode_changed);
+    int dir_remove(fs_inode *dir, const std::string &name, pointer_blocks *pointers);
+    bool dir_target(int inumber);
+
+    int max_depth();
+    long long max_file_blocks();
+    int block_path(int block_number, int indices[]);
+    int map_block(const fs_inode &inode, int block_number, block_map_cache *cache);
+    int map_alloc(fs_inode *inode, int block_number, pointer_blocks *pointers, block_run *run, int wanted, bool *fresh, bool *inode_changed, int *copied, int link);
+    union fs_block *pointer_block(pointer_blocks *pointers, int blocknum);
+    void flush_pointers(pointer_blocks *pointers, Journal::transaction *txn);
+    void walk_tree(int block, int depth, const std::function<void(int, int)> &visit);
+
+    const union fs_block *block_view(int blocknum, union fs_block *scratch);
+    const union fs_block *metadata_view(int blocknum, union fs_block *scratch);
+    static int inodes_per_block(int version);
+    static void inode_decode(const union fs_block *block, int slot, int version, fs_inode *inode);
+    static void inode_encode(union fs_block *block, int slot, int version, const fs_inode *inode);
     int inode_load(int inumber, class fs_inode *inode);
-    int inode_save(int inumber, class fs_inode *inode);
+    int inode_save(int inumber, class fs_inode *inode, Journal::transaction *txn);
+    union fs_block *inode_table_block(int index);
+    void load_inode_table(int begin, int end);
+    void load_inode_blocks(const std::vector<int> &inumbers);
+    void flush_inodes();
+    void scan_inodes(bool with_blocks);
+    int scan_workers(int count);
+    void for_each_range(int count, const std::function<void(int, int)> &body);
+    void bitmap_load();
+    void bitmap_save();
+    void superblock_save();
     void set_mounted(bool value);
-    int get_mounted();
-    int search_block();
+    int search_block(block_run *run, int wanted);
+    void release_run(block_run *run);
+    void forget_run(block_run *run);
+
+    int journal_start();
+    void log_record(Journal::transaction *txn, int type, int target, int index, int count, const void *payload, int size);
+    void log_run(block_run *run, Journal::transaction *txn);
+    void journal_submit(Journal::transaction *txn);
+    bool journal_commit();
+    void journal_apply(const char *record, int size);
+    void checkpoint();
+    void commit_loop();
+    void start_committer();
+    void stop_committer();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,85 @@
+// Medida do acesso aos inodes (make bench): cria N inodes, consulta o
+// tamanho de cada um GETSIZE_ROUNDS vezes e remove todos, com a taxa de
+// cada fase e o número de blocos lidos do disco desde o fs_mount.
+#include "fs.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char *BENCH_IMAGE = "fs_bench.img";
+static const int GETSIZE_ROUNDS = 5;
+
+// Leituras de blocos registradas pela instrumentação do disco
+static long block_reads(Disk *disk)
+{
+    stringstream csv;
+    disk->get_stats()->write_csv(csv);
+
+    long reads = 0;
+    string line;
+    while (getline(csv, line)) {
+        int block;
+        long value;
+        if (sscanf(line.c_str(), "block_reads,%d,%ld", &block, &value) == 2) {
+            reads += value;
+        }
+    }
+    return reads;
+}
+
+// Executa operations vezes a operação e retorna quantas por segundo
+template <typename F>
+static double rate(int operations, F operation)
+{
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < operations; i++) {
+        operation(i);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return operations / elapsed.count();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        cerr << "use: " << argv[0] << " <nblocks> <ninodes>\n";
+        return 1;
+    }
+    int nblocks = atoi(argv[1]);
+    int count = atoi(argv[2]);
+
+    remove(BENCH_IMAGE);
+    Disk disk(BENCH_IMAGE, nblocks);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+    disk.get_stats()->reset();
+
+    vector<int> inumbers(count);
+    double create = rate(count, [&](int i) { inumbers[i] = fs.fs_create(); });
+    for (int inumber : inumbers) {
+        if (inumber <= 0) {
+            cerr << "fs_create failed: the disk has too few inodes\n";
+            return 1;
+        }
+    }
+    double getsize = rate(count * GETSIZE_ROUNDS, [&](int i) { fs.fs_getsize(inumbers[i % count]); });
+    double remove_rate = rate(count, [&](int i) { fs.fs_delete(inumbers[i]); });
+    long reads = block_reads(&disk);
+
+    // Sem fs_unmount, que as versões anteriores à 012 não têm: o programa
+    // também compila contra elas, para a comparação com o código antigo
+    remove(BENCH_IMAGE);
+
+    printf("%d blocks, %d inodes\n", nblocks, count);
+    printf("    create/s     %10.0f\n", create);
+    printf("    getsize/s    %10.0f\n", getsize);
+    printf("    delete/s     %10.0f\n", remove_rate);
+    printf("    block reads  %10ld\n", reads);
+    return 0;
+}
@@ -0,0 +1,1302 @@
+// Testes do INE5412_FS e do disco sem a interface gráfica (make test). Cada
+// teste usa uma imagem temporária e conta as falhas em failures.
+#include "fs.h"
+#include <cstring>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+static const char *TEST_IMAGE = "fs_test.img";
+
+static atomic<int> failures{0};
+
+static void check(bool condition, const char *what)
+{
+    if (!condition) {
+        cerr << "FAIL: " << what << "\n";
+        failures++;
+    }
+}
+
+// Primeiro bloco de dados do disco descrito pelo superbloco
+static int data_start(const INE5412_FS::fs_superblock &sb)
+{
+    return 1 + sb.ninodeblocks + sb.nbitmapblocks + sb.ninodemapblocks + sb.nrefblocks + sb.njournalblocks;
+}
+
+// Lê a imagem desmontada e compara o mapa de blocos gravado no disco com o
+// mapa reconstruído percorrendo os inodes válidos e as suas árvores de
+// ponteiros, como a varredura do fs_mount
+static void check_bitmap(Disk *disk)
+{
+    INE5412_FS::fs_block super;
+    disk->read(0, super.data);
+    const INE5412_FS::fs_superblock &sb = super.super;
+    check(sb.clean == 1, "image is clean after unmount");
+
+    int nblocks = sb.nblocks;
+    vector<bool> expected(nblocks, false);
+    int metadata = data_start(sb);
+    for (int i = 0; i < metadata; i++) {
+        expected[i] = true;
+    }
+
+    function<void(int, int)> mark = [&](int block, int depth) {
+        if (!block) {
+            return;
+        }
+        check(block >= metadata && block < nblocks, "block pointer inside the data area");
+        if (block < metadata || block >= nblocks) {
+            return;
+        }
+        expected[block] = true;
+        if (depth > 0) {
+            INE5412_FS::fs_block pointers;
+            disk->read(block, pointers.data);
+            for (int pointer : pointers.pointers) {
+                mark(pointer, depth - 1);
+            }
+        }
+    };
+
+    INE5412_FS::fs_block inodes;
+    for (int i = 1; i <= sb.ninodeblocks; i++) {
+        disk->read(i, inodes.data);
+        for (auto &inode : inodes.inode) {
+            if (!inode.isvalid || (inode.flags & INE5412_FS::INODE_INLINE)) {
+                continue;
+            }
+            for (int direct : inode.direct) {
+                mark(direct, 0);
+            }
+            mark(inode.indirect, 1);
+            mark(inode.dindirect, 2);
+            mark(inode.tindirect, 3);
+        }
+    }
+
+    vector<uint64_t> words((size_t) sb.nbitmapblocks * Disk::DISK_BLOCK_SIZE / 8);
+    for (int i = 0; i < sb.nbitmapblocks; i++) {
+        disk->read(1 + sb.ninodeblocks + i, (char *) words.data() + (size_t) i * Disk::DISK_BLOCK_SIZE);
+    }
+
+    int differences = 0;
+    for (int block = 0; block < nblocks; block++) {
+        bool saved = words[block / 64] >> (block % 64) & 1;
+        differences += saved != expected[block];
+    }
+    check(differences == 0, "saved bitmap matches a rescan of the inodes");
+}
+
+// Arquivo de um trabalhador e o conteúdo que ele deve ter
+class model_file {
+    public:
+        int inumber;
+        vector<char> contents;
+};
+
+static void check_contents(INE5412_FS *fs, model_file &file, const char *what)
+{
+    vector<char> data(file.contents.size() + 1);
+    int read = fs->fs_read(file.inumber, data.data(), data.size(), 0);
+    check(read == (int) file.contents.size() && !memcmp(data.data(), file.contents.data(), read), what);
+}
+
+static void record_write(model_file &file, const vector<char> &data, int written, long long offset)
+{
+    if (written <= 0) {
+        return;
+    }
+    if ((long long) file.contents.size() < offset + written) {
+        file.contents.resize(offset + written, 0);
+    }
+    memcpy(file.contents.data() + offset, data.data(), written);
+}
+
+// 8 trabalhadores criam, escrevem (síncrona e assincronamente), reservam,
+// leem, procuram e removem arquivos próprios, leem dois arquivos comuns e
+// disputam o alocador com uma thread que sincroniza sem parar. No fim os
+// conteúdos são conferidos e, desmontado o disco, o mapa de blocos gravado
+// precisa ser igual ao reconstruído a partir dos inodes.
+static void stress_test(Disk::disk_mode mode)
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 6000, mode);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    const int WORKERS = 8;
+    const int OPERATIONS = 300;
+
+    vector<model_file> common(2);
+    for (size_t i = 0; i < common.size(); i++) {
+        common[i].inumber = fs.fs_create();
+        vector<char> data(100000 + 40000 * i);
+        for (size_t j = 0; j < data.size(); j++) {
+            data[j] = (char) (j * 7 + i);
+        }
+        record_write(common[i], data, fs.fs_write(common[i].inumber, data.data(), data.size(), 0), 0);
+    }
+
+    atomic<bool> done{false};
+    thread syncer([&] {
+        while (!done) {
+            fs.fs_sync();
+            this_thread::yield();
+        }
+    });
+
+    vector<thread> workers;
+    for (int w = 0; w < WORKERS; w++) {
+        workers.emplace_back([&, w] {
+            mt19937 rng(w + 1);
+            vector<model_file> files;
+
+            for (int op = 0; op < OPERATIONS; op++) {
+                int choice = rng() % 10;
+                if (files.empty() || (choice == 0 && files.size() < 4)) {
+                    model_file file;
+                    file.inumber = fs.fs_create();
+                    check(file.inumber > 0, "fs_create under contention");
+                    if (file.inumber > 0) {
+                        files.push_back(file);
+                    }
+                    continue;
+                }
+
+                model_file &file = files[rng() % files.size()];
+                long long offset = rng() % 150000;
+                vector<char> data(1 + rng() % 20000);
+                for (char &c : data) {
+                    c = (char) rng();
+                }
+
+                if (choice <= 2) {
+                    record_write(file, data, fs.fs_write(file.inumber, data.data(), data.size(), offset), offset);
+                } else if (choice == 3) {
+                    int written = fs.fs_write_async(file.inumber, data.data(), data.size(), offset).get();
+                    record_write(file, data, written, offset);
+                } else if (choice == 4) {
+                    fs.fs_reserve(file.inumber, offset);
+                } else if (choice == 5) {
+                    check_contents(&fs, file, "private file contents");
+                    fs.fs_seek_data(file.inumber, offset);
+                    fs.fs_seek_hole(file.inumber, offset);
+                } else if (choice == 6) {
+                    model_file &shared = common[rng() % common.size()];
+                    vector<char> read(shared.contents.size());
+                    int count = fs.fs_read_async(shared.inumber, read.data(), read.size(), 0).get();
+                    check(count == (int) read.size() && read == shared.contents, "common file contents");
+                } else if (choice == 7) {
+                    vector<int> created;
+                    fs.fs_create_many(3, created);
+                    check(fs.fs_delete_many(created) == (int) created.size(), "fs_delete_many of fresh inodes");
+                } else if (choice == 8) {
+                    check(fs.fs_delete(file.inumber) == 1, "fs_delete of a private file");
+                    file = files.back();
+                    files.pop_back();
+                } else {
+                    check_contents(&fs, file, "private file contents");
+                }
+            }
+
+            for (auto &file : files) {
+                check_contents(&fs, file, "private file contents at the end");
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    done = true;
+    syncer.join();
+
+    for (auto &file : common) {
+        check_contents(&fs, file, "common file contents at the end");
+    }
+
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Uma queda logo depois do fs_sync: as transações confirmadas só estão no
+// diário, e o fs_mount seguinte precisa reaplicá-las. A escrita em um arquivo
+// e a remoção de outro têm de sobreviver.
+static void journal_replay_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    vector<char> data(3 * Disk::DISK_BLOCK_SIZE + 100);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (char) (i * 13);
+    }
+    int kept, removed;
+
+    {
+        INE5412_FS fs(&disk);
+        fs.fs_format();
+        fs.fs_mount();
+        kept = fs.fs_create();
+        removed = fs.fs_create();
+        fs.fs_write(kept, data.data(), data.size(), 0);
+        fs.fs_write(removed, data.data(), data.size(), 0);
+        check(fs.fs_delete(removed) == 1, "fs_delete before the crash");
+        fs.fs_sync();
+        // Sem fs_unmount: o destrutor só encerra a thread de commit
+    }
+
+    INE5412_FS::fs_block super;
+    disk.read(0, super.data);
+    check(super.super.clean == 0, "image is not clean after a crash");
+
+    INE5412_FS fs(&disk);
+    check(fs.fs_mount() == 1, "mount replays the journal");
+    vector<char> read(data.size() + 1);
+    check(fs.fs_read(kept, read.data(), read.size(), 0) == (int) data.size() &&
+          equal(data.begin(), data.end(), read.begin()), "committed write survives a crash");
+    check(fs.fs_getsize(removed) == -1, "committed delete survives a crash");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Uma queda no checkpoint depois que o mapa de referências foi gravado no
+// lugar, mas antes que o superbloco avançasse o começo do diário: a
+// recuperação reaplica as transações já contidas no mapa. Três donos
+// compartilham os blocos, um é removido e o arquivo original é então
+// reescrito; o clone restante não pode mudar.
+static void crash_during_checkpoint_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    vector<char> original(2 * Disk::DISK_BLOCK_SIZE, 'A');
+    vector<char> changed(Disk::DISK_BLOCK_SIZE, 'B');
+    int source, clone, removed;
+
+    {
+        INE5412_FS fs(&disk);
+        fs.fs_format();
+        fs.fs_mount();
+        source = fs.fs_create();
+        fs.fs_write(source, original.data(), original.size(), 0);
+        clone = fs.fs_clone(source);
+        removed = fs.fs_clone(source);
+        check(clone > 0 && removed > 0, "fs_clone");
+        fs.fs_unmount();
+
+        fs.fs_mount();
+        check(fs.fs_delete(removed) == 1, "fs_delete of a clone");
+        fs.fs_sync();
+
+        // O superbloco de antes do checkpoint volta por cima do gravado nele
+        INE5412_FS::fs_block super;
+        disk.read(0, super.data);
+        fs.fs_unmount();
+        disk.write(0, super.data);
+    }
+
+    INE5412_FS fs(&disk);
+    check(fs.fs_mount() == 1, "mount replays the journal");
+    fs.fs_write(source, changed.data(), changed.size(), 0);
+
+    vector<char> data(original.size());
+    check(fs.fs_read(clone, data.data(), data.size(), 0) == (int) data.size() && data == original,
+          "clone keeps its data after recovery from a crash during a checkpoint");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// A cópia de um bloco indireto compartilhado dá um dono a mais a cada um
+// dos seus 1024 filhos, contadores demais para um registro do diário. A
+// escrita que faz a cópia é confirmada e o sistema cai: a recuperação
+// precisa aplicar a transação inteira.
+static void large_clone_replay_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 6000);
+    vector<char> original(1100 * Disk::DISK_BLOCK_SIZE);
+    for (size_t i = 0; i < original.size(); i++) {
+        original[i] = (char) (i / Disk::DISK_BLOCK_SIZE + i);
+    }
+    long long offset = 600LL * Disk::DISK_BLOCK_SIZE + 7;
+    int source, clone;
+
+    {
+        INE5412_FS fs(&disk);
+        fs.fs_format();
+        fs.fs_mount();
+        source = fs.fs_create();
+        fs.fs_write(source, original.data(), original.size(), 0);
+        clone = fs.fs_clone(source);
+        check(clone > 0, "fs_clone of a file past the indirect block");
+        fs.fs_write(clone, "x", 1, offset);
+        fs.fs_sync();
+        // Sem fs_unmount: o destrutor só encerra a thread de commit
+    }
+
+    INE5412_FS fs(&disk);
+    check(fs.fs_mount() == 1, "mount replays the journal");
+    vector<char> data(original.size());
+    check(fs.fs_read(clone, data.data(), data.size(), 0) == (int) data.size(), "fs_read of the clone");
+    check(data[offset] == 'x', "write to a clone survives a crash");
+    data[offset] = original[offset];
+    check(data == original, "rest of the clone is unchanged");
+    check(fs.fs_read(source, data.data(), data.size(), 0) == (int) data.size() && data == original,
+          "source keeps its data");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Com a deduplicação ligada, trabalhadores escrevem arquivos com poucos
+// conteúdos diferentes (cada bloco novo tende a ser ligado a um existente)
+// e removem os seus enquanto outros os ligam: um bloco liberado por uma
+// remoção não pode ter ganhado outro dono no caminho.
+static void dedup_stress_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 3000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+    fs.fs_dedup(true);
+
+    const int WORKERS = 8;
+    const int OPERATIONS = 400;
+    const int PATTERNS = 6;
+
+    vector<thread> workers;
+    for (int w = 0; w < WORKERS; w++) {
+        workers.emplace_back([&, w] {
+            mt19937 rng(w + 100);
+            vector<model_file> files;
+
+            for (int op = 0; op < OPERATIONS; op++) {
+                if (files.size() < 3 || (rng() % 3 && files.size() < 8)) {
+                    model_file file;
+                    file.inumber = fs.fs_create();
+                    vector<char> data((1 + rng() % 4) * Disk::DISK_BLOCK_SIZE);
+                    for (size_t b = 0; b < data.size() / Disk::DISK_BLOCK_SIZE; b++) {
+                        memset(data.data() + b * Disk::DISK_BLOCK_SIZE, 'a' + rng() % PATTERNS, Disk::DISK_BLOCK_SIZE);
+                    }
+                    record_write(file, data, fs.fs_write(file.inumber, data.data(), data.size(), 0), 0);
+                    check(file.contents.size() == data.size(), "fs_write with deduplication");
+                    files.push_back(file);
+                } else {
+                    size_t victim = rng() % files.size();
+                    check_contents(&fs, files[victim], "deduplicated file contents");
+                    check(fs.fs_delete(files[victim].inumber) == 1, "fs_delete of a deduplicated file");
+                    files[victim] = files.back();
+                    files.pop_back();
+                }
+            }
+
+            for (auto &file : files) {
+                check_contents(&fs, file, "deduplicated file contents at the end");
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Discos pequenos: o de 5 blocos não tem espaço nem para os mapas e não
+// pode ser formatado; o de 20 fica sem diário, mas com os blocos que sobram
+// para os dados
+static void small_format_test()
+{
+    remove(TEST_IMAGE);
+    {
+        Disk disk(TEST_IMAGE, 5);
+        INE5412_FS fs(&disk);
+        check(fs.fs_format() == 0, "fs_format refuses a disk with no data blocks");
+    }
+
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 20);
+    INE5412_FS fs(&disk);
+    check(fs.fs_format() == 1, "fs_format of a 20 block disk");
+
+    INE5412_FS::fs_block super;
+    disk.read(0, super.data);
+    const INE5412_FS::fs_superblock &sb = super.super;
+    int data_blocks = sb.nblocks - data_start(sb);
+    check(sb.njournalblocks == 0 && data_blocks == 14, "small disk keeps its blocks for data");
+
+    check(fs.fs_mount() == 1, "fs_mount of a disk without journal");
+    int inumber = fs.fs_create();
+    vector<char> data(data_blocks * Disk::DISK_BLOCK_SIZE, 'z');
+    check(fs.fs_write(inumber, data.data(), data.size(), 0) > 0, "fs_write on a small disk");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Padrão de bytes de um trecho que começa no bloco first: cada bloco tem o
+// seu, para que um bloco trocado ou deslocado não passe despercebido
+static vector<char> pattern(int first, int count)
+{
+    vector<char> data((size_t) count * Disk::DISK_BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (char) (i * 31 + (first + i / Disk::DISK_BLOCK_SIZE) * 7);
+    }
+    return data;
+}
+
+// readv/writev nas duas formas: um trecho contíguo e uma lista de pares
+// com blocos adjacentes (unidos numa só chamada) e soltos. O que volta, por
+// readv ou bloco a bloco, é o que foi gravado.
+static void vectored_io_test(Disk::disk_mode mode)
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 64, mode);
+
+    vector<char> run = pattern(10, 8), back(run.size());
+    disk.writev(10, 8, run.data());
+    disk.readv(10, 8, back.data());
+    check(back == run, "readv of a run written by writev");
+
+    int blocks[] = {20, 21, 22, 30, 40};
+    vector<vector<char>> written, read;
+    vector<pair<int, const char *>> writes;
+    vector<pair<int, char *>> reads;
+    for (int block : blocks) {
+        written.push_back(pattern(block, 1));
+        read.push_back(vector<char>(Disk::DISK_BLOCK_SIZE));
+    }
+    for (size_t i = 0; i < written.size(); i++) {
+        writes.push_back(make_pair(blocks[i], (const char *) written[i].data()));
+        reads.push_back(make_pair(blocks[i], read[i].data()));
+    }
+    disk.writev(writes);
+    disk.readv(reads);
+    check(read == written, "readv of a block list written by writev");
+
+    vector<char> single(Disk::DISK_BLOCK_SIZE);
+    disk.read(21, single.data());
+    check(single == written[1], "read of a block inside a merged run");
+    disk.read(13, single.data());
+    check(equal(single.begin(), single.end(), run.begin() + 3 * Disk::DISK_BLOCK_SIZE), "read of a block inside a writev run");
+}
+
+// Lotes assíncronos do disco (io_uring ou o pool de threads) e as
+// variantes assíncronas do fs_read/fs_write: um lote de escritas seguido de
+// um de leituras devolve os blocos gravados, e um arquivo escrito em pedaços
+// com fs_write_async é lido de volta com fs_read_async e fs_read.
+static void async_io_test(Disk::disk_mode mode)
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000, mode);
+
+    vector<char> written = pattern(1500, 6), read(written.size());
+    vector<Disk::io_request> writes, reads;
+    int blocks[] = {1500, 1501, 1502, 1600, 1700, 1701};
+    for (int i = 0; i < 6; i++) {
+        writes.push_back({blocks[i], written.data() + i * Disk::DISK_BLOCK_SIZE, true});
+        reads.push_back({blocks[i], read.data() + i * Disk::DISK_BLOCK_SIZE, false});
+    }
+    promise<void> written_done, read_done;
+    disk.submit(writes, [&] { written_done.set_value(); });
+    written_done.get_future().wait();
+    disk.submit(reads, [&] { read_done.set_value(); });
+    read_done.get_future().wait();
+    check(read == written, "async batch reads back an async batch of writes");
+
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+    int inumber = fs.fs_create();
+    // Escritas pendentes no mesmo bloco não são ordenadas entre si, então
+    // os pedaços começam em blocos diferentes
+    vector<char> data = pattern(0, 40);
+    data.resize(data.size() - 1000);
+    vector<future<int>> pending;
+    size_t chunk = 3 * Disk::DISK_BLOCK_SIZE;
+    for (size_t offset = 0; offset < data.size(); offset += chunk) {
+        int length = min(chunk, data.size() - offset);
+        pending.push_back(fs.fs_write_async(inumber, data.data() + offset, length, offset));
+    }
+    int total = 0;
+    for (auto &result : pending) {
+        total += result.get();
+    }
+    check(total == (int) data.size(), "fs_write_async writes every byte");
+
+    vector<char> back(data.size());
+    check(fs.fs_read_async(inumber, back.data(), back.size(), 0).get() == (int) back.size() && back == data,
+          "fs_read_async reads back fs_write_async");
+    fill(back.begin(), back.end(), 0);
+    check(fs.fs_read(inumber, back.data() + 1, back.size() - 1, 1) == (int) back.size() - 1 &&
+          equal(back.begin() + 1, back.end(), data.begin() + 1), "fs_read at an unaligned offset after async writes");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Uma escrita que chega entre a falta e o fill() (a leitura do backend é
+// feita sem o lock) vence: o fill devolve a cópia do cache e, se ela já foi
+// despejada, não insere a leitura velha
+static void block_cache_fill_test()
+{
+    vector<pair<int, vector<char>>> written_back;
+    Block_Cache cache(1, Disk::DISK_BLOCK_SIZE, Block_Cache::POLICY_LRU,
+                      [&](const vector<pair<int, const char *>> &blocks) {
+                          for (const auto &block : blocks) {
+                              written_back.push_back(make_pair(block.first, vector<char>(block.second, block.second + Disk::DISK_BLOCK_SIZE)));
+                          }
+                      });
+    vector<char> old_data = pattern(1, 1), new_data = pattern(2, 1), data(Disk::DISK_BLOCK_SIZE);
+
+    check(!cache.read(5, data.data(), true), "miss on an empty cache");
+    cache.write(5, new_data.data());
+    data = old_data;
+    cache.fill(5, data.data());
+    check(data == new_data, "fill returns a block written after the miss");
+    check(cache.read(5, data.data()) && data == new_data, "fill keeps a block written after the miss");
+
+    check(!cache.read(6, data.data(), true), "miss on a block not in the cache");
+    cache.write(6, new_data.data());
+    cache.write(7, new_data.data());
+    check(written_back.size() == 2 && written_back[1].first == 6, "writing another block evicts the only slot");
+    data = old_data;
+    cache.fill(6, data.data());
+    check(!cache.contains(6), "fill drops a read older than an evicted write");
+
+    check(!cache.read(8, data.data(), true), "miss before a fill with no concurrent write");
+    data = old_data;
+    cache.fill(8, data.data());
+    check(cache.read(8, data.data()) && data == old_data, "fill inserts a block nobody wrote");
+}
+
+// O modelo de latência é ligado, reconfigurado e desligado enquanto outras
+// threads fazem E/S; params() só vê um dos conjuntos de custos configurados,
+// e depois o modelo cobra exatamente o que o acesso custa
+static void model_toggle_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 64, Disk::MODE_PREAD);
+
+    Disk_Model::model_params slow, fast;
+    fast.seek_settle = 1;
+    fast.seek_per_block = 0;
+    fast.rotation = 2;
+    fast.transfer = 3;
+
+    atomic<bool> done{false};
+    vector<thread> workers;
+    for (int t = 0; t < 4; t++) {
+        workers.push_back(thread([&, t] {
+            vector<char> data = pattern(t, 1);
+            for (int i = 0; !done; i++) {
+                int block = (t * 16 + i) % 64;
+                if (i % 2) disk.write(block, data.data());
+                else disk.read(block, data.data());
+            }
+        }));
+    }
+
+    bool consistent = true;
+    for (int i = 0; i < 500; i++) {
+        disk.enable_model(i % 2 ? fast : slow);
+        Disk_Model *model = disk.get_model();
+        if (model) {
+            Disk_Model::model_params now = model->params();
+            consistent = consistent && (now.transfer == slow.transfer ? now.rotation == slow.rotation : now.rotation == fast.rotation);
+        }
+        if (i % 3 == 0) disk.disable_model();
+    }
+    done = true;
+    for (thread &worker : workers) worker.join();
+    check(consistent, "params() returns one of the configured cost sets");
+
+    vector<char> data = pattern(0, 3);
+    disk.writev(0, 3, data.data());
+    disk.enable_model(fast);
+    for (int block = 0; block < 3; block++) disk.read(block, data.data());
+    check(disk.get_model()->elapsed_us() == fast.seek_settle + fast.rotation + 3 * fast.transfer,
+          "the model charges one seek and three transfers after reconfiguring");
+    disk.disable_model();
+    check(!disk.get_model(), "no model after disable_model");
+}
+
+// Buracos na imagem: um bloco descartado é lido como zeros, também depois
+// de reabrir a imagem, que acha os buracos no arquivo
+static void hole_test(Disk::disk_mode mode)
+{
+    remove(TEST_IMAGE);
+    vector<char> zeros(Disk::DISK_BLOCK_SIZE, 0), data = pattern(7, 3), read(Disk::DISK_BLOCK_SIZE);
+    {
+        Disk disk(TEST_IMAGE, 64, mode);
+        check(disk.is_hole(7), "a new image is a hole");
+        disk.writev(7, 3, data.data());
+        check(!disk.is_hole(8), "a written block is not a hole");
+        disk.discard(8);
+        check(disk.is_hole(8), "a discarded block is a hole");
+        disk.read(8, read.data());
+        check(read == zeros, "a discarded block reads back as zeros");
+    }
+
+    Disk disk(TEST_IMAGE, 64, mode);
+    check(disk.is_hole(8) && !disk.is_hole(7) && !disk.is_hole(9), "holes found when the image is reopened");
+    disk.read(8, read.data());
+    check(read == zeros, "a discarded block reads back as zeros after reopening");
+    disk.read(9, read.data());
+    check(equal(read.begin(), read.end(), data.begin() + 2 * Disk::DISK_BLOCK_SIZE), "the block after the hole keeps its data");
+}
+
+// O intervalo nunca escrito de um arquivo é lido como zeros, e os blocos de
+// um arquivo removido voltam a ser buracos na imagem
+static void sparse_file_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    int inumber = fs.fs_create();
+    vector<char> data = pattern(0, 2);
+    long long offset = 5LL * Disk::DISK_BLOCK_SIZE + 100;
+    fs.fs_write(inumber, data.data(), data.size(), offset);
+
+    vector<char> read(offset + data.size());
+    check(fs.fs_read(inumber, read.data(), read.size(), 0) == (int) read.size(), "fs_read across a hole");
+    check(all_of(read.begin(), read.begin() + offset, [](char c) { return c == 0; }), "a hole in a file reads back as zeros");
+    check(equal(data.begin(), data.end(), read.begin() + offset), "data after a hole");
+    check(fs.fs_seek_data(inumber, 0) == 5LL * Disk::DISK_BLOCK_SIZE, "fs_seek_data skips the hole");
+
+    fs.fs_delete(inumber);
+    fs.fs_unmount();
+    check_bitmap(&disk);
+
+    INE5412_FS::fs_block super;
+    disk.read(0, super.data);
+    const INE5412_FS::fs_superblock &sb = super.super;
+    int holes = 0;
+    for (int block = data_start(sb); block < sb.nblocks; block++) {
+        holes += disk.is_hole(block);
+    }
+    check(holes == sb.nblocks - data_start(sb), "blocks freed by fs_delete are holes again");
+}
+
+// Mapa de blocos: a busca continua de onde a última alocação parou (um
+// bloco liberado atrás do cursor só volta depois de dar a volta), nunca
+// devolve os bits além do último bloco de uma palavra incompleta e mantém o
+// contador de livres; allocate_first sempre fica com o menor livre.
+static void bitmap_next_fit_test()
+{
+    Block_Bitmap bitmap;
+    bitmap.reset(130);
+    int count;
+
+    check(bitmap.allocate_run(1, &count) == 0 && bitmap.allocate_run(1, &count) == 1, "allocate_run starts at the beginning");
+    bitmap.clear(0);
+    check(bitmap.allocate_run(1, &count) == 2, "next fit continues after the last allocation");
+
+    for (int block = 3; block < 130; block++) {
+        bitmap.set(block);
+    }
+    check(bitmap.free_count() == 1, "free count after set");
+    check(bitmap.allocate_run(1, &count) == 0 && count == 1, "next fit wraps around to a freed block");
+    check(bitmap.allocate_run(1, &count) == -1 && count == 0 && bitmap.free_count() == 0,
+          "a full bitmap never hands out the bits past the last block");
+
+    bitmap.clear(129);
+    bitmap.clear(64);
+    bitmap.clear(5);
+    check(bitmap.allocate_first() == 5 && bitmap.allocate_first() == 64 && bitmap.allocate_first() == 129,
+          "allocate_first takes the lowest free block");
+
+    vector<uint64_t> image(4);
+    bitmap.clear(70);
+    bitmap.store(image);
+    Block_Bitmap loaded;
+    loaded.reset(130);
+    loaded.load(image);
+    check(loaded.free_count() == 1 && !loaded.test(70) && loaded.test(71), "store and load keep the bitmap");
+}
+
+// Inode gravado no disco (desmontado)
+static INE5412_FS::fs_inode disk_inode(Disk *disk, int inumber)
+{
+    INE5412_FS::fs_block block;
+    disk->read(1 + inumber / INE5412_FS::INODES_PER_BLOCK, block.data);
+    return block.inode[inumber % INE5412_FS::INODES_PER_BLOCK];
+}
+
+// Blocos de dados dos primeiros count blocos do arquivo (só diretos e
+// indireto simples), lidos do disco desmontado
+static vector<int> file_blocks(Disk *disk, int inumber, int count)
+{
+    INE5412_FS::fs_inode inode = disk_inode(disk, inumber);
+    vector<int> blocks(inode.direct, inode.direct + INE5412_FS::POINTERS_PER_INODE);
+    if (inode.indirect) {
+        INE5412_FS::fs_block indirect;
+        disk->read(inode.indirect, indirect.data);
+        blocks.insert(blocks.end(), indirect.pointers, indirect.pointers + INE5412_FS::POINTERS_PER_BLOCK);
+    }
+    blocks.resize(count);
+    return blocks;
+}
+
+// Alocação em trechos: allocate_run fica com um trecho do tamanho pedido
+// ou, sem nenhum, com o maior; fs_reserve cobre o arquivo com blocos
+// contíguos sem mudar o tamanho, e a escrita seguinte usa os mesmos blocos.
+static void run_allocation_test()
+{
+    Block_Bitmap bitmap;
+    bitmap.reset(100);
+    for (int block = 0; block < 100; block++) {
+        if (!(block >= 10 && block < 13) && !(block >= 20 && block < 30)) {
+            bitmap.set(block);
+        }
+    }
+    int count;
+    check(bitmap.allocate_run(5, &count) == 20 && count == 5, "allocate_run skips a run that is too short");
+    check(bitmap.allocate_run(8, &count) == 25 && count == 5, "allocate_run takes the longest run when none is long enough");
+    check(bitmap.allocate_run(8, &count) == 10 && count == 3, "allocate_run takes what is left");
+
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    const int BLOCKS = 12;
+    int inumber = fs.fs_create();
+    check(fs.fs_reserve(inumber, BLOCKS * Disk::DISK_BLOCK_SIZE) == BLOCKS * Disk::DISK_BLOCK_SIZE, "fs_reserve covers the range");
+    check(fs.fs_getsize(inumber) == 0, "fs_reserve keeps the file size");
+    fs.fs_unmount();
+
+    // O bloco indireto fica no trecho, entre os diretos e os seus filhos
+    vector<int> reserved = file_blocks(&disk, inumber, BLOCKS);
+    vector<int> layout = reserved;
+    layout.insert(layout.begin() + INE5412_FS::POINTERS_PER_INODE, disk_inode(&disk, inumber).indirect);
+    bool contiguous = layout[0] > 0;
+    for (size_t i = 1; i < layout.size(); i++) {
+        contiguous = contiguous && layout[i] == layout[i - 1] + 1;
+    }
+    check(contiguous, "fs_reserve allocates one contiguous run");
+
+    fs.fs_mount();
+    vector<char> data = pattern(0, BLOCKS);
+    fs.fs_write(inumber, data.data(), data.size(), 0);
+    fs.fs_unmount();
+    check(file_blocks(&disk, inumber, BLOCKS) == reserved, "fs_write fills the reserved blocks");
+    check_bitmap(&disk);
+}
+
+// Leituras ou gravações (metric "block_reads" ou "block_writes") dos blocos
+// [first, first + count) registradas pela instrumentação do disco desde o
+// último reset
+static long block_accesses(Disk *disk, const string &metric, int first, int count)
+{
+    stringstream csv;
+    disk->get_stats()->write_csv(csv);
+
+    long accesses = 0;
+    string line;
+    while (getline(csv, line)) {
+        int block;
+        long value;
+        if (sscanf(line.c_str(), (metric + ",%d,%ld").c_str(), &block, &value) == 2 && block >= first && block < first + count) {
+            accesses += value;
+        }
+    }
+    return accesses;
+}
+
+static long block_reads(Disk *disk, int first, int count)
+{
+    return block_accesses(disk, "block_reads", first, count);
+}
+
+// Montagem instantânea: depois de uma desmontagem correta os mapas
+// gravados são carregados sem ler a tabela de inodes. Depois de uma queda
+// num disco sem diário (pequeno demais para ter um), eles são reconstruídos
+// pela varredura dos inodes, mesmo com o mapa gravado destruído.
+static void clean_mount_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 30);
+    vector<char> first = pattern(0, 3), second = pattern(3, 2);
+    int a, b;
+    INE5412_FS::fs_block super;
+
+    {
+        INE5412_FS fs(&disk);
+        fs.fs_format();
+        fs.fs_mount();
+        a = fs.fs_create();
+        fs.fs_write(a, first.data(), first.size(), 0);
+        fs.fs_unmount();
+
+        disk.read(0, super.data);
+        check(super.super.clean == 1 && super.super.njournalblocks == 0, "clean flag set at unmount");
+
+        disk.get_stats()->reset();
+        check(fs.fs_mount() == 1, "mount of a clean disk");
+        check(block_reads(&disk, 1, super.super.ninodeblocks) == 0, "clean mount does not read the inode table");
+
+        b = fs.fs_create();
+        fs.fs_write(b, second.data(), second.size(), 0);
+        fs.fs_sync();
+        // Sem fs_unmount, como numa queda
+    }
+
+    disk.read(0, super.data);
+    check(super.super.clean == 0, "clean flag cleared while mounted");
+    vector<char> zeros(Disk::DISK_BLOCK_SIZE, 0);
+    disk.write(1 + super.super.ninodeblocks, zeros.data());
+
+    disk.get_stats()->reset();
+    INE5412_FS fs(&disk);
+    check(fs.fs_mount() == 1, "mount after a crash");
+    check(block_reads(&disk, 1, super.super.ninodeblocks) >= super.super.ninodeblocks, "unclean mount scans the inode table");
+
+    vector<char> read(first.size());
+    check(fs.fs_read(a, read.data(), read.size(), 0) == (int) first.size() && read == first, "file written before the clean unmount");
+    check(fs.fs_read(b, read.data(), read.size(), 0) == (int) second.size() &&
+          equal(second.begin(), second.end(), read.begin()), "file synced before the crash");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Caminho rápido das escritas de blocos inteiros: eles são gravados sem ser
+// lidos antes; numa escrita desalinhada só os blocos das pontas são lidos.
+// Os ponteiros alterados de um bloco indireto vão para o disco numa só
+// gravação dele, mesmo com centenas de blocos escritos por ele.
+static void streaming_write_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    INE5412_FS::fs_block super;
+    disk.read(0, super.data);
+    const INE5412_FS::fs_superblock &sb = super.super;
+    int first_data = data_start(sb), data_blocks = sb.nblocks - first_data;
+
+    int inumber = fs.fs_create();
+    vector<char> data = pattern(0, 300);
+    disk.get_stats()->reset();
+    check(fs.fs_write(inumber, data.data(), data.size(), 0) == (int) data.size(), "streaming write of 300 blocks");
+    check(block_reads(&disk, first_data, data_blocks) == 0, "full-block writes read no data block");
+
+    vector<char> middle = pattern(1000, 2);
+    disk.get_stats()->reset();
+    fs.fs_write(inumber, middle.data(), middle.size(), 100);
+    check(block_reads(&disk, first_data, data_blocks) == 2, "an unaligned write reads only its two edge blocks");
+    copy(middle.begin(), middle.end(), data.begin() + 100);
+
+    disk.get_stats()->reset();
+    fs.fs_unmount();
+    int indirect = disk_inode(&disk, inumber).indirect;
+    check(block_accesses(&disk, "block_writes", indirect, 1) == 1, "the indirect block is written once");
+
+    fs.fs_mount();
+    vector<char> read(data.size());
+    check(fs.fs_read(inumber, read.data(), read.size(), 0) == (int) read.size() && read == data, "streamed file contents");
+    fs.fs_unmount();
+}
+
+// Escritas de vários blocos inteiros (o caminho rápido do fs_write), com
+// as pontas desalinhadas, atravessando o começo do indireto, do duplo e do
+// triplo indireto. Os dois últimos ficam além de 2 GB e 4 GB, num arquivo
+// esparso: o tamanho de 64 bits e as árvores de ponteiros têm de sobreviver
+// a uma remontagem.
+static void large_file_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    const long long PER_BLOCK = INE5412_FS::POINTERS_PER_BLOCK;
+    long long boundaries[] = {INE5412_FS::POINTERS_PER_INODE, INE5412_FS::POINTERS_PER_INODE + PER_BLOCK,
+                              INE5412_FS::POINTERS_PER_INODE + PER_BLOCK + PER_BLOCK * PER_BLOCK};
+
+    int inumber = fs.fs_create();
+    vector<vector<char>> written;
+    vector<long long> offsets;
+    for (long long boundary : boundaries) {
+        offsets.push_back((boundary - 2) * Disk::DISK_BLOCK_SIZE + 100);
+        written.push_back(pattern(boundary, 4));
+        check(fs.fs_write(inumber, written.back().data(), written.back().size(), offsets.back()) == (int) written.back().size(),
+              "streaming write across a pointer level boundary");
+    }
+    // Um trecho no meio do duplo indireto, além de 2 GB
+    offsets.push_back(600LL * PER_BLOCK * Disk::DISK_BLOCK_SIZE + 1);
+    written.push_back(pattern(600, 3));
+    check(fs.fs_write(inumber, written.back().data(), written.back().size(), offsets.back()) == (int) written.back().size(),
+          "streaming write past 2 GB");
+
+    long long size = offsets[2] + written[2].size();
+    check(fs.fs_getsize(inumber) == size, "64-bit file size");
+
+    fs.fs_unmount();
+    check_bitmap(&disk);
+    fs.fs_mount();
+    check(fs.fs_getsize(inumber) == size, "64-bit file size after remount");
+    for (size_t i = 0; i < written.size(); i++) {
+        vector<char> read(written[i].size() + 2 * Disk::DISK_BLOCK_SIZE);
+        long long from = offsets[i] - Disk::DISK_BLOCK_SIZE;
+        int count = fs.fs_read(inumber, read.data(), read.size(), from);
+        check(count == (int) read.size() || from + count == size, "fs_read across a pointer level boundary");
+        check(equal(written[i].begin(), written[i].end(), read.begin() + Disk::DISK_BLOCK_SIZE), "data across a pointer level boundary");
+        check(all_of(read.begin(), read.begin() + Disk::DISK_BLOCK_SIZE, [](char c) { return c == 0; }), "hole before the data");
+    }
+    fs.fs_unmount();
+}
+
+// Leitura antecipada: leituras de um bloco em sequência trazem primeiro
+// READAHEAD_MIN blocos, e a janela dobra a cada leitura sequencial até
+// READAHEAD_MAX; as leituras dentro do que já veio não vão ao disco. Uma
+// leitura fora de sequência desliga a janela, que recomeça do mínimo.
+static void readahead_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    const int BLOCKS = 200;
+    int inumber = fs.fs_create();
+    vector<char> data = pattern(0, BLOCKS);
+    fs.fs_write(inumber, data.data(), data.size(), 0);
+    fs.fs_unmount();
+    vector<int> blocks = file_blocks(&disk, inumber, BLOCKS);
+    fs.fs_mount();
+
+    auto data_reads = [&] {
+        long reads = 0;
+        for (int block : blocks) {
+            reads += block_reads(&disk, block, 1);
+        }
+        return reads;
+    };
+    vector<char> read(Disk::DISK_BLOCK_SIZE);
+    auto read_block = [&](int block) {
+        fs.fs_read(inumber, read.data(), read.size(), (long long) block * Disk::DISK_BLOCK_SIZE);
+        check(equal(read.begin(), read.end(), data.begin() + (size_t) block * Disk::DISK_BLOCK_SIZE), "readahead contents");
+    };
+
+    disk.get_stats()->reset();
+    read_block(0);
+    check(data_reads() == INE5412_FS::READAHEAD_MIN, "first sequential read brings READAHEAD_MIN blocks");
+    for (int block = 1; block < INE5412_FS::READAHEAD_MIN; block++) {
+        read_block(block);
+    }
+    check(data_reads() == INE5412_FS::READAHEAD_MIN, "reads inside the window cost no I/O");
+
+    // A janela passou por 4, 8, 16 e 32 e chega a 64 na quinta leitura
+    read_block(INE5412_FS::READAHEAD_MIN);
+    long grown = INE5412_FS::READAHEAD_MIN + INE5412_FS::READAHEAD_MAX;
+    check(data_reads() == grown, "the window doubles up to READAHEAD_MAX");
+    for (int block = INE5412_FS::READAHEAD_MIN + 1; block < grown; block++) {
+        read_block(block);
+    }
+    check(data_reads() == grown, "reads inside the grown window cost no I/O");
+
+    read_block(150);
+    check(data_reads() == grown + 1, "a non-sequential read turns readahead off");
+    read_block(151);
+    check(data_reads() == grown + 1 + INE5412_FS::READAHEAD_MIN, "the window restarts at READAHEAD_MIN");
+    fs.fs_unmount();
+}
+
+// Mapa de inodes livres: fs_create fica com o menor inode livre, também
+// depois de uma remontagem (o mapa é persistido), e devolve 0 com a tabela
+// cheia
+static void inode_map_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 200);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    vector<int> created;
+    for (int i = 0; i < 10; i++) {
+        created.push_back(fs.fs_create());
+    }
+    check(created.front() == 1 && created.back() == 10, "fs_create hands out inodes in order");
+    fs.fs_delete(4);
+    fs.fs_delete(7);
+    check(fs.fs_create() == 4, "fs_create reuses the lowest free inode");
+    fs.fs_unmount();
+
+    fs.fs_mount();
+    check(fs.fs_create() == 7, "the free inode map survives a remount");
+    check(fs.fs_create() == 11, "fs_create continues after the used inodes");
+
+    INE5412_FS::fs_block super;
+    disk.read(0, super.data);
+    vector<int> rest;
+    fs.fs_create_many(super.super.ninodes, rest);
+    check((int) rest.size() == super.super.ninodes - 12, "fs_create_many stops when the table is full");
+    check(fs.fs_create() == 0, "fs_create fails on a full inode table");
+    fs.fs_unmount();
+}
+
+// Criação e remoção em lote: fs_delete_many remove todos os inodes da lista
+// e o fs_create_many seguinte volta a usar os mesmos números
+static void batch_create_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 200);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    vector<int> first, second;
+    check(fs.fs_create_many(100, first) == 100 && first.size() == 100, "fs_create_many of 100 inodes");
+    vector<char> data = pattern(0, 1);
+    for (int inumber : first) {
+        check(fs.fs_getsize(inumber) == 0, "inode created by fs_create_many is valid");
+    }
+    fs.fs_write(first[50], data.data(), data.size(), 0);
+
+    check(fs.fs_delete_many(first) == 100, "fs_delete_many of 100 inodes");
+    for (int inumber : first) {
+        check(fs.fs_getsize(inumber) == -1, "inode removed by fs_delete_many");
+    }
+
+    check(fs.fs_create_many(100, second) == 100, "fs_create_many after fs_delete_many");
+    sort(first.begin(), first.end());
+    sort(second.begin(), second.end());
+    check(first == second, "fs_create_many reuses the deleted inodes");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+// Arquivos pequenos no inode: até INLINE_BYTES bytes os dados ficam no
+// próprio inode, sem bloco de dados; o byte seguinte promove o arquivo,
+// que passa a usar blocos com o conteúdo anterior preservado
+static void inline_file_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 200);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    const int LIMIT = INE5412_FS::INLINE_BYTES;
+    vector<char> data(LIMIT + 1);
+    for (int i = 0; i <= LIMIT; i++) {
+        data[i] = (char) ('a' + i % 26);
+    }
+    int kept = fs.fs_create(), promoted = fs.fs_create(), whole = fs.fs_create();
+    check(fs.fs_write(kept, data.data(), LIMIT, 0) == LIMIT, "fs_write of INLINE_BYTES bytes");
+    check(fs.fs_reserve(kept, LIMIT) == LIMIT, "fs_reserve within the inline limit");
+    fs.fs_write(promoted, data.data(), LIMIT, 0);
+    fs.fs_write(promoted, data.data() + LIMIT, 1, LIMIT);
+    fs.fs_write(whole, data.data(), LIMIT + 1, 0);
+    fs.fs_unmount();
+
+    INE5412_FS::fs_inode inode = disk_inode(&disk, kept);
+    check((inode.flags & INE5412_FS::INODE_INLINE) && inode.size == LIMIT && !memcmp(inode.direct, data.data(), LIMIT),
+          "48 bytes stay inside the inode");
+    inode = disk_inode(&disk, promoted);
+    check(!(inode.flags & INE5412_FS::INODE_INLINE) && inode.size == LIMIT + 1 && inode.direct[0], "the 49th byte promotes the file");
+    inode = disk_inode(&disk, whole);
+    check(!(inode.flags & INE5412_FS::INODE_INLINE) && inode.direct[0], "a 49 byte write goes to a block");
+    check_bitmap(&disk);
+
+    fs.fs_mount();
+    vector<char> read(LIMIT + 2);
+    disk.get_stats()->reset();
+    check(fs.fs_read(kept, read.data(), read.size(), 0) == LIMIT && equal(read.begin(), read.begin() + LIMIT, data.begin()),
+          "inline contents");
+    INE5412_FS::fs_block super;
+    disk.read(0, super.data);
+    int first_data = data_start(super.super);
+    check(block_reads(&disk, first_data, super.super.nblocks - first_data) == 0, "an inline read touches no data block");
+    check(fs.fs_read(promoted, read.data(), read.size(), 0) == LIMIT + 1 && equal(data.begin(), data.end(), read.begin()),
+          "promoted file keeps its contents");
+    check(fs.fs_read(whole, read.data(), read.size(), 0) == LIMIT + 1 && equal(data.begin(), data.end(), read.begin()),
+          "49 byte file contents");
+    fs.fs_unmount();
+}
+
+// Hash dos nomes nos diretórios (FNV-1a de 32 bits), como no INE5412_FS
+static unsigned int fnv1a(const string &name)
+{
+    unsigned int hash = 2166136261u;
+    for (unsigned char byte : name) {
+        hash = (hash ^ byte) * 16777619u;
+    }
+    return hash;
+}
+
+// Diretórios: 1000 nomes enchem e dividem baldes e dobram o índice, e
+// todos continuam achados, também depois de remover metade e remontar. Com
+// 64 nomes de hash iguais nos 16 bits baixos, o balde se divide até o
+// índice chegar ao tamanho máximo e o último nome não cabe; o resto do
+// diretório continua valendo.
+static void directory_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+
+    const int NAMES = 1000;
+    int dir = fs.fs_mkdir("/d");
+    vector<int> inumbers;
+    for (int i = 0; i < NAMES; i++) {
+        inumbers.push_back(fs.fs_create_path("/d/f" + to_string(i)));
+    }
+    check(count(inumbers.begin(), inumbers.end(), 0) == 0, "fs_create_path of 1000 names");
+    int found = 0;
+    for (int i = 0; i < NAMES; i++) {
+        found += fs.fs_lookup("/d/f" + to_string(i)) == inumbers[i];
+    }
+    check(found == NAMES, "fs_lookup finds every name after the splits");
+
+    for (int i = 0; i < NAMES; i += 2) {
+        check(fs.fs_unlink("/d/f" + to_string(i)) == 1, "fs_unlink");
+    }
+    fs.fs_unmount();
+
+    INE5412_FS::fs_inode inode = disk_inode(&disk, dir);
+    check(inode.entries == NAMES / 2 && inode.buckets * INE5412_FS::DIR_BUCKET_ENTRIES >= NAMES && inode.depth >= 4,
+          "buckets split and the index doubled");
+
+    fs.fs_mount();
+    found = 0;
+    for (int i = 0; i < NAMES; i++) {
+        found += fs.fs_lookup("/d/f" + to_string(i)) == (i % 2 ? inumbers[i] : 0);
+    }
+    check(found == NAMES, "names after fs_unlink and a remount");
+    vector<tuple<string, int, bool>> entries;
+    fs.fs_readdir("/d", entries);
+    check((int) entries.size() == NAMES / 2, "fs_readdir lists the remaining names");
+
+    // Nomes que caem no mesmo balde qualquer que seja o tamanho do índice
+    int overflow = fs.fs_mkdir("/o");
+    unsigned int mask = (1u << INE5412_FS::DIR_MAX_DEPTH) - 1;
+    unsigned int target = fnv1a("x0") & mask;
+    vector<string> colliding;
+    for (int i = 0; (int) colliding.size() <= INE5412_FS::DIR_BUCKET_ENTRIES; i++) {
+        string name = "x" + to_string(i);
+        if ((fnv1a(name) & mask) == target) {
+            colliding.push_back(name);
+        }
+    }
+    int created = 0;
+    for (int i = 0; i < INE5412_FS::DIR_BUCKET_ENTRIES; i++) {
+        created += fs.fs_create_path("/o/" + colliding[i]) > 0;
+    }
+    check(created == INE5412_FS::DIR_BUCKET_ENTRIES, "a full bucket of colliding names");
+    check(fs.fs_create_path("/o/" + colliding.back()) == 0, "a name that overflows a bucket at the maximum depth is refused");
+    check(fs.fs_lookup("/o/" + colliding.front()) > 0 && fs.fs_lookup("/o/" + colliding.back()) == 0,
+          "the overflowing directory keeps its names");
+    check(fs.fs_create_path("/o/other") > 0, "other buckets still take names");
+    fs.fs_unmount();
+
+    check(disk_inode(&disk, overflow).depth == INE5412_FS::DIR_MAX_DEPTH, "the index grew to the maximum depth");
+    check_bitmap(&disk);
+}
+
+// Deduplicação: um arquivo escrito com os mesmos blocos de outro passa a
+// apontar para os blocos dele; remover um dos dois não tira os blocos do
+// outro, e alterar uma cópia compartilhada não muda as demais
+static void dedup_test()
+{
+    remove(TEST_IMAGE);
+    Disk disk(TEST_IMAGE, 2000);
+    INE5412_FS fs(&disk);
+    fs.fs_format();
+    fs.fs_mount();
+    check(fs.fs_dedup(true) == 1, "fs_dedup on a version 7 disk");
+
+    vector<char> data = pattern(0, 3), other = pattern(10, 1), read(data.size());
+    int first = fs.fs_create(), second = fs.fs_create(), third = fs.fs_create();
+    fs.fs_write(first, data.data(), data.size(), 0);
+    fs.fs_write(second, data.data(), data.size(), 0);
+    fs.fs_write(third, other.data(), other.size(), 0);
+    fs.fs_write(third, data.data(), Disk::DISK_BLOCK_SIZE, Disk::DISK_BLOCK_SIZE);
+    fs.fs_unmount();
+
+    vector<int> shared = file_blocks(&disk, first, 3);
+    check(file_blocks(&disk, second, 3) == shared, "a duplicate write shares the existing blocks");
+    vector<int> mixed = file_blocks(&disk, third, 2);
+    check(mixed[0] != shared[0] && mixed[1] == shared[0], "only identical blocks are shared");
+    check_bitmap(&disk);
+
+    fs.fs_mount();
+    check(fs.fs_delete(first) == 1, "fs_delete of one copy");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+
+    fs.fs_mount();
+    check(fs.fs_read(second, read.data(), read.size(), 0) == (int) read.size() && read == data, "the other copy keeps its data");
+
+    // O primeiro bloco ainda é do terceiro arquivo: a escrita fica numa cópia
+    fs.fs_write(second, other.data(), other.size(), 0);
+    check(fs.fs_read(third, read.data(), 2 * Disk::DISK_BLOCK_SIZE, 0) == 2 * Disk::DISK_BLOCK_SIZE &&
+          equal(other.begin(), other.end(), read.begin()) && equal(data.begin(), data.begin() + Disk::DISK_BLOCK_SIZE, read.begin() + Disk::DISK_BLOCK_SIZE),
+          "a write to a shared block leaves the other owners alone");
+    fs.fs_unmount();
+    check_bitmap(&disk);
+}
+
+static void run(const string &name, const function<void()> &test)
+{
+    int before = failures;
+    test();
+    cout << name << ": " << (failures == before ? "ok" : "FAILED") << "\n";
+}
+
+int main()
+{
+    Disk::disk_mode modes[] = {Disk::MODE_STDIO, Disk::MODE_PREAD, Disk::MODE_MMAP};
+
+    for (Disk::disk_mode mode : modes) {
+        run("vectored I/O (" + string(Disk::mode_name(mode)) + ")", [&] { vectored_io_test(mode); });
+        run("async I/O (" + string(Disk::mode_name(mode)) + ")", [&] { async_io_test(mode); });
+        run("holes (" + string(Disk::mode_name(mode)) + ")", [&] { hole_test(mode); });
+    }
+
+    run("block cache fill", block_cache_fill_test);
+    run("latency model toggle", model_toggle_test);
+    run("bitmap next fit", bitmap_next_fit_test);
+    run("run allocation", run_allocation_test);
+
+    for (Disk::disk_mode mode : modes) {
+        run("stress test (" + string(Disk::mode_name(mode)) + ")", [&] { stress_test(mode); });
+    }
+    run("sparse file", sparse_file_test);
+    run("clean mount", clean_mount_test);
+    run("streaming write", streaming_write_test);
+    run("readahead", readahead_test);
+    run("large file", large_file_test);
+    run("free inode map", inode_map_test);
+    run("batch create and delete", batch_create_test);
+    run("inline files", inline_file_test);
+    run("directories", directory_test);
+    run("deduplication", dedup_test);
+    run("journal replay", journal_replay_test);
+    run("crash during checkpoint", crash_during_checkpoint_test);
+    run("large clone replay", large_clone_replay_test);
+    run("dedup stress test", dedup_stress_test);
+    run("small disk format", small_format_test);
+
+    remove(TEST_IMAGE);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,240 @@
+#include "journal.h"
+#include <cstring>
+#include <cstddef>
+
+void Journal::transaction::add(const void *header, int header_size, const void *payload, int payload_size)
+{
+	int size = header_size + payload_size;
+	size_t at = records.size();
+
+	records.resize(at + sizeof(size) + size);
+	memcpy(&records[at], &size, sizeof(size));
+	memcpy(&records[at + sizeof(size)], header, header_size);
+	if(payload_size > 0) {
+		memcpy(&records[at + sizeof(size) + header_size], payload, payload_size);
+	}
+}
+
+bool Journal::transaction::empty()
+{
+	return records.empty();
+}
+
+Journal::Journal(Disk *d, int start, int nblocks, int head, int sequence)
+{
+	disk = d;
+	this->start = start;
+	this->nblocks = nblocks;
+	first = nblocks > 0 ? head % nblocks : 0;
+	first_sequence = sequence;
+}
+
+int Journal::max_record()
+{
+	return Disk::DISK_BLOCK_SIZE - sizeof(block_header) - sizeof(int);
+}
+
+// Cada registro vai com o seu tamanho na frente; o tamanho 0 fecha a transação
+void Journal::submit(transaction *txn)
+{
+	if(txn->empty()) {
+		return;
+	}
+
+	int end = 0;
+	lock_guard<mutex> guard(append_lock);
+	pending.insert(pending.end(), txn->records.begin(), txn->records.end());
+	pending.insert(pending.end(), (const char *) &end, (const char *) &end + sizeof(end));
+	txn->records.clear();
+}
+
+size_t Journal::pending_bytes()
+{
+	lock_guard<mutex> guard(append_lock);
+	return pending.size();
+}
+
+bool Journal::commit()
+{
+	lock_guard<mutex> commit_guard(commit_lock);
+
+	// As operações continuam enfileirando num buffer novo durante a gravação
+	vector<char> records;
+	{
+		lock_guard<mutex> guard(append_lock);
+		records.swap(pending);
+	}
+	if(records.empty()) {
+		return true;
+	}
+
+	vector<char> blocks;
+	bool packed = pack(records, &blocks);
+	int count = blocks.size() / Disk::DISK_BLOCK_SIZE;
+
+	if(!packed || count > nblocks - used) {
+		// Devolve as transações, antes das que chegaram nesse meio tempo
+		lock_guard<mutex> guard(append_lock);
+		records.insert(records.end(), pending.begin(), pending.end());
+		pending.swap(records);
+		return false;
+	}
+
+	// Numera os blocos a partir do fim da parte viva, que pode dar a volta
+	// na área; os trechos contíguos vão numa só requisição
+	vector<pair<int, const char *>> writes;
+	for(int i = 0; i < count; i++) {
+		char *block = blocks.data() + (size_t) i * Disk::DISK_BLOCK_SIZE;
+		block_header header;
+
+		memcpy(&header, block, sizeof(header));
+		header.sequence = first_sequence + used + i;
+		memcpy(block, &header, sizeof(header));
+		header.checksum = checksum(block);
+		memcpy(block, &header, sizeof(header));
+
+		writes.push_back(make_pair(start + (first + used + i) % nblocks, (const char *) block));
+	}
+
+	disk->sync();
+	disk->writev(writes);
+	disk->sync();
+
+	used += count;
+	return true;
+}
+
+void Journal::checkpointed()
+{
+	lock_guard<mutex> commit_guard(commit_lock);
+	lock_guard<mutex> guard(append_lock);
+
+	pending.clear();
+	first = (first + used) % nblocks;
+	first_sequence += used;
+	used = 0;
+}
+
+int Journal::replay(const function<void(const char *record, int size)> &apply)
+{
+	lock_guard<mutex> commit_guard(commit_lock);
+
+	vector<char> area((size_t) nblocks * Disk::DISK_BLOCK_SIZE);
+	disk->readv(start, nblocks, area.data());
+
+	// Registros da transação em curso, aplicados quando ela termina
+	vector<pair<const char *, int>> current;
+	int applied = 0;
+	int valid;
+	bool broken = false;
+
+	for(valid = 0; valid < nblocks && !broken; valid++) {
+		const char *block = area.data() + (size_t) ((first + valid) % nblocks) * Disk::DISK_BLOCK_SIZE;
+		block_header header;
+		memcpy(&header, block, sizeof(header));
+
+		if(header.magic != JOURNAL_MAGIC || header.sequence != first_sequence + valid ||
+		   header.used < 0 || header.used > Disk::DISK_BLOCK_SIZE - (int) sizeof(header) ||
+		   header.checksum != checksum(block)) {
+			break;
+		}
+
+		const char *cursor = block + sizeof(header);
+		const char *end = cursor + header.used;
+		while(cursor + sizeof(int) <= end) {
+			int size;
+			memcpy(&size, cursor, sizeof(size));
+			cursor += sizeof(size);
+
+			if(size == 0) {
+				for(auto &record : current) {
+					apply(record.first, record.second);
+				}
+				current.clear();
+				applied++;
+			} else if(size < 0 || size > end - cursor) {
+				broken = true;
+				break;
+			} else {
+				current.push_back(make_pair(cursor, size));
+				cursor += size;
+			}
+		}
+	}
+
+	// Um commit interrompido pode ter deixado blocos válidos depois do
+	// primeiro inválido. Como a parte viva nunca passa de nblocks blocos, os
+	// números seguintes aos aplicados mais nblocks não aparecem em nenhum.
+	first = (first + valid) % nblocks;
+	first_sequence += valid + nblocks;
+	used = 0;
+
+	return applied;
+}
+
+int Journal::head()
+{
+	return first;
+}
+
+int Journal::sequence()
+{
+	return first_sequence;
+}
+
+int Journal::capacity()
+{
+	return nblocks;
+}
+
+int Journal::live_blocks()
+{
+	lock_guard<mutex> commit_guard(commit_lock);
+	return used;
+}
+
+// FNV-1a do bloco inteiro, com o campo da soma contado como zero
+unsigned int Journal::checksum(const char *block)
+{
+	unsigned int hash = 2166136261u;
+	size_t field = offsetof(block_header, checksum);
+
+	for(size_t i = 0; i < Disk::DISK_BLOCK_SIZE; i++) {
+		unsigned char byte = (i >= field && i < field + sizeof(unsigned int)) ? 0 : block[i];
+		hash = (hash ^ byte) * 16777619u;
+	}
+	return hash;
+}
+
+// Distribui os registros em blocos zerados, com o cabeçalho no começo de
+// cada um; um registro que não cabe no resto do bloco vai para o próximo.
+// Retorna false se algum registro for maior que max_record(): ele não
+// caberia em bloco nenhum e a recuperação descartaria a sua transação.
+bool Journal::pack(const vector<char> &records, vector<char> *blocks)
+{
+	int capacity = Disk::DISK_BLOCK_SIZE - sizeof(block_header);
+	block_header header = {JOURNAL_MAGIC, 0, 0, 0};
+	size_t cursor = 0;
+
+	while(cursor < records.size()) {
+		int size;
+		memcpy(&size, &records[cursor], sizeof(size));
+		int entry = sizeof(size) + size;
+		if(entry > capacity) {
+			return false;
+		}
+
+		if(blocks->empty() || header.used + entry > capacity) {
+			blocks->resize(blocks->size() + Disk::DISK_BLOCK_SIZE, 0);
+			header.used = 0;
+		}
+
+		char *block = blocks->data() + blocks->size() - Disk::DISK_BLOCK_SIZE;
+		memcpy(block + sizeof(header) + header.used, &records[cursor], entry);
+		header.used += entry;
+		memcpy(block, &header, sizeof(header));
+
+		cursor += entry;
+	}
+	return true;
+}
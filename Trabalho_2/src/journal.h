@@ -0,0 +1,98 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "disk.h"
+#include <vector>
+#include <functional>
+#include <mutex>
+
+using namespace std;
+
+// Diário de metadados (write-ahead log) numa área fixa e circular do disco.
+// Cada operação monta uma transação de registros lógicos, opacos para o
+// diário, que é acrescentada a um buffer em memória; commit() grava numa só
+// requisição sequencial tudo o que se acumulou desde o último commit, então
+// várias operações são confirmadas juntas. Depois que o sistema de arquivos
+// grava os metadados no lugar (checkpoint), o diário volta a ficar vazio.
+//
+// Cada bloco do diário começa com um cabeçalho com número de sequência e
+// soma de verificação; os registros não atravessam blocos e uma transação
+// termina com um registro vazio. Na recuperação só as transações completas
+// de blocos válidos e consecutivos são aplicadas.
+class Journal
+{
+public:
+    static const unsigned int JOURNAL_MAGIC = 0x4a524e4c;
+
+    // Registros de uma operação, aplicados juntos (ou não) na recuperação
+    class transaction {
+        public:
+            vector<char> records;
+
+            // Acrescenta um registro formado por um cabeçalho e uma carga
+            void add(const void *header, int header_size, const void *payload, int payload_size);
+            bool empty();
+    };
+
+    // Área de nblocks blocos a partir de start; head e sequence dizem onde
+    // começa a parte viva do diário e o número do seu primeiro bloco
+    Journal(Disk *d, int start, int nblocks, int head, int sequence);
+
+    // Maior registro (cabeçalho mais carga) que cabe num bloco
+    static int max_record();
+
+    // Enfileira a transação para o próximo commit e a esvazia
+    void submit(transaction *txn);
+    size_t pending_bytes();
+
+    // Grava as transações enfileiradas depois de esvaziar a cache do disco,
+    // para que os dados escritos pelas operações cheguem antes dos
+    // registros que os referenciam. Retorna false, sem gravar nada, se elas
+    // não couberem no espaço livre ou se um registro for maior que
+    // max_record(): o chamador deve fazer um checkpoint.
+    bool commit();
+
+    // Os metadados foram gravados no lugar: o diário fica vazio e as
+    // transações enfileiradas são descartadas
+    void checkpointed();
+
+    // Aplica, em ordem, os registros das transações completas gravadas a
+    // partir de head. Os blocos seguintes passam a ser ignorados: o diário
+    // continua depois deles com uma sequência que nenhum deles tem.
+    // Retorna o número de transações aplicadas.
+    int replay(const function<void(const char *record, int size)> &apply);
+
+    int head();
+    int sequence();
+    int capacity();
+    int live_blocks();
+
+private:
+    class block_header {
+        public:
+            unsigned int magic;
+            int sequence;
+            int used;           // bytes de registros depois do cabeçalho
+            unsigned int checksum;
+    };
+
+    static unsigned int checksum(const char *block);
+    bool pack(const vector<char> &records, vector<char> *blocks);
+
+private:
+    Disk *disk;
+    int start;
+    int nblocks;
+
+    // commit_lock serializa commits e checkpoints e protege a posição do
+    // diário; append_lock (tomada depois) protege só o buffer de transações
+    mutex commit_lock;
+    mutex append_lock;
+    vector<char> pending;
+
+    int first = 0;          // posição do primeiro bloco vivo
+    int first_sequence = 1; // e o seu número de sequência
+    int used = 0;           // blocos vivos, gravados desde o último checkpoint
+};
+
+#endif
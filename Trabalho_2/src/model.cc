@@ -0,0 +1,83 @@
+#include "model.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+Disk_Model::Disk_Model(const model_params &params)
+{
+	costs = params;
+}
+
+// Sob um só lock: nenhuma cobrança vê o tempo zerado com os custos antigos
+void Disk_Model::configure(const model_params &params)
+{
+	lock_guard<mutex> guard(lock);
+
+	costs = params;
+	head = -1;
+	accesses = sequential = blocks = 0;
+	seek_us = rotation_us = transfer_us = 0;
+}
+
+void Disk_Model::charge(int blocknum, int count)
+{
+	lock_guard<mutex> guard(lock);
+
+	accesses++;
+	blocks += count;
+
+	if(blocknum == head) {
+		sequential++;
+	} else {
+		long distance = head < 0 ? blocknum : labs((long) blocknum - head);
+		seek_us += costs.seek_settle + costs.seek_per_block * distance;
+		rotation_us += costs.rotation;
+	}
+
+	transfer_us += costs.transfer * count;
+	head = blocknum + count;
+}
+
+void Disk_Model::reset()
+{
+	lock_guard<mutex> guard(lock);
+
+	head = -1;
+	accesses = sequential = blocks = 0;
+	seek_us = rotation_us = transfer_us = 0;
+}
+
+double Disk_Model::elapsed_us()
+{
+	lock_guard<mutex> guard(lock);
+	return seek_us + rotation_us + transfer_us;
+}
+
+Disk_Model::model_params Disk_Model::params()
+{
+	lock_guard<mutex> guard(lock);
+	return costs;
+}
+
+void Disk_Model::print(ostream &out)
+{
+	lock_guard<mutex> guard(lock);
+
+	double total = seek_us + rotation_us + transfer_us;
+	out << "modeled device time: " << total / 1000 << " ms\n";
+	out << "    " << accesses << " accesses (" << sequential << " sequential), " << blocks << " blocks\n";
+	out << "    seek: " << seek_us / 1000 << " ms\n";
+	out << "    rotation: " << rotation_us / 1000 << " ms\n";
+	out << "    transfer: " << transfer_us / 1000 << " ms\n";
+}
+
+bool Disk_Model::parse_params(const char *text, model_params *params)
+{
+	model_params parsed;
+	if(sscanf(text, "%lf:%lf:%lf:%lf", &parsed.seek_settle, &parsed.seek_per_block, &parsed.rotation, &parsed.transfer) != 4) 
+		return false;
+	if(parsed.seek_settle < 0 || parsed.seek_per_block < 0 || parsed.rotation < 0 || parsed.transfer < 0) 
+		return false;
+
+	*params = parsed;
+	return true;
+}
@@ -0,0 +1,55 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+
+// Modelo de custo de um disco mecânico. Cada acesso físico é cobrado em
+// tempo virtual (nada é de fato esperado): um acesso que não continua de
+// onde o anterior parou paga o posicionamento do braço, proporcional à
+// distância em blocos, mais a latência rotacional; todo bloco paga o
+// tempo de transferência.
+class Disk_Model
+{
+public:
+    // Custos em microssegundos
+    class model_params {
+        public:
+            double seek_settle = 500;      // custo fixo de qualquer seek
+            double seek_per_block = 10;    // custo por bloco de distância
+            double rotation = 4170;        // meia volta a 7200 rpm
+            double transfer = 30;          // um bloco de 4 KiB a ~130 MB/s
+    };
+
+    Disk_Model(const model_params &params);
+
+    // Troca os custos e zera o tempo acumulado
+    void configure(const model_params &params);
+    // Cobra o acesso a count blocos consecutivos a partir de blocknum
+    void charge(int blocknum, int count);
+    void reset();
+    void print(ostream &out);
+
+    double elapsed_us();
+    model_params params();
+
+    // Formato "settle:por_bloco:rotação:transferência", em microssegundos
+    static bool parse_params(const char *text, model_params *params);
+
+private:
+    model_params costs;
+
+    int head = -1;            // bloco seguinte ao último acesso
+    long accesses = 0;
+    long sequential = 0;
+    long blocks = 0;
+    double seek_us = 0;
+    double rotation_us = 0;
+    double transfer_us = 0;
+
+    mutex lock;
+};
+
+#endif
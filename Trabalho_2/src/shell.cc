@@ -8,6 +8,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 class File_Ops
 {
@@ -280,26 +282,72 @@ namespace GRAPHIC_INTERFACE {
     }
 }  // namespace GRAPHIC_INTERFACE
 
+// Um argumento que começa com "/" é um caminho, resolvido nos diretórios;
+// os demais são números de inode. Retorna 0 para um caminho inexistente.
+static int inode_argument(INE5412_FS &fs, const char *arg)
+{
+	if(arg[0] != '/') 
+		return atoi(arg);
+
+	int inumber = fs.fs_lookup(arg);
+	if(!inumber) {
+		cout << "no such file or directory: " << arg << "\n";
+	}
+	return inumber;
+}
+
+static void usage(const char *program)
+{
+	cout << "use: " << program << " [-m stdio|pread|mmap] [-c <blocks>[:lru|:clock]] <diskfile> <nblocks>\n";
+}
+
 int main( int argc, char *argv[] )
 {
 	char line[1024];
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	int inumber, args;
+	long long result;
+
+	Disk::disk_mode mode = Disk::MODE_PREAD;
+	Block_Cache::cache_policy policy = Block_Cache::POLICY_LRU;
+	int cache_blocks = 0;
+	char policy_name[16];
+	int opt;
+
+	while((opt = getopt(argc, argv, "m:c:")) != -1) {
+		if(opt == 'm' && Disk::parse_mode(optarg, &mode)) 
+			continue;
+		if(opt == 'c') {
+			args = sscanf(optarg, "%d:%15s", &cache_blocks, policy_name);
+			if(args == 1 || (args == 2 && Block_Cache::parse_policy(policy_name, &policy))) 
+				continue;
+		}
+		usage(argv[0]);
+		return 1;
+	}
 
-	if(argc != 3) {
-		cout << "use: " << argv[0] << " <diskfile> <nblocks>\n";
+	if(argc - optind != 2) {
+		usage(argv[0]);
 		return 1;
 	}
 
 
-    Disk disk(argv[1], atoi(argv[2]));
+    Disk disk(argv[optind], atoi(argv[optind + 1]), mode);
+
+	if(cache_blocks > 0) {
+		if(disk.enable_cache(cache_blocks, policy)) {
+			cout << "block cache: " << cache_blocks << " blocks (" << Block_Cache::policy_name(policy) << ")\n";
+		} else {
+			cout << "block cache not available in " << Disk::mode_name(disk.get_mode()) << " mode\n";
+		}
+	}
 
     INE5412_FS fs(&disk);
 	std::thread sfmlThread(std::bind(GRAPHIC_INTERFACE::run, &fs));
 
-	cout << "opened emulated disk image " << argv[1] << " with " << disk.size() << " blocks\n";
+	cout << "opened emulated disk image " << argv[optind] << " with " << disk.size() << " blocks (" << Disk::mode_name(disk.get_mode()) << ")\n";
 
 	while(1) {
 		cout << " simplefs> ";
@@ -344,32 +392,55 @@ int main( int argc, char *argv[] )
 			} else {
 				cout << "use: debug\n";
 			}
+		} else if(!strcmp(cmd, "unmount")) {
+			if(args == 1) {
+				if(fs.fs_unmount()) {
+					cout << "disk unmounted.\n";
+				} else {
+					cout << "unmount failed!\n";
+				}
+			} else {
+				cout << "use: unmount\n";
+			}
+		} else if(!strcmp(cmd, "sync")) {
+			if(args == 1) {
+				fs.fs_sync();
+				cout << "disk synced\n";
+			} else {
+				cout << "use: sync\n";
+			}
 		} else if(!strcmp(cmd, "getsize")) {
 			if(args == 2) {
-				inumber = atoi(arg1);
-				result = fs.fs_getsize(inumber);
+				inumber = inode_argument(fs, arg1);
+				result = inumber ? fs.fs_getsize(inumber) : -1;
 				if(result >= 0) {
 					cout << "inode " << inumber << " has size " << result << "\n";
 				} else {
 					cout << "getsize failed!\n";
 				}
 			} else {
-				cout << "use: getsize <inumber>\n";
+				cout << "use: getsize <inumber | path>\n";
 			}
 			
 		} else if(!strcmp(cmd, "create")) {
-			if(args == 1) {
-				inumber = fs.fs_create();
+			if(args == 1 || (args == 2 && arg1[0] == '/')) {
+				inumber = args == 1 ? fs.fs_create() : fs.fs_create_path(arg1);
 				if(inumber > 0) {
 					cout << "created inode " << inumber << "\n";
 				} else {
 					cout << "create failed!\n";
 				}
 			} else {
-				cout << "use: create\n";
+				cout << "use: create [path]\n";
 			}
 		} else if(!strcmp(cmd, "delete")) {
-			if(args == 2) {
+			if(args == 2 && arg1[0] == '/') {
+				if(fs.fs_unlink(arg1)) {
+					cout << arg1 << " deleted.\n";
+				} else {
+					cout << "delete failed!\n";
+				}
+			} else if(args == 2) {
 				inumber = atoi(arg1);
 				if(fs.fs_delete(inumber)) {
 					cout << "inode " << inumber << " deleted.\n";
@@ -377,52 +448,212 @@ int main( int argc, char *argv[] )
 					cout << "delete failed!\n";	
 				}
 			} else {
-				cout << "use: delete <inumber>\n";
+				cout << "use: delete <inumber | path>\n";
+			}
+		} else if(!strcmp(cmd, "clone")) {
+			if(args == 2) {
+				inumber = inode_argument(fs, arg1);
+				result = inumber ? fs.fs_clone(inumber) : 0;
+				if(result > 0) {
+					cout << "created inode " << result << " as a clone of inode " << inumber << "\n";
+				} else {
+					cout << "clone failed!\n";
+				}
+			} else {
+				cout << "use: clone <inode | path>\n";
+			}
+		} else if(!strcmp(cmd, "mkdir")) {
+			if(args == 2) {
+				inumber = fs.fs_mkdir(arg1);
+				if(inumber > 0) {
+					cout << "created directory " << arg1 << " (inode " << inumber << ")\n";
+				} else {
+					cout << "mkdir failed!\n";
+				}
+			} else {
+				cout << "use: mkdir <path>\n";
+			}
+		} else if(!strcmp(cmd, "rmdir")) {
+			if(args == 2) {
+				if(fs.fs_rmdir(arg1)) {
+					cout << "directory " << arg1 << " removed.\n";
+				} else {
+					cout << "rmdir failed!\n";
+				}
+			} else {
+				cout << "use: rmdir <path>\n";
+			}
+		} else if(!strcmp(cmd, "ls")) {
+			if(args <= 2) {
+				vector<tuple<string, int, bool>> entries;
+				if(fs.fs_readdir(args == 2 ? arg1 : "/", entries)) {
+					sort(entries.begin(), entries.end());
+					for(auto &entry : entries) {
+						cout << "    " << get<0>(entry) << (get<2>(entry) ? "/" : "") << "  inode " << get<1>(entry);
+						if(!get<2>(entry)) {
+							cout << "  " << fs.fs_getsize(get<1>(entry)) << " bytes";
+						}
+						cout << "\n";
+					}
+					cout << entries.size() << " entries\n";
+				} else {
+					cout << "ls failed!\n";
+				}
+			} else {
+				cout << "use: ls [path]\n";
+			}
+		} else if(!strcmp(cmd, "lookup")) {
+			if(args == 2) {
+				inumber = fs.fs_lookup(arg1);
+				if(inumber > 0) {
+					cout << arg1 << " is inode " << inumber << "\n";
+				} else {
+					cout << "no such file or directory: " << arg1 << "\n";
+				}
+			} else {
+				cout << "use: lookup <path>\n";
+			}
+		} else if(!strcmp(cmd, "createmany")) {
+			if(args == 2 && atoi(arg1) > 0) {
+				vector<int> inumbers;
+				if(fs.fs_create_many(atoi(arg1), inumbers) > 0) {
+					cout << "created " << inumbers.size() << " inodes (first " << inumbers.front() << ", last " << inumbers.back() << ")\n";
+				} else {
+					cout << "create failed!\n";
+				}
+			} else {
+				cout << "use: createmany <count>\n";
+			}
+		} else if(!strcmp(cmd, "deletemany")) {
+			if(args == 3 && atoi(arg1) <= atoi(arg2)) {
+				vector<int> inumbers;
+				for(inumber = atoi(arg1); inumber <= atoi(arg2); inumber++) {
+					inumbers.push_back(inumber);
+				}
+				cout << fs.fs_delete_many(inumbers) << " inodes deleted.\n";
+			} else {
+				cout << "use: deletemany <first inumber> <last inumber>\n";
 			}
 		} else if(!strcmp(cmd, "cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
-				if(!File_Ops::do_copyout(inumber, "/dev/stdout", &fs)) {
+				inumber = inode_argument(fs, arg1);
+				if(!inumber || !File_Ops::do_copyout(inumber, "/dev/stdout", &fs)) {
 					cout << "cat failed!\n";
 				}
 			} else {
-				cout << "use: cat <inumber>\n";
+				cout << "use: cat <inumber | path>\n";
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				inumber = atoi(arg2);
-				if(File_Ops::do_copyin(arg1, inumber, &fs)) {
+				// Um caminho que ainda não existe é criado
+				inumber = arg2[0] == '/' ? fs.fs_lookup(arg2) : atoi(arg2);
+				if(!inumber && arg2[0] == '/') {
+					inumber = fs.fs_create_path(arg2);
+				}
+				if(inumber && File_Ops::do_copyin(arg1, inumber, &fs)) {
 					cout << "copied file " << arg1 << " to inode " << inumber << "\n";
 				} else {
 					cout << "copy failed!\n";
 				}
 			} else {
-				cout << "use: copyin <filename> <inumber>\n";
+				cout << "use: copyin <filename> <inumber | path>\n";
 			}
 
 		} else if(!strcmp(cmd, "copyout")) {
 			if(args == 3) {
-				inumber = atoi(arg1);
-				if(File_Ops::do_copyout(inumber, arg2, &fs)) {
+				inumber = inode_argument(fs, arg1);
+				if(inumber && File_Ops::do_copyout(inumber, arg2, &fs)) {
 					cout << "copied inode " << inumber << " to file " << arg2 << "\n";
 				} else {
 					cout << "copy failed!\n";
 				}
 			} else {
-				cout << "use: copyout <inumber> <filename>\n";
+				cout << "use: copyout <inumber | path> <filename>\n";
+			}
+
+		} else if(!strcmp(cmd, "stats")) {
+			if(args == 1) {
+				disk.get_stats()->print(cout);
+			} else if(args == 2 && !strcmp(arg1, "reset")) {
+				disk.get_stats()->reset();
+				cout << "disk statistics reset.\n";
+			} else if(args == 3 && (!strcmp(arg1, "csv") || !strcmp(arg1, "json"))) {
+				ofstream out(arg2);
+				if(!out) {
+					cout << "couldn't open " << arg2 << "\n";
+				} else {
+					if(!strcmp(arg1, "csv")) {
+						disk.get_stats()->write_csv(out);
+					} else {
+						disk.get_stats()->write_json(out);
+					}
+					cout << "disk statistics written to " << arg2 << "\n";
+				}
+			} else {
+				cout << "use: stats [reset | csv <file> | json <file>]\n";
+			}
+
+		} else if(!strcmp(cmd, "model")) {
+			Disk_Model::model_params params;
+			if(args == 1) {
+				if(disk.get_model()) {
+					disk.get_model()->print(cout);
+				} else {
+					cout << "latency model is off.\n";
+				}
+			} else if(!strcmp(arg1, "on") && (args == 2 || (args == 3 && Disk_Model::parse_params(arg2, &params)))) {
+				disk.enable_model(params);
+				cout << "latency model on.\n";
+			} else if(args == 2 && !strcmp(arg1, "off")) {
+				disk.disable_model();
+				cout << "latency model off.\n";
+			} else if(args == 2 && !strcmp(arg1, "reset") && disk.get_model()) {
+				disk.get_model()->reset();
+				cout << "latency model reset.\n";
+			} else {
+				cout << "use: model [on [settle:per_block:rotation:transfer] | off | reset]\n";
+			}
+
+		} else if(!strcmp(cmd, "dedup")) {
+			if(args == 1) {
+				fs.fs_dedup_print(cout);
+			} else if(args == 2 && (!strcmp(arg1, "on") || !strcmp(arg1, "off"))) {
+				bool enabled = !strcmp(arg1, "on");
+				if(fs.fs_dedup(enabled)) {
+					cout << "deduplication " << arg1 << ".\n";
+				} else {
+					cout << "dedup failed!\n";
+				}
+			} else if(args == 2 && !strcmp(arg1, "reset")) {
+				fs.fs_dedup_reset();
+				cout << "deduplication statistics reset.\n";
+			} else {
+				cout << "use: dedup [on | off | reset]\n";
 			}
 
 		} else if(!strcmp(cmd, "help")) {
 			cout << "Commands are:\n";
 			cout << "    format\n";
 			cout << "    mount\n";
+			cout << "    unmount\n";
 			cout << "    debug\n";
-			cout << "    create\n";
-			cout << "    delete  <inode>\n";
-			cout << "    cat     <inode>\n";
-			cout << "    copyin  <file> <inode>\n";
-			cout << "    copyout <inode> <file>\n";
+			cout << "    sync\n";
+			cout << "    create  [path]\n";
+			cout << "    delete  <inode | path>\n";
+			cout << "    clone   <inode | path>\n";
+			cout << "    createmany <count>\n";
+			cout << "    deletemany <first inode> <last inode>\n";
+			cout << "    mkdir   <path>\n";
+			cout << "    rmdir   <path>\n";
+			cout << "    ls      [path]\n";
+			cout << "    lookup  <path>\n";
+			cout << "    cat     <inode | path>\n";
+			cout << "    copyin  <file> <inode | path>\n";
+			cout << "    copyout <inode | path> <file>\n";
+			cout << "    stats   [reset | csv <file> | json <file>]\n";
+			cout << "    model   [on [settle:per_block:rotation:transfer] | off | reset]\n";
+			cout << "    dedup   [on | off | reset]\n";
 			cout << "    help\n";
 			cout << "    quit\n";
 			cout << "    exit\n";
@@ -441,6 +672,14 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	// Desmonta o disco, se montado, para que o próximo mount não precise
+	// varrer a tabela de inodes
+	if(fs.get_mounted()) {
+		fs.fs_unmount();
+	} else {
+		fs.fs_sync();
+	}
+
 	cout << "closing emulated disk.\n";
 	disk.close();
 
@@ -450,7 +689,8 @@ int main( int argc, char *argv[] )
 int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 {
 	FILE *file;
-	int offset=0, result, actual;
+	long long offset=0;
+	int result, actual;
 	char buffer[16384];
 
 	file = fopen(filename, "r");
@@ -459,6 +699,13 @@ int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 		return 0;
 	}
 
+	// Com o tamanho do arquivo conhecido, reserva os blocos de uma vez para
+	// que fiquem contíguos no disco
+	struct stat info;
+	if(fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		fs->fs_reserve(inumber, info.st_size);
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result <= 0) break;
@@ -486,7 +733,8 @@ int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 {
 	FILE *file;
-	int offset = 0, result;
+	long long offset = 0;
+	int result;
 	char buffer[16384];
 
 	file = fopen(filename,"w");
@@ -495,13 +743,34 @@ int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 		return 0;
 	}
 
+	// Num arquivo regular os buracos do inode são pulados com fseek, e o
+	// arquivo de saída fica esparso também; em /dev/stdout os zeros são escritos
+	struct stat info;
+	bool sparse = fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode);
+	long long size = fs->fs_getsize(inumber);
+	int length = sizeof(buffer);
+
 	while(1) {
-		result = fs->fs_read(inumber,buffer,sizeof(buffer),offset);
+		if(sparse) {
+			long long data = fs->fs_seek_data(inumber, offset);
+			if(data < 0) break;
+			offset = data;
+			length = min((long long) sizeof(buffer), fs->fs_seek_hole(inumber, offset) - offset);
+			fseeko(file, offset, SEEK_SET);
+		}
+
+		result = fs->fs_read(inumber,buffer,length,offset);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
 	}
 
+	if(sparse && size > offset) {
+		fflush(file);
+		ftruncate(fileno(file), size);
+		offset = size;
+	}
+
 	cout << offset << " bytes copied\n";
 
 	fclose(file);
@@ -0,0 +1,154 @@
+#include "stats.h"
+#include <algorithm>
+#include <stdlib.h>
+
+Disk_Stats::Disk_Stats(int nblocks)
+{
+	block_reads.resize(max(nblocks, 0), 0);
+	block_writes.resize(max(nblocks, 0), 0);
+}
+
+void Disk_Stats::record_latency(bool is_write, long nanoseconds)
+{
+	lock_guard<mutex> guard(lock);
+	(is_write ? write_latency : read_latency).add(nanoseconds);
+}
+
+void Disk_Stats::record_access(bool is_write, int blocknum, int count)
+{
+	lock_guard<mutex> guard(lock);
+
+	if(last_block >= 0) {
+		seek_distance.add(labs((long) blocknum - last_block));
+	}
+	last_block = blocknum + count - 1;
+
+	vector<long> &heat = is_write ? block_writes : block_reads;
+	for(int i = 0; i < count; i++) {
+		if(blocknum + i < (int) heat.size()) heat[blocknum + i]++;
+	}
+}
+
+void Disk_Stats::reset()
+{
+	lock_guard<mutex> guard(lock);
+
+	read_latency = histogram();
+	write_latency = histogram();
+	seek_distance = histogram();
+	fill(block_reads.begin(), block_reads.end(), 0);
+	fill(block_writes.begin(), block_writes.end(), 0);
+	last_block = -1;
+}
+
+void Disk_Stats::histogram::add(long value)
+{
+	int bucket = 0;
+	while(value >= bucket_high(bucket) && bucket < HISTOGRAM_BUCKETS - 1) {
+		bucket++;
+	}
+	buckets[bucket]++;
+	samples++;
+	total += value;
+}
+
+long Disk_Stats::histogram::bucket_low(int bucket)
+{
+	return bucket == 0 ? 0 : 1L << (bucket - 1);
+}
+
+long Disk_Stats::histogram::bucket_high(int bucket)
+{
+	return 1L << bucket;
+}
+
+void Disk_Stats::print_histogram(ostream &out, const char *name, const char *unit, histogram &h)
+{
+	out << name << ": " << h.samples << " samples";
+	if(h.samples) {
+		out << ", mean " << h.total / h.samples << " " << unit;
+	}
+	out << "\n";
+
+	for(int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		if(h.buckets[b]) {
+			out << "    [" << histogram::bucket_low(b) << ", " << histogram::bucket_high(b) << ") " << unit << ": " << h.buckets[b] << "\n";
+		}
+	}
+}
+
+// Resumo legível: histogramas e os blocos mais acessados
+void Disk_Stats::print(ostream &out)
+{
+	lock_guard<mutex> guard(lock);
+
+	print_histogram(out, "read latency", "ns", read_latency);
+	print_histogram(out, "write latency", "ns", write_latency);
+	print_histogram(out, "seek distance", "blocks", seek_distance);
+
+	vector<int> hottest;
+	for(size_t b = 0; b < block_reads.size(); b++) {
+		if(block_reads[b] + block_writes[b]) hottest.push_back(b);
+	}
+	stable_sort(hottest.begin(), hottest.end(), [this](int a, int b) {
+		return block_reads[a] + block_writes[a] > block_reads[b] + block_writes[b];
+	});
+	if(hottest.size() > 10) hottest.resize(10);
+
+	out << "hottest blocks:\n";
+	for(int b : hottest) {
+		out << "    block " << b << ": " << block_reads[b] << " reads, " << block_writes[b] << " writes\n";
+	}
+}
+
+// Formato longo: metric,key,value (key é o início do balde ou o número do bloco)
+void Disk_Stats::write_csv(ostream &out)
+{
+	lock_guard<mutex> guard(lock);
+
+	out << "metric,key,value\n";
+
+	const char *names[] = { "read_latency_ns", "write_latency_ns", "seek_distance" };
+	histogram *histograms[] = { &read_latency, &write_latency, &seek_distance };
+	for(int i = 0; i < 3; i++) {
+		for(int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			if(histograms[i]->buckets[b]) {
+				out << names[i] << "," << histogram::bucket_low(b) << "," << histograms[i]->buckets[b] << "\n";
+			}
+		}
+	}
+
+	for(size_t b = 0; b < block_reads.size(); b++) {
+		if(block_reads[b]) out << "block_reads," << b << "," << block_reads[b] << "\n";
+		if(block_writes[b]) out << "block_writes," << b << "," << block_writes[b] << "\n";
+	}
+}
+
+void Disk_Stats::write_json(ostream &out)
+{
+	lock_guard<mutex> guard(lock);
+
+	const char *names[] = { "read_latency_ns", "write_latency_ns", "seek_distance" };
+	histogram *histograms[] = { &read_latency, &write_latency, &seek_distance };
+
+	out << "{\n";
+	for(int i = 0; i < 3; i++) {
+		out << "  \"" << names[i] << "\": [";
+		bool first = true;
+		for(int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			if(!histograms[i]->buckets[b]) continue;
+			out << (first ? "" : ", ") << "{\"min\": " << histogram::bucket_low(b) << ", \"max\": " << histogram::bucket_high(b) << ", \"count\": " << histograms[i]->buckets[b] << "}";
+			first = false;
+		}
+		out << "],\n";
+	}
+
+	out << "  \"blocks\": [";
+	bool first = true;
+	for(size_t b = 0; b < block_reads.size(); b++) {
+		if(!block_reads[b] && !block_writes[b]) continue;
+		out << (first ? "" : ",") << "\n    {\"block\": " << b << ", \"reads\": " << block_reads[b] << ", \"writes\": " << block_writes[b] << "}";
+		first = false;
+	}
+	out << "\n  ]\n}\n";
+}
@@ -0,0 +1,58 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <iostream>
+#include <vector>
+#include <mutex>
+
+using namespace std;
+
+// Instrumentação dos acessos ao disco: histogramas de latência de leitura
+// e escrita, distância entre blocos acessados em sequência (aproximação
+// do custo de seek) e contagem de acessos por bloco.
+class Disk_Stats
+{
+public:
+    // Histograma em escala log2: o balde 0 guarda o valor 0 e o balde b
+    // guarda os valores em [2^(b-1), 2^b)
+    static const int HISTOGRAM_BUCKETS = 48;
+
+    Disk_Stats(int nblocks);
+
+    // Registra o acesso a count blocos consecutivos
+    void record_access(bool is_write, int blocknum, int count);
+    // Registra a duração de uma operação
+    void record_latency(bool is_write, long nanoseconds);
+    void reset();
+
+    void print(ostream &out);
+    void write_csv(ostream &out);
+    void write_json(ostream &out);
+
+private:
+    class histogram {
+        public:
+            long buckets[HISTOGRAM_BUCKETS] = {};
+            long samples = 0;
+            long total = 0;
+
+            void add(long value);
+            static long bucket_low(int bucket);
+            static long bucket_high(int bucket);
+    };
+
+    void print_histogram(ostream &out, const char *name, const char *unit, histogram &h);
+
+private:
+    histogram read_latency;
+    histogram write_latency;
+    histogram seek_distance;
+
+    vector<long> block_reads;
+    vector<long> block_writes;
+    int last_block = -1;
+
+    mutex lock;
+};
+
+#endif